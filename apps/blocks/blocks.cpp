@@ -85,11 +85,11 @@ extern "C" void main(int argc, char** argv){
 
         static unsigned long prev_timeout = 0;
         if (prev_timeout == 0){
-            const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000/kFrameRate);
+            const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000/kFrameRate, nullptr);
             prev_timeout = timeout.value;
         } else {
             prev_timeout += 1000/ kFrameRate;
-            SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+            SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout, nullptr);
         }
 
         AppEvent events[1];
@@ -0,0 +1,87 @@
+// パイプの転送速度を測る
+//   pipebench w <MiB> [chunk] | pipebench r [chunk]
+//   pipebench s <MiB> | pipebench r [chunk]
+// 書き手は指定した量のデータをchunkバイトずつ標準出力へ書き、読み手は標準入力を読み切るまでの時間を表示する
+// sはSyscallSpliceでページ境界に揃えた64KiBずつ書き、ページをコピーせずに渡す
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "../syscall.h"
+
+namespace{
+    const size_t kMaxChunk = 1024; // SyscallPutStringで一度に書ける上限
+    char buf[kMaxChunk];
+    const size_t kSpliceChunk = 16 * 4096;
+    alignas(4096) char splice_buf[kSpliceChunk];
+
+    // argv[index]の正の整数。省略されていればdefault_value。0以下なら終了する
+    size_t PositiveArg(int argc, char** argv, int index, size_t default_value){
+        if (argc <= index){
+            return default_value;
+        }
+        const int v = atoi(argv[index]);
+        if (v <= 0){
+            fprintf(stderr, "%s: invalid argument: %s\n", argv[0], argv[index]);
+            exit(1);
+        }
+        return v;
+    }
+
+    size_t ChunkArg(int argc, char** argv, int index){
+        return std::min(PositiveArg(argc, argv, index, kMaxChunk), kMaxChunk);
+    }
+}
+
+extern "C" void main(int argc, char** argv){
+    if (argc < 2 || (strcmp(argv[1], "w") != 0 && strcmp(argv[1], "s") != 0 && strcmp(argv[1], "r") != 0)){
+        fprintf(stderr, "Usage: %s w <MiB> [chunk] | %s s <MiB> | %s r [chunk]\n", argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+
+    if (argv[1][0] == 's'){
+        const size_t total = PositiveArg(argc, argv, 2, 16) * 1024 * 1024;
+        memset(splice_buf, 'x', sizeof(splice_buf));
+        for (size_t sent = 0; sent < total; ){
+            const size_t n = std::min(kSpliceChunk, total - sent);
+            if (SyscallSplice(1, splice_buf, n).error){
+                exit(1);
+            }
+            sent += n;
+        }
+        exit(0);
+    }
+
+    if (argv[1][0] == 'w'){
+        const size_t total = PositiveArg(argc, argv, 2, 16) * 1024 * 1024;
+        const size_t chunk = ChunkArg(argc, argv, 3);
+        memset(buf, 'x', sizeof(buf));
+        for (size_t sent = 0; sent < total; ){
+            const size_t n = std::min(chunk, total - sent);
+            if (write(1, buf, n) < 0){
+                exit(1);
+            }
+            sent += n;
+        }
+        exit(0);
+    }
+
+    const size_t chunk = ChunkArg(argc, argv, 2);
+    auto [tick_start, timer_freq] = SyscallGetCurrentTick();
+    size_t total = 0, reads = 0;
+    while (true){
+        const ssize_t n = read(0, buf, chunk);
+        if (n <= 0){
+            break;
+        }
+        total += n;
+        ++reads;
+    }
+    const auto tick_end = SyscallGetCurrentTick().value;
+
+    const unsigned long elapsed_ms = std::max<unsigned long>((tick_end - tick_start) * 1000 / timer_freq, 1);
+    printf("%lu bytes in %lu ms (%lu reads): %lu KiB/s\n",
+           total, elapsed_ms, reads, total * 1000 / 1024 / elapsed_ms);
+    exit(0);
+}
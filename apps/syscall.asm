@@ -25,4 +25,16 @@ define_syscall CreateTimer,      0x8000000b
 define_syscall OpenFile,         0x8000000c
 define_syscall ReadFile,         0x8000000d
 define_syscall DemandPages,      0x8000000e
-define_syscall MapFile,          0x8000000f
\ No newline at end of file
+define_syscall MapFile,          0x8000000f
+define_syscall CancelTimer,      0x80000010
+define_syscall GetTaskStats,     0x80000011
+define_syscall FutexWait,        0x80000012
+define_syscall FutexWake,        0x80000013
+define_syscall PollCtl,          0x80000014
+define_syscall PollWait,         0x80000015
+define_syscall Splice,           0x80000016
+define_syscall OpenSharedMemory, 0x80000017
+define_syscall MapSharedMemory,  0x80000018
+define_syscall UnmapSharedMemory, 0x80000019
+define_syscall IoRingSetup,      0x8000001a
+define_syscall IoRingEnter,      0x8000001b
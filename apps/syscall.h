@@ -10,6 +10,9 @@ extern "C"{
 
     #include "../kernel/logger.hpp"
     #include "../kernel/app_event.hpp"
+    #include "../kernel/task_stat.hpp"
+    #include "../kernel/poll_event.hpp"
+    #include "../kernel/io_ring.hpp"
 
     struct SyscallResult{
         uint64_t value;
@@ -32,11 +35,41 @@ extern "C"{
 
     #define TIMER_ONESHOT_REL 1
     #define TIMER_ONESHOT_ABS 0
-    struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value, unsigned long timeout_ms);
+    // handleにNULL以外を指定すると、SyscallCancelTimerで使うタイマーの識別子が格納される
+    struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value, unsigned long timeout_ms, uint64_t* handle);
     struct SyscallResult SyscallOpenFile(const char* path, int flags);
     struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
     struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
     struct SyscallResult SyscallMapFile(int fd, size_t* file_size, int flags);
+    struct SyscallResult SyscallCancelTimer(uint64_t handle);
+    // valueには全タスク数が返る。statsには先頭からlen個までが書き込まれる
+    struct SyscallResult SyscallGetTaskStats(struct TaskStat* stats, size_t len);
+    // *addrがexpectedなら、SyscallFutexWakeされるまで眠る。timeout_msが0なら無期限
+    // error: 値が異なればEAGAIN、時間切れならETIMEDOUT
+    struct SyscallResult SyscallFutexWait(const uint32_t* addr, uint32_t expected, unsigned long timeout_ms);
+    // addrで待っているタスクを最大n個起こす。valueは起こした数
+    struct SyscallResult SyscallFutexWake(const uint32_t* addr, int n);
+    // opはPOLL_CTL_*。fdにPOLL_FD_EVENTSを指定するとアプリのイベントを待てる
+    // エッジトリガなので、報告された対象は読み切ってから再び待つこと
+    struct SyscallResult SyscallPollCtl(int op, int fd, uint32_t events, uint64_t data);
+    // 準備のできた対象を最大max個eventsに書き、valueにその数を返す
+    // timeout_msが負なら無期限に待ち、0なら待たずに戻る。時間切れならvalueは0
+    struct SyscallResult SyscallPollWait(struct PollEvent* events, size_t max, long timeout_ms);
+    // bufからlenバイトをfdへ書く。fdがパイプなら、ページ境界に揃ったページはコピーせずに渡す
+    // 渡したページは次に書き込んだときにコピーされるので、書き込み後もbufは自由に使ってよい
+    struct SyscallResult SyscallSplice(int fd, const void* buf, size_t len);
+    // 名前付きの共有メモリを開き、valueにファイルディスクリプタを返す
+    // flagsにO_CREATを指定すると、なければsizeバイト（4KiB単位に切り上げ）で作る
+    struct SyscallResult SyscallOpenSharedMemory(const char* name, size_t size, int flags);
+    // 共有メモリの全体をマップし、valueに先頭アドレス、*sizeに大きさを返す
+    struct SyscallResult SyscallMapSharedMemory(int fd, size_t* size);
+    // SyscallMapSharedMemoryが返したアドレスのマップを外す
+    struct SyscallResult SyscallUnmapSharedMemory(void* addr);
+    // entries個（2のべき乗に切り上げ）の要素を持つリングを作ってマップし、valueに先頭のstruct IoRing*を返す
+    struct SyscallResult SyscallIoRingSetup(size_t entries);
+    // 投入リングから最大to_submit個を順に実行し、結果を完了リングに書く。valueは実行した数
+    // 完了リングが満杯になるとそこで止まる
+    struct SyscallResult SyscallIoRingEnter(size_t to_submit);
 
     #ifdef __cplusplus
 }
@@ -10,7 +10,7 @@ extern "C" void main(int argc, char** argv){
     }
 
     const unsigned long duration_ms = atoi(argv[1]);
-    const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, duration_ms);
+    const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, duration_ms, nullptr);
     printf("timer created. timeout = %lu\n", timeout.value);
 
     AppEvent events[1];
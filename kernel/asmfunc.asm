@@ -16,6 +16,32 @@ IoIn32:
     in eax, dx
     ret
 
+global IoOut16 ; void IoOut16(uint16_t addr, uint16_t data);
+IoOut16:
+    mov dx, di
+    mov ax, si
+    out dx, ax
+    ret
+
+global IoIn16 ; uint16_t IoIn16(uint16_t addr);
+IoIn16:
+    mov dx, di
+    in ax, dx
+    ret
+
+global IoOut8 ; void IoOut8(uint16_t addr, uint8_t data);
+IoOut8:
+    mov dx, di
+    mov ax, si
+    out dx, al
+    ret
+
+global IoIn8 ; uint8_t IoIn8(uint16_t addr);
+IoIn8:
+    mov dx, di
+    in al, dx
+    ret
+
 global GetCS ; uint16_t GetCS(void);
 GetCS:
     xor eax, eax ;clears upper 32 bits of rax
@@ -98,6 +124,13 @@ GetCR3:
     mov rax, cr3
     ret
 
+global ReadTSC  ; uint64_t ReadTSC();
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -147,8 +180,6 @@ SwitchContext:
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
-
 global RestoreContext
 RestoreContext:
     ;iret用のスタックフレーム
@@ -158,15 +189,17 @@ RestoreContext:
     push qword [rdi + 0x20] ;CS
     push qword [rdi + 0x08] ;RIP
 
-    ;コンテキストの復帰
-    fxrstor [rdi + 0xc0]
-
+    ;コンテキストの復帰（FPUの状態は#NMで遅延して復帰する）
     mov rax, [rdi + 0x00]
     mov cr3, rax
     mov rax, [rdi + 0x30]
     mov fs, ax
-    mov rax, [rdi + 0x38]
-    mov gs, ax
+    ; GSのベースはCPUごとのデータを指しているので、GSは読み込まない
+    ; アプリへ戻る場合は、GSのベースをアプリ用に切り替える（割り込み禁止で呼ばれる）
+    test byte [rdi + 0x20], 3
+    jz .kernel
+    swapgs
+.kernel:
 
     mov rax, [rdi + 0x40]
     mov rbx, [rdi + 0x48]
@@ -196,25 +229,36 @@ CallApp: ;CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp
     push r14
     push r15
     mov [r9], rsp
+    mov [gs:0x10], rsp ; PerCPU::os_stack_ptr
 
     push rdx  ;SS
     push r8  ;RSP
+    push 0x202 ;RFLAGS（IF=1）
     add rdx, 8
     push rdx  ;CS
     push rcx   ;RIP
-    o64 retf
+    ;swapgsからアプリへ移るまでに割り込まれないよう、割り込みはiretqで許可する
+    cli
+    swapgs
+    o64 iret
     ;アプリケーションが終了してもここには来ない
 
 extern LAPICTimerOnInterrupt
+extern fpu_owner_area
+extern fpu_in_interrupt
 
 global IntHandlerLAPICTimer
 IntHandlerLAPICTimer:
+    ;アプリ実行中の割り込みなら、GSのベースをカーネル用に切り替える
+    test byte [rsp + 0x08], 3 ; CS
+    jz .from_kernel
+    swapgs
+.from_kernel:
     push rbp
     mov rbp, rsp
+    sub rsp, 16 ; [rbp-8]: 入口でFPUの状態を退避した領域（退避していなければ0）
 
     ;スタック上に1TaskContext型の構造を構築する
-    sub rsp, 512
-    fxsave [rsp]
     push r15
     push r14
     push r13
@@ -245,9 +289,41 @@ IntHandlerLAPICTimer:
     push qword [rbp+0x08]
     push rcx
 
+    ;FPUレジスタが現在のタスクのもの（CR0.TS=0）なら退避し、ハンドラ内では作業用に使う
+    mov qword [rbp-8], 0
+    mov byte [fpu_in_interrupt], 1
+    mov rax, cr0
+    test al, 8
+    jnz .fpu_saved
+    mov rdi, [fpu_owner_area]
+    test rdi, rdi
+    jz .fpu_saved
+    call SaveFPUState
+    mov [rbp-8], rdi
+    mov qword [fpu_owner_area], 0
+.fpu_saved:
+
     mov rdi, rsp
     call LAPICTimerOnInterrupt
 
+    ;タスクが切り替わらなかった場合は、入口で退避したFPUの状態を戻す
+    mov byte [fpu_in_interrupt], 0
+    mov rdi, [rbp-8]
+    test rdi, rdi
+    jz .fpu_not_saved
+    clts
+    call RestoreFPUState
+    mov [fpu_owner_area], rdi
+    jmp .fpu_restored
+.fpu_not_saved:
+    ;ハンドラが作業用に使ったFPUレジスタを、どのタスクにも使わせないようTSを戻す
+    mov rax, cr0
+    test al, 8
+    jnz .fpu_restored
+    or rax, 8
+    mov cr0, rax
+.fpu_restored:
+
     add rsp, 8*8
     pop rax
     pop rbx
@@ -264,12 +340,152 @@ IntHandlerLAPICTimer:
     pop r13
     pop r14
     pop r15
-    fxrstor [rsp]
 
     mov rsp, rbp
     pop rbp
+    test byte [rsp + 0x08], 3 ; CS
+    jz .to_kernel
+    swapgs
+.to_kernel:
     iretq
 
+extern GetCurrentTaskFPUArea
+
+; #NM（CR0.TSが立っている状態でのFPU命令）：FPUの状態を遅延して切り替える
+global IntHandlerNM
+IntHandlerNM:
+    test byte [rsp + 0x08], 3 ; CS
+    jz .from_kernel
+    swapgs
+.from_kernel:
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+
+    clts
+    mov rdi, [fpu_owner_area]
+    test rdi, rdi
+    jz .load
+    call SaveFPUState
+    mov qword [fpu_owner_area], 0
+.load:
+    ;割り込みハンドラ内ではレジスタを作業用に使わせるだけで、タスクの状態は読み込まない
+    cmp byte [fpu_in_interrupt], 0
+    jne .done
+    call GetCurrentTaskFPUArea
+    mov rdi, rax
+    call RestoreFPUState
+    mov [fpu_owner_area], rdi
+.done:
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    test byte [rsp + 0x08], 3 ; CS
+    jz .to_kernel
+    swapgs
+.to_kernel:
+    iretq
+
+extern fpu_save_mode
+extern fpu_xsave_mask
+
+global SaveFPUState ; void SaveFPUState(void* area)  rdiは変更しない
+SaveFPUState:
+    mov eax, [fpu_save_mode]
+    cmp eax, 2
+    je .xsaveopt
+    cmp eax, 1
+    je .xsave
+    fxsave [rdi]
+    ret
+.xsave:
+    mov eax, [fpu_xsave_mask]
+    mov edx, [fpu_xsave_mask + 4]
+    xsave [rdi]
+    ret
+.xsaveopt:
+    ;前回のXRSTOR以降に変更されていない、または初期状態の要素は書き込まれない
+    mov eax, [fpu_xsave_mask]
+    mov edx, [fpu_xsave_mask + 4]
+    xsaveopt [rdi]
+    ret
+
+global RestoreFPUState ; void RestoreFPUState(void* area)  rdiは変更しない
+RestoreFPUState:
+    mov eax, [fpu_save_mode]
+    test eax, eax
+    jnz .xrstor
+    fxrstor [rdi]
+    ret
+.xrstor:
+    mov eax, [fpu_xsave_mask]
+    mov edx, [fpu_xsave_mask + 4]
+    xrstor [rdi]
+    ret
+
+global PrepareFPU ; void PrepareFPU(void* next_area)
+PrepareFPU:
+    ;次のタスクがFPUレジスタの持ち主ならTSを下ろし、そうでなければ立てる
+    mov byte [fpu_in_interrupt], 0
+    mov rax, cr0
+    mov rdx, rax
+    and rdx, ~8
+    cmp rdi, [fpu_owner_area]
+    je .owner
+    or rdx, 8
+.owner:
+    cmp rax, rdx
+    je .done
+    mov cr0, rdx
+.done:
+    ret
+
+global GetCR4 ; uint64_t GetCR4()
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4 ; void SetCR4(uint64_t value)
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global SetXCR0 ; void SetXCR0(uint64_t value)
+SetXCR0:
+    mov eax, edi
+    mov rdx, rdi
+    shr rdx, 32
+    xor ecx, ecx
+    xsetbv
+    ret
+
+global ReadCPUID ; void ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d)
+ReadCPUID:
+    push rbx
+    mov r10, rdx
+    mov r11, rcx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r10], eax
+    mov [r11], ebx
+    mov [r8], ecx
+    mov [r9], edx
+    pop rbx
+    ret
+
 global LoadTR
 LoadTR:
     ltr di
@@ -284,10 +500,16 @@ WriteMSR:
     wrmsr
     ret
 
-extern GetCurrentTaskOSStackPointer
+extern BeginSyscallAccounting
+extern EndSyscallAccounting
 extern syscall_table
 global SyscallEntry
 SyscallEntry:
+    ;IA32_FMASKによりIF=0で入る。OS用のスタックへ切り替えるまで割り込みは許可しない
+    swapgs
+    mov [gs:0x18], rsp ; PerCPU::user_rsp
+    mov rsp, [gs:0x10] ; PerCPU::os_stack_ptr
+    push qword [gs:0x18]
     push rbp
     push rcx
     push r11
@@ -297,27 +519,28 @@ SyscallEntry:
     mov rcx, r10
     and eax, 0x7fffffff
     mov rbp, rsp
-
     and rsp, 0xfffffffffffffff0
-    push rax
-    push rdx
-    cli
-    call GetCurrentTaskOSStackPointer
-    sti
-    mov rdx, [rsp+0]
-    mov [rax-16], rdx
-    mov rdx, [rsp+8]
-    mov [rax-8], rdx
 
-    lea rsp, [rax-16]
-    pop rdx
+    push rax
+    push rdi
+    mov edi, eax
+    call BeginSyscallAccounting ; rax以外のレジスタは保存される
+    pop rdi
     pop rax
-    and rsp, 0xfffffffffffffff0
+    sti
 
     call [syscall_table + 8*eax]
     ; rbx, r12-r15はcallee-savedなので呼び出し側で保存する
     ; raxは戻り値用なため、呼び出し側で保存しない
 
+    ;ここからsysretまで割り込みを禁止する
+    cli
+    push rax
+    sub rsp, 8
+    call EndSyscallAccounting
+    add rsp, 8
+    pop rax
+
     mov rsp, rbp
 
     pop rsi
@@ -327,9 +550,13 @@ SyscallEntry:
     pop r11
     pop rcx
     pop rbp
+    pop rsp
+    swapgs
     o64 sysret
 
 .exit:
+    ;アプリへは戻らないので、GSのベースはカーネル用のまま
+    sti
     mov rdi, rax
     mov esi, edx
     jmp ExitApp
@@ -5,6 +5,10 @@
 extern "C" {
     void IoOut32(uint16_t addr, uint32_t data);
     uint32_t IoIn32(uint16_t addr);
+    void IoOut16(uint16_t addr, uint16_t data);
+    uint16_t IoIn16(uint16_t addr);
+    void IoOut8(uint16_t addr, uint8_t data);
+    uint8_t IoIn8(uint16_t addr);
     uint16_t GetCS(void);
     void LoadIDT(uint16_t limit, uint64_t offset);
     void LoadGDT(uint16_t limit, uint64_t offset);
@@ -15,6 +19,7 @@ extern "C" {
     uint64_t GetCR2();
     void SetCR3(uint64_t value);
     uint64_t GetCR3();
+    uint64_t ReadTSC();
     void SwitchContext(void* next_ctx, void* current_ctx);
     void RestoreContext(void* ctx);
     int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
@@ -24,4 +29,12 @@ extern "C" {
     void SyscallEntry(void);
     void ExitApp(uint64_t rsp, int32_t ret_val);
     void InvalidateTLB(uint64_t addr);
+    void IntHandlerNM();
+    void SaveFPUState(void* area);
+    void RestoreFPUState(void* area);
+    void PrepareFPU(void* next_area);
+    uint64_t GetCR4();
+    void SetCR4(uint64_t value);
+    void SetXCR0(uint64_t value);
+    void ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
 }
\ No newline at end of file
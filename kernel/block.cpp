@@ -0,0 +1,195 @@
+#include "block.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "fat.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "pci.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include "nvme.hpp"
+#include "virtio_blk.hpp"
+
+Error BlockDevice::ReadFrames(uint64_t sector, const std::vector<uint64_t>& frames, size_t num_sectors){
+    for (size_t i = 0; i < frames.size() && num_sectors > 0; ++i){
+        const size_t n = std::min(num_sectors, kSectorsPerFrame);
+        if (auto err = Read(sector, reinterpret_cast<void*>(frames[i]), n)){
+            return err;
+        }
+        sector += n;
+        num_sectors -= n;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+BlockCache::BlockCache(std::unique_ptr<BlockDevice> dev)
+    : dev_{std::move(dev)},
+      bytes_{std::min(dev_->NumSectors() * BlockDevice::kSectorBytes, kRegionBytes)}{
+}
+
+Error BlockCache::HandleFault(uint64_t addr){
+    auto [frame, err] = memory_manager->Allocate(1);
+    if (err){
+        return err;
+    }
+    return Load((addr - kRegionBase) / kPageBytes, {reinterpret_cast<uint64_t>(frame.Frame())});
+}
+
+void BlockCache::Prefetch(const void* addr, size_t len){
+    const uint64_t begin = reinterpret_cast<uint64_t>(addr);
+    if (len == 0 || !Contains(begin)){
+        return;
+    }
+    const uint64_t end = std::min(begin + len, kRegionBase + bytes_);
+
+    uint64_t index = (begin - kRegionBase) / kPageBytes;
+    const uint64_t last = (end - 1 - kRegionBase) / kPageBytes;
+    while (index <= last){
+        if (Resident(index)){
+            ++index;
+            continue;
+        }
+
+        const uint64_t first = index;
+        std::vector<uint64_t> frames;
+        while (index <= last && frames.size() < kMaxPrefetchPages && !Resident(index)){
+            auto [frame, err] = memory_manager->Allocate(1);
+            if (err){
+                break;
+            }
+            frames.push_back(reinterpret_cast<uint64_t>(frame.Frame()));
+            ++index;
+        }
+        if (frames.empty() || Load(first, frames)){
+            return;
+        }
+    }
+}
+
+Error BlockCache::Sync(){
+    for (size_t i = 0; ; ++i){
+        Page page;
+        {
+            SpinLockGuard lock{lock_};
+            if (i >= pages_.size()){
+                break;
+            }
+            page = pages_[i];
+        }
+
+        // 先にダーティビットを落とすので、書き戻しの途中で書き込まれたページは次のSyncで書き戻される
+        if (!TestAndClearKernelPageDirty(kRegionBase + page.index * kPageBytes)){
+            continue;
+        }
+        if (auto err = dev_->Write(page.index * kSectorsPerPage, reinterpret_cast<const void*>(page.frame),
+                                   SectorsInPage(page.index))){
+            return err;
+        }
+        SpinLockGuard lock{lock_};
+        ++writebacks_;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+BlockCacheStat BlockCache::Stat(){
+    SpinLockGuard lock{lock_};
+    return {pages_.size(), reads_, writebacks_};
+}
+
+size_t BlockCache::SectorsInPage(uint64_t index) const{
+    return std::min<uint64_t>(kSectorsPerPage, dev_->NumSectors() - index * kSectorsPerPage);
+}
+
+bool BlockCache::Resident(uint64_t index) const{
+    // 領域のPML4エントリはアプリのPML4とも共有しているので、現在のCR3で調べてよい
+    return !GetPhysicalAddress(kRegionBase + index * kPageBytes).error;
+}
+
+Error BlockCache::Load(uint64_t first_index, const std::vector<uint64_t>& frames){
+    size_t num_sectors = 0;
+    for (size_t i = 0; i < frames.size(); ++i){
+        num_sectors += SectorsInPage(first_index + i);
+    }
+    // 読み込み中は割り込みを禁止しないので、デバイスは完了までスリープして待てる
+    // フレームへは恒等写像のアドレスで読み込むので、読み込んだだけではダーティにならない
+    auto err = dev_->ReadFrames(first_index * kSectorsPerPage, frames, num_sectors);
+
+    SpinLockGuard lock{lock_};
+    for (size_t i = 0; i < frames.size(); ++i){
+        const uint64_t index = first_index + i;
+        // 読み込み中に別の経路（ページフォールトなど）で読み込まれたページは、そちらを使う
+        if (err || Resident(index) || MapKernelFrame(LinearAddress4Level{kRegionBase + index * kPageBytes}, frames[i])){
+            memory_manager->Free(FrameID{frames[i] / kBytesPerFrame}, 1);
+            continue;
+        }
+        pages_.push_back({index, frames[i]});
+        ++reads_;
+    }
+    return err;
+}
+
+BlockCache* block_cache;
+
+namespace {
+    const unsigned long kWritebackPeriod = 5 * kTimerFreq;
+
+    // 先頭セクタがFAT32のブートセクタか
+    bool HasFATVolume(BlockDevice& dev){
+        std::vector<uint8_t> sector(BlockDevice::kSectorBytes);
+        if (dev.NumSectors() == 0 || dev.Read(0, sector.data(), 1)){
+            return false;
+        }
+        const auto bpb = reinterpret_cast<const fat::BPB*>(sector.data());
+        return bpb->bytes_per_sector == BlockDevice::kSectorBytes &&
+            memcmp(bpb->fs_type, "FAT32", 5) == 0 && sector[510] == 0x55 && sector[511] == 0xaa;
+    }
+
+    void TaskBlockWriteback(uint64_t task_id, int64_t data){
+        while (true){
+            if (auto err = task_manager->SleepUntil(timer_manager->CurrentTick() + kWritebackPeriod)){
+                // 起こされないまま眠り続けないよう、書き戻しを止める（syncコマンドでは書き戻せる）
+                Log(kError, "block writeback stopped: %s\n", err.Name());
+                task_manager->Finish(0);
+            }
+
+            if (auto err = block_cache->Sync()){
+                Log(kError, "block writeback failed: %s\n", err.Name());
+            }
+        }
+    }
+}
+
+void InitializeBlockDevice(){
+    for (int i = 0; i < pci::num_devices; ++i){
+        std::unique_ptr<BlockDevice> dev = nvme::Controller::Probe(pci::devices[i]);
+        if (!dev){
+            dev = VirtioBlock::Probe(pci::devices[i]);
+        }
+        if (!dev || !HasFATVolume(*dev)){
+            continue;
+        }
+
+        if (auto err = ReserveKernelPageMap(LinearAddress4Level{BlockCache::kRegionBase})){
+            Log(kError, "failed to reserve block cache region: %s\n", err.Name());
+            return;
+        }
+        block_cache = new BlockCache{std::move(dev)};
+        return;
+    }
+}
+
+void StartBlockWriteback(){
+    if (block_cache){
+        auto [task, err] = task_manager->NewTask().InitContext(TaskBlockWriteback, 0);
+        if (err){
+            // syncコマンドでは書き戻せる
+            Log(kError, "failed to start block writeback: %s\n", err.Name());
+            task_manager->DiscardTask(task);
+            return;
+        }
+        task.Wakeup();
+    }
+}
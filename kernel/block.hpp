@@ -0,0 +1,87 @@
+// ブロックデバイスと、その内容を必要になったページだけ読み込むキャッシュ
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "error.hpp"
+#include "spinlock.hpp"
+
+// セクタ単位で読み書きする記憶装置
+class BlockDevice{
+    public:
+        static const size_t kSectorBytes = 512;
+        static const size_t kFrameBytes = 4096;
+        static const size_t kSectorsPerFrame = kFrameBytes / kSectorBytes;
+
+        virtual ~BlockDevice() = default;
+        virtual uint64_t NumSectors() const = 0;
+        // bufはDMAで直接読み書きするので、恒等写像のメモリ（ヒープやフレーム）であること
+        // タスクのスタックは恒等写像ではないので使えない
+        virtual Error Read(uint64_t sector, void* buf, size_t num_sectors) = 0;
+        virtual Error Write(uint64_t sector, const void* buf, size_t num_sectors) = 0;
+        // 連続したnum_sectors個のセクタを、物理的に連続しないフレームの並びへ先頭から順に読み込む
+        // 既定ではフレームごとにReadする。1つの要求で読めるデバイスは上書きする
+        virtual Error ReadFrames(uint64_t sector, const std::vector<uint64_t>& frames, size_t num_sectors);
+};
+
+struct BlockCacheStat{
+    size_t resident_pages; // 読み込み済みのページ数
+    uint64_t reads; // デバイスから読み込んだページ数
+    uint64_t writebacks; // デバイスへ書き戻したページ数
+};
+
+// ブロックデバイス全体を専用の仮想アドレス領域に見せるキャッシュ
+// 各ページは初めて触れたときにページフォールトで読み込む。FATの層はエントリへのポインタを保持し続けるので、
+// 読み込んだページは解放しない。書き込まれたページはページテーブルのダーティビットで見分け、Syncで書き戻す
+class BlockCache{
+    public:
+        static const uint64_t kRegionBase = 0x0000'4080'0000'0000; // PML4の129番目のエントリ
+        static const uint64_t kRegionBytes = 512ul << 30; // PML4の1エントリ分
+        static const size_t kPageBytes = BlockDevice::kFrameBytes;
+        static const size_t kSectorsPerPage = BlockDevice::kSectorsPerFrame;
+        static const size_t kMaxPrefetchPages = 64; // Prefetchで1度に要求するページ数
+
+        explicit BlockCache(std::unique_ptr<BlockDevice> dev);
+        void* Base() const {return reinterpret_cast<void*>(kRegionBase);}
+        bool Contains(uint64_t addr) const {return kRegionBase <= addr && addr < kRegionBase + bytes_;}
+        // ページフォールトから呼ぶ。addrを含むページをデバイスから読み込んでマップする
+        Error HandleFault(uint64_t addr);
+        // [addr, addr+len)のうち未読み込みのページを、連続した分ずつまとめて読み込む
+        // 割り込みが許可されていて、デバイスが対応していれば読み込みの完了までスリープする
+        // 範囲外のアドレスやメモリ不足は無視する（残りはページフォールトで読み込まれる）
+        void Prefetch(const void* addr, size_t len);
+        // 書き込まれたページをデバイスへ書き戻す
+        Error Sync();
+        BlockCacheStat Stat();
+
+    private:
+        struct Page{
+            uint64_t index; // 先頭からのページ番号
+            uint64_t frame; // フレームの物理アドレス
+        };
+
+        std::unique_ptr<BlockDevice> dev_;
+        uint64_t bytes_;
+        SpinLock lock_{};
+        std::vector<Page> pages_{}; // 読み込んだ順
+        uint64_t reads_{0}, writebacks_{0};
+
+        // pageのセクタのうちデバイスに実在する数（末尾のページは途中までのことがある）
+        size_t SectorsInPage(uint64_t index) const;
+        bool Resident(uint64_t index) const;
+        // ページfirst_indexから連続したページをデバイスから読み込んでマップする。framesは引き取り、マップしなかったものは解放する
+        Error Load(uint64_t first_index, const std::vector<uint64_t>& frames);
+};
+
+// FATのボリュームを置いたブロックデバイスのキャッシュ。無ければnullptr（ローダーが読み込んだイメージを使う）
+extern BlockCache* block_cache;
+
+// PCIデバイス（NVMe, virtio-blk）からFATのボリュームを持つブロックデバイスを探し、block_cacheを作る
+// InitializePCIの後に呼ぶ
+void InitializeBlockDevice();
+// block_cacheを定期的に書き戻すタスクを起動する。InitializeTaskの後に呼ぶ
+void StartBlockWriteback();
@@ -34,6 +34,7 @@ class Error{
             kIsDirectory,
             kNoSuchEntry,
             kFreeTypeError,
+            kNoSuchTimer,
             kLastOfCode,
         };
         
@@ -68,6 +69,7 @@ class Error{
             "kIsDirectory",
             "kNoSuchEntry",
             "kFreeTypeError",
+            "kNoSuchTimer",
         };
         static_assert(Error::Code::kLastOfCode == code_names_.size());
 
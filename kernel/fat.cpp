@@ -3,20 +3,29 @@
 #include <algorithm>
 #include <cstring>
 #include <cctype>
+#include <map>
+#include <unordered_map>
 #include <utility>
+#include <vector>
+
+#include "block.hpp"
+#include "font.hpp"
+#include "mutex.hpp"
 
 namespace {
+    // 長い名前の1文字はUTF-8で最大3バイト
+    const size_t kMaxPathElement = fat::kMaxNameLength * 3 + 1;
+
     std::pair<const char*, bool>
     NextPathElement(const char* path, char* path_elem){
         const char* next_slash = strchr(path, '/');
+        const size_t path_len = next_slash ? next_slash - path : strlen(path);
+        const size_t elem_len = std::min(path_len, kMaxPathElement - 1);
+        strncpy(path_elem, path, elem_len);
+        path_elem[elem_len] = '\0';
         if (next_slash == nullptr){
-            strcpy(path_elem, path);
             return {nullptr, false};
         }
-
-        const auto elem_len = next_slash - path;
-        strncpy(path_elem, path, elem_len);
-        path_elem[elem_len] = '\0';
         return {&next_slash[1], true};
     }
 }
@@ -25,9 +34,358 @@ namespace fat{
     BPB* boot_volume_image;
     unsigned long bytes_per_cluster;
 
+    namespace {
+        // 1ビットを1クラスタに対応させる  0: 空き、1: 使用中（FATの値が0以外）
+        // クラスタ0, 1と、最後のクラスタより後ろのビットは使用中にしておく
+        std::vector<uint64_t>* cluster_bitmap;
+        unsigned long num_clusters; // 最後のクラスタ番号+1
+        unsigned long free_clusters;
+        unsigned long next_free_hint = 2;
+        FSInfo* fs_info; // 署名が正しくなければnullptr
+
+        bool ClusterUsed(unsigned long cluster){
+            return ((*cluster_bitmap)[cluster / 64] >> (cluster % 64)) & 1;
+        }
+
+        void SetClusterUsed(unsigned long cluster){
+            (*cluster_bitmap)[cluster / 64] |= 1ul << (cluster % 64);
+        }
+
+        // startから空きクラスタを探す。最後まで探したら先頭に戻り、1周しても無ければ0
+        // 64クラスタ分のビットをまとめて調べる
+        unsigned long FindFreeCluster(unsigned long start){
+            if (start < 2 || start >= num_clusters){
+                start = 2;
+            }
+            const size_t num_words = cluster_bitmap->size();
+            size_t i = start / 64;
+            uint64_t used = (*cluster_bitmap)[i] | ((1ul << (start % 64)) - 1);
+            for (size_t n = 0; n <= num_words; ++n){
+                if (~used != 0){
+                    return i * 64 + __builtin_ctzll(~used);
+                }
+                i = (i + 1) % num_words;
+                used = (*cluster_bitmap)[i];
+            }
+            return 0;
+        }
+
+        // ヒントから後ろで、n個連続して空いている範囲の先頭を探す。無ければ最初に見つかった空きクラスタ
+        unsigned long FindFreeRun(size_t n){
+            const unsigned long first = FindFreeCluster(next_free_hint);
+            unsigned long cluster = first;
+            while (cluster != 0){
+                size_t len = 1;
+                while (len < n && cluster + len < num_clusters && !ClusterUsed(cluster + len)){
+                    ++len;
+                }
+                if (len == n){
+                    return cluster;
+                }
+                const unsigned long next = FindFreeCluster(cluster + len);
+                if (next <= cluster){
+                    break; // 先頭に戻った
+                }
+                cluster = next;
+            }
+            return first;
+        }
+
+        // 空きクラスタを使用中にしてチェーンの末尾（EOC）にする
+        void TakeCluster(unsigned long cluster){
+            GetFAT()[cluster] = kEndOfClusterchain;
+            SetClusterUsed(cluster);
+            --free_clusters;
+            next_free_hint = cluster + 1;
+            if (fs_info){
+                fs_info->free_count = free_clusters;
+                fs_info->next_free = next_free_hint;
+            }
+        }
+
+        // 長い名前のエントリ1つに入る文字の、エントリ先頭からの位置
+        const size_t kLongNameCharsPerEntry = 13;
+        const int kLongNameCharOffsets[kLongNameCharsPerEntry] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+        uint16_t GetLongNameChar(const LongNameEntry& entry, int i){
+            uint16_t c;
+            memcpy(&c, reinterpret_cast<const uint8_t*>(&entry) + kLongNameCharOffsets[i], sizeof(c));
+            return c;
+        }
+
+        void SetLongNameChar(LongNameEntry& entry, int i, uint16_t c){
+            memcpy(reinterpret_cast<uint8_t*>(&entry) + kLongNameCharOffsets[i], &c, sizeof(c));
+        }
+
+        uint8_t ShortNameChecksum(const unsigned char* name83){
+            uint8_t sum = 0;
+            for (int i = 0; i < 11; ++i){
+                sum = ((sum & 1) << 7) + (sum >> 1) + name83[i];
+            }
+            return sum;
+        }
+
+        void AppendUTF8(std::string& s, uint16_t c){
+            if (c < 0x80){
+                s += static_cast<char>(c);
+            } else if (c < 0x800){
+                s += static_cast<char>(0xc0 | (c >> 6));
+                s += static_cast<char>(0x80 | (c & 0x3f));
+            } else {
+                s += static_cast<char>(0xe0 | (c >> 12));
+                s += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+                s += static_cast<char>(0x80 | (c & 0x3f));
+            }
+        }
+
+        // UTF-8の名前をUTF-16にして文字数を返す。長すぎるか、UTF-16の1単位で表せない文字があれば0
+        size_t EncodeLongName(const char* name, uint16_t* u16){
+            size_t len = 0;
+            while (*name){
+                const auto [c, bytes] = ConvertUTF8To32(name);
+                if (bytes == 0 || c > 0xffff || len == kMaxNameLength){
+                    return 0;
+                }
+                u16[len++] = c;
+                name += bytes;
+            }
+            return len;
+        }
+
+        // 名前の比較は大文字と小文字を区別しない（ASCIIの範囲のみ）
+        std::string FoldName(const std::string& name){
+            std::string folded = name;
+            for (auto& c : folded){
+                if ('A' <= c && c <= 'Z'){
+                    c = c - 'A' + 'a';
+                }
+            }
+            return folded;
+        }
+
+        bool IsShortNameChar(char c){
+            const auto uc = static_cast<unsigned char>(c);
+            return uc != 0 && uc < 0x80 && (isalnum(uc) || strchr("$%'-_@~`!(){}^#&", c));
+        }
+
+        // 長い名前を作らずに8+3形式だけで表せる名前か。小文字は大文字にして格納する
+        bool FitsShortName(const char* name){
+            const char* dot = strrchr(name, '.');
+            const size_t base_len = dot ? dot - name : strlen(name);
+            const size_t ext_len = dot ? strlen(&dot[1]) : 0;
+            if (base_len == 0 || base_len > 8 || ext_len > 3 || (dot && ext_len == 0)){
+                return false;
+            }
+            for (const char* p = name; *p; ++p){
+                if (p != dot && !IsShortNameChar(*p)){
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // ディレクトリのエントリを名前で引くための索引。最初に引いたときにディレクトリを走査して作る
+        struct DirectoryIndex{
+            std::vector<std::pair<std::string, DirectoryEntry*>> entries; // ディレクトリ内の順
+            // キー: 小文字にした名前。長い名前と8+3形式の名前の両方を載せる
+            std::unordered_map<std::string, DirectoryEntry*> by_name;
+        };
+        Mutex dir_index_mutex;
+        std::map<unsigned long, DirectoryIndex>* dir_indexes; // キー: ディレクトリの先頭クラスタ
+
+        void AddToIndex(DirectoryIndex& index, const std::string& long_name, DirectoryEntry* entry){
+            char short_name[13];
+            FormatName(*entry, short_name);
+            index.entries.emplace_back(long_name.empty() ? std::string{short_name} : long_name, entry);
+            index.by_name.emplace(FoldName(short_name), entry);
+            if (!long_name.empty()){
+                index.by_name.emplace(FoldName(long_name), entry);
+            }
+        }
+
+        // dir_index_mutexを取ってから呼ぶこと
+        DirectoryIndex& GetIndex(unsigned long dir_cluster){
+            if (dir_indexes == nullptr){
+                dir_indexes = new std::map<unsigned long, DirectoryIndex>;
+            }
+            if (auto it = dir_indexes->find(dir_cluster); it != dir_indexes->end()){
+                return it->second;
+            }
+
+            DirectoryIndex& index = (*dir_indexes)[dir_cluster];
+            // 長い名前は最後の部分から逆順に並び、直後の短い名前のエントリに付く
+            uint16_t long_name[kMaxNameLength / kLongNameCharsPerEntry * kLongNameCharsPerEntry + kLongNameCharsPerEntry];
+            int long_name_parts = 0;
+            int expected_part = -1; // 次に来るべき部分の番号。-1なら組み立てていない
+            uint8_t checksum = 0;
+
+            for (auto cluster = dir_cluster; cluster != kEndOfClusterchain; cluster = NextCluster(cluster)){
+                auto dir = GetSectorByCluster<DirectoryEntry>(cluster);
+                for (int i=0; i<bytes_per_cluster/sizeof(DirectoryEntry); ++i){
+                    if (dir[i].name[0] == 0x00){
+                        return index;
+                    } else if (dir[i].name[0] == 0xe5){
+                        expected_part = -1;
+                        continue;
+                    }
+
+                    if (dir[i].attr == Attribute::kLongName){
+                        const auto& lfn = reinterpret_cast<const LongNameEntry&>(dir[i]);
+                        const int part = lfn.ord & 0x1f;
+                        if (lfn.ord & 0x40){
+                            expected_part = part;
+                            long_name_parts = part;
+                            checksum = lfn.checksum;
+                        }
+                        if (part == 0 || part != expected_part || lfn.checksum != checksum ||
+                            part * kLongNameCharsPerEntry > sizeof(long_name) / sizeof(long_name[0])){
+                            expected_part = -1;
+                            continue;
+                        }
+                        for (int k = 0; k < kLongNameCharsPerEntry; ++k){
+                            long_name[(part - 1) * kLongNameCharsPerEntry + k] = GetLongNameChar(lfn, k);
+                        }
+                        expected_part = part - 1;
+                        continue;
+                    }
+
+                    std::string name;
+                    if (expected_part == 0 && ShortNameChecksum(dir[i].name) == checksum){
+                        for (int k = 0; k < long_name_parts * kLongNameCharsPerEntry; ++k){
+                            if (long_name[k] == 0x0000 || long_name[k] == 0xffff){
+                                break;
+                            }
+                            AppendUTF8(name, long_name[k]);
+                        }
+                    }
+                    expected_part = -1;
+
+                    if ((static_cast<uint8_t>(dir[i].attr) & static_cast<uint8_t>(Attribute::kVolumeID)) == 0){
+                        AddToIndex(index, name, &dir[i]);
+                    }
+                }
+            }
+            return index;
+        }
+
+        DirectoryEntry* FindEntry(unsigned long dir_cluster, const char* name){
+            MutexGuard lock{dir_index_mutex};
+            const auto& index = GetIndex(dir_cluster);
+            auto it = index.by_name.find(FoldName(name));
+            return it == index.by_name.end() ? nullptr : it->second;
+        }
+
+        // 長い名前に対応する、ディレクトリ内で重複しない短い名前（BASIS~N.EXT）を作る
+        void MakeShortAlias(const DirectoryIndex& index, const char* name, unsigned char* name83){
+            const char* dot = strrchr(name, '.');
+            if (dot == name){
+                dot = nullptr; // 先頭のドットは拡張子の区切りではない
+            }
+
+            std::string basis, ext;
+            for (const char* p = name; *p && p != dot; ++p){
+                if (*p != '.' && *p != ' '){
+                    basis += IsShortNameChar(*p) ? toupper(*p) : '_';
+                }
+            }
+            for (const char* p = dot ? &dot[1] : ""; *p && ext.size() < 3; ++p){
+                if (*p != ' '){
+                    ext += IsShortNameChar(*p) ? toupper(*p) : '_';
+                }
+            }
+
+            for (int n = 1; ; ++n){
+                char tail[8];
+                sprintf(tail, "~%d", n);
+                const size_t basis_len = std::min(basis.size(), 8 - strlen(tail));
+                memset(name83, 0x20, 11);
+                memcpy(name83, basis.data(), basis_len);
+                memcpy(&name83[basis_len], tail, strlen(tail));
+                memcpy(&name83[8], ext.data(), ext.size());
+
+                char formatted[13];
+                DirectoryEntry probe{};
+                memcpy(probe.name, name83, 11);
+                FormatName(probe, formatted);
+                if (index.by_name.count(FoldName(formatted)) == 0){
+                    return;
+                }
+            }
+        }
+
+        // 連続したn個の空きエントリを確保する。足りなければディレクトリにクラスタを追加する
+        // 空きクラスタがなければ空のvectorを返す
+        std::vector<DirectoryEntry*> AllocateEntries(unsigned long dir_cluster, size_t n){
+            std::vector<DirectoryEntry*> run;
+            while (true){
+                auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
+                for (int i=0; i<bytes_per_cluster/sizeof(DirectoryEntry); ++i){
+                    if (dir[i].name[0] == 0x00 || dir[i].name[0] == 0xe5){
+                        run.push_back(&dir[i]);
+                        if (run.size() == n){
+                            return run;
+                        }
+                    } else {
+                        run.clear();
+                    }
+                }
+
+                auto next = NextCluster(dir_cluster);
+                if (next == kEndOfClusterchain){
+                    next = ExtendCluster(dir_cluster, 1);
+                    if (next == dir_cluster){
+                        return {};
+                    }
+                    memset(GetSectorByCluster<DirectoryEntry>(next), 0, bytes_per_cluster);
+                }
+                dir_cluster = next;
+            }
+        }
+
+        void InitializeClusterBitmap(){
+            const unsigned long data_sectors = boot_volume_image->total_sectors_32
+                - boot_volume_image->reserved_sector_count
+                - boot_volume_image->num_fats * boot_volume_image->fat_size_32;
+            const unsigned long fat_entries =
+                static_cast<unsigned long>(boot_volume_image->fat_size_32) * boot_volume_image->bytes_per_sector / sizeof(uint32_t);
+            num_clusters = std::min(data_sectors / boot_volume_image->sectors_per_cluster + 2, fat_entries);
+
+            cluster_bitmap = new std::vector<uint64_t>((num_clusters + 63) / 64, 0);
+            for (unsigned long bit = num_clusters; bit < cluster_bitmap->size() * 64; ++bit){
+                SetClusterUsed(bit);
+            }
+            SetClusterUsed(0);
+            SetClusterUsed(1);
+
+            const uint32_t* fat = GetFAT();
+            free_clusters = 0;
+            for (unsigned long cluster = 2; cluster < num_clusters; ++cluster){
+                if ((fat[cluster] & 0x0ffffffful) != 0){
+                    SetClusterUsed(cluster);
+                } else {
+                    ++free_clusters;
+                }
+            }
+
+            auto info = reinterpret_cast<FSInfo*>(
+                reinterpret_cast<uintptr_t>(boot_volume_image) + boot_volume_image->fs_info * boot_volume_image->bytes_per_sector);
+            if (boot_volume_image->fs_info != 0 &&
+                info->lead_signature == 0x41615252 && info->struct_signature == 0x61417272 &&
+                info->trail_signature == 0xaa550000){
+                fs_info = info;
+                if (2 <= info->next_free && info->next_free < num_clusters){
+                    next_free_hint = info->next_free;
+                }
+                // 走査して数えた値の方が確かなので書き戻しておく
+                info->free_count = free_clusters;
+            }
+        }
+    }
+
     void Initialize(void* volume_image){
         boot_volume_image = reinterpret_cast<fat::BPB*>(volume_image);
         bytes_per_cluster = static_cast<unsigned long>(boot_volume_image->bytes_per_sector)*boot_volume_image->sectors_per_cluster;
+        InitializeClusterBitmap();
     }
 
     uintptr_t GetClusterAddr(unsigned long cluster){
@@ -75,48 +433,19 @@ namespace fat{
             directory_cluster = boot_volume_image->root_cluster;
         }
 
-        char path_elem[13];
+        char path_elem[kMaxPathElement];
         const auto [next_path, post_slash] = NextPathElement(path, path_elem);
         const bool path_last = next_path == nullptr || next_path[0] == '\0';
 
-        while (directory_cluster != kEndOfClusterchain){
-            auto dir = GetSectorByCluster<DirectoryEntry>(directory_cluster);
-            for (int i=0; i<bytes_per_cluster/sizeof(DirectoryEntry); ++i){
-                if (dir[i].name[0] == 0x00){
-                    goto not_found;
-                } else if (!NameIsEqual(dir[i], path_elem)){
-                    continue;
-                }
-
-                if (dir[i].attr == Attribute::kDirectory && !path_last){
-                    return FindFile(next_path, dir[i].FirstCluster());
-                } else {
-                    return {&dir[i], post_slash};
-                }
-            }
-
-            directory_cluster = NextCluster(directory_cluster);
+        DirectoryEntry* entry = FindEntry(directory_cluster, path_elem);
+        if (entry == nullptr){
+            return {nullptr, post_slash};
         }
 
-    not_found:
-        return {nullptr, post_slash};
-    }
-
-    bool NameIsEqual(const DirectoryEntry& entry, const char* name){
-        unsigned char name83[11];
-        memset(name83, 0x20, sizeof(name83));
-
-        int i = 0;
-        int i83 = 0;
-        for (; name[i] != 0 && i83 < sizeof(name83); ++i, ++i83){
-            if (name[i] == '.'){
-                i83 = 7;
-                continue;
-            }
-            name83[i83] = toupper(name[i]);
+        if (entry->attr == Attribute::kDirectory && !path_last){
+            return FindFile(next_path, entry->FirstCluster());
         }
-
-        return memcmp(entry.name, name83, sizeof(name83)) == 0;
+        return {entry, post_slash};
     }
 
     size_t LoadFile(void* buf, size_t len, DirectoryEntry& entry){
@@ -138,40 +467,21 @@ namespace fat{
             eoc_cluster = fat[eoc_cluster];
         }
 
-        size_t num_allocated = 0;
         auto current = eoc_cluster;
-
-        for (unsigned long candidate = 2; num_allocated < n; ++candidate){
-            if (fat[candidate] != 0){
-                continue;
+        for (size_t num_allocated = 0; num_allocated < n; ++num_allocated){
+            // 末尾の直後が空いていれば、連続するようにそれを使う
+            unsigned long next = current + 1;
+            if (next >= num_clusters || ClusterUsed(next)){
+                next = FindFreeCluster(next_free_hint);
             }
-            fat[current] = candidate;
-            current = candidate;
-            ++num_allocated;
-        }
-        fat[current] = kEndOfClusterchain;
-        return current;
-    }
-
-    DirectoryEntry* AllocateEntry(unsigned long dir_cluster){
-        while (true){
-            auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
-            for (int i=0; i<bytes_per_cluster/sizeof(DirectoryEntry); ++i){
-                if (dir[i].name[0] == 0 || dir[i].name[0] == 0x05){
-                    return &dir[i];
-                }
-            }
-            auto next = NextCluster(dir_cluster);
-            if (next == kEndOfClusterchain){
+            if (next == 0){
                 break;
             }
-            dir_cluster = next;
+            TakeCluster(next);
+            fat[current] = next;
+            current = next;
         }
-
-        dir_cluster = ExtendCluster(dir_cluster, 1);
-        auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
-        memset(dir, 0, bytes_per_cluster);
-        return &dir[0];
+        return current;
     }
 
     void SetFileName(DirectoryEntry& entry, const char* name){
@@ -214,24 +524,59 @@ namespace fat{
             }
         }
 
-        auto dir = fat::AllocateEntry(parent_dir_cluster);
-        if (dir == nullptr){
+        MutexGuard lock{dir_index_mutex};
+        auto& index = GetIndex(parent_dir_cluster);
+        if (FitsShortName(filename)){
+            auto entries = AllocateEntries(parent_dir_cluster, 1);
+            if (entries.empty()){
+                return {nullptr, MAKE_ERROR(Error::kNoEnoughMemory)};
+            }
+            auto dir = entries[0];
+            memset(dir, 0, sizeof(DirectoryEntry));
+            fat::SetFileName(*dir, filename);
+            AddToIndex(index, "", dir);
+            return {dir, MAKE_ERROR(Error::kSuccess)};
+        }
+
+        // 長い名前のエントリを、最後の部分から順に短い名前のエントリの前に置く
+        uint16_t u16[kMaxNameLength];
+        const size_t len = EncodeLongName(filename, u16);
+        if (len == 0){
+            return {nullptr, MAKE_ERROR(Error::kInvalidFormat)};
+        }
+        const size_t num_parts = (len + kLongNameCharsPerEntry - 1) / kLongNameCharsPerEntry;
+        auto entries = AllocateEntries(parent_dir_cluster, num_parts + 1);
+        if (entries.empty()){
             return {nullptr, MAKE_ERROR(Error::kNoEnoughMemory)};
         }
-        fat::SetFileName(*dir, filename);
-        dir->file_size=0;
+
+        auto dir = entries[num_parts];
+        memset(dir, 0, sizeof(DirectoryEntry));
+        MakeShortAlias(index, filename, dir->name);
+        const uint8_t checksum = ShortNameChecksum(dir->name);
+        for (size_t i = 0; i < num_parts; ++i){
+            const int part = num_parts - i;
+            auto& lfn = *reinterpret_cast<LongNameEntry*>(entries[i]);
+            memset(&lfn, 0, sizeof(lfn));
+            lfn.ord = part | (i == 0 ? 0x40 : 0);
+            lfn.attr = Attribute::kLongName;
+            lfn.checksum = checksum;
+            for (int k = 0; k < kLongNameCharsPerEntry; ++k){
+                // 名前の後ろは0x0000を1つ置き、残りを0xffffで埋める
+                const size_t pos = (part - 1) * kLongNameCharsPerEntry + k;
+                SetLongNameChar(lfn, k, pos < len ? u16[pos] : pos == len ? 0x0000 : 0xffff);
+            }
+        }
+        AddToIndex(index, filename, dir);
         return {dir, MAKE_ERROR(Error::kSuccess)};
     }
 
     unsigned long AllocateClusterChain(size_t n){
-        uint32_t* fat = GetFAT();
-        unsigned long first_cluster;
-        for (first_cluster = 2; ; ++first_cluster){
-            if (fat[first_cluster] == 0){
-                fat[first_cluster] = kEndOfClusterchain;
-                break;
-            }
+        const unsigned long first_cluster = FindFreeRun(n);
+        if (first_cluster == 0){
+            return 0;
         }
+        TakeCluster(first_cluster);
 
         if (n>1){
             ExtendCluster(first_cluster, n-1);
@@ -239,30 +584,21 @@ namespace fat{
         return first_cluster;
     }
 
-    FileDescriptor::FileDescriptor(DirectoryEntry& fat_entry): fat_entry_{fat_entry}{
+    std::vector<std::pair<std::string, DirectoryEntry*>> ListDirectory(unsigned long dir_cluster){
+        MutexGuard lock{dir_index_mutex};
+        return GetIndex(dir_cluster).entries;
     }
 
-    size_t FileDescriptor::Read(void* buf, size_t len){
-        if (rd_cluster_ == 0){
-            rd_cluster_ = fat_entry_.FirstCluster();
-        }
-        uint8_t* buf8 = reinterpret_cast<uint8_t*>(buf);
-        len = std::min(len, fat_entry_.file_size - rd_off_);
-
-        size_t total = 0;
-        while (total < len){
-            uint8_t* sec = GetSectorByCluster<uint8_t>(rd_cluster_);
-            size_t n = std::min(len - total, bytes_per_cluster - rd_cluster_off_);
-            memcpy(&buf8[total], &sec[rd_cluster_off_], n);
-            total += n;
+    unsigned long CountFreeClusters(){
+        return free_clusters;
+    }
 
-            rd_cluster_off_ += n;
-            if (rd_cluster_off_ == bytes_per_cluster){
-                rd_cluster_ = NextCluster(rd_cluster_);
-                rd_cluster_off_ = 0;
-            }
-        }
+    FileDescriptor::FileDescriptor(DirectoryEntry& fat_entry): fat_entry_{fat_entry}{
+    }
 
+    size_t FileDescriptor::Read(void* buf, size_t len){
+        len = rd_off_ < fat_entry_.file_size ? std::min<size_t>(len, fat_entry_.file_size - rd_off_) : 0;
+        const size_t total = CopyOut(buf, len, rd_off_);
         rd_off_ += total;
         return total;
     }
@@ -272,36 +608,36 @@ namespace fat{
             return (bytes + bytes_per_cluster -1 )/bytes_per_cluster;
         };
 
-        if (wr_cluster_ == 0){
-            if (fat_entry_.FirstCluster() != 0){
-                wr_cluster_ = fat_entry_.FirstCluster();
-            } else {
-                wr_cluster_ = AllocateClusterChain(num_cluster(len));
-                fat_entry_.first_cluster_low = wr_cluster_ & 0xffff;
-                fat_entry_.first_cluster_high = (wr_cluster_ >> 16) & 0xffff;
+        if (len == 0){
+            return 0;
+        }
+        if (fat_entry_.FirstCluster() == 0){
+            const auto first_cluster = AllocateClusterChain(num_cluster(len));
+            if (first_cluster == 0){
+                return 0;
             }
+            fat_entry_.first_cluster_low = first_cluster & 0xffff;
+            fat_entry_.first_cluster_high = (first_cluster >> 16) & 0xffff;
+            extents_.clear();
         }
 
-        const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
+        const size_t needed = num_cluster(wr_off_ + len);
+        if (const size_t mapped = MapClusters(needed); mapped < needed){
+            // 末尾のクラスタは対応表から分かるので、チェーンをたどり直さずに伸ばす
+            const Extent& last = extents_.back();
+            ExtendCluster(last.cluster + last.length - 1, needed - mapped);
+        }
 
+        const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
         size_t total = 0;
         while (total < len){
-            if (wr_cluster_off_ == bytes_per_cluster){
-                const auto next_cluster = NextCluster(wr_cluster_);
-                if (next_cluster == kEndOfClusterchain){
-                    wr_cluster_ = ExtendCluster(wr_cluster_, num_cluster(len-total));
-                } else {
-                    wr_cluster_ = next_cluster;
-                }
-                wr_cluster_off_ = 0;
+            const auto [dst, run] = Locate(wr_off_ + total, len - total);
+            if (run == 0){
+                break; // 空きクラスタがない
             }
-
-            uint8_t* sec = GetSectorByCluster<uint8_t>(wr_cluster_);
-            size_t n = std::min(len, bytes_per_cluster - wr_cluster_off_);
-            memcpy(&sec[wr_cluster_off_], &buf8[total], n);
+            const size_t n = std::min(len - total, run);
+            memcpy(dst, &buf8[total], n);
             total += n;
-
-            wr_cluster_off_ += n;
         }
 
         wr_off_ += total;
@@ -310,17 +646,69 @@ namespace fat{
     }
 
     size_t FileDescriptor::Load(void* buf, size_t len, size_t offset){
-        FileDescriptor fd{fat_entry_};
-        fd.rd_off_ = offset;
+        len = offset < fat_entry_.file_size ? std::min<size_t>(len, fat_entry_.file_size - offset) : 0;
+        return CopyOut(buf, len, offset);
+    }
+
+    size_t FileDescriptor::MapClusters(size_t num_clusters){
+        if (extents_.empty()){
+            const auto first_cluster = fat_entry_.FirstCluster();
+            if (first_cluster == 0 || num_clusters == 0){
+                return 0;
+            }
+            extents_.push_back({0, first_cluster, 1});
+        }
 
-        unsigned long cluster = fat_entry_.FirstCluster();
-        while (offset >= bytes_per_cluster){
-            offset -= bytes_per_cluster;
-            cluster = NextCluster(cluster);
+        size_t mapped = extents_.back().index + extents_.back().length;
+        while (mapped < num_clusters){
+            const Extent& last = extents_.back();
+            const auto next = NextCluster(last.cluster + last.length - 1);
+            if (next == kEndOfClusterchain){
+                break;
+            }
+            if (next == last.cluster + last.length){
+                ++extents_.back().length;
+            } else {
+                extents_.push_back({mapped, next, 1});
+            }
+            ++mapped;
+        }
+        return mapped;
+    }
+
+    std::pair<uint8_t*, size_t> FileDescriptor::Locate(size_t offset, size_t len){
+        const size_t index = offset / bytes_per_cluster;
+        if (MapClusters((offset + len + bytes_per_cluster - 1) / bytes_per_cluster) <= index){
+            return {nullptr, 0};
         }
 
-        fd.rd_cluster_ = cluster;
-        fd.rd_cluster_off_ = offset;
-        return fd.Read(buf, len);
+        // indexを含む並びを二分探索する
+        auto it = std::upper_bound(extents_.begin(), extents_.end(), index,
+                                   [](size_t i, const Extent& e){ return i < e.index; });
+        --it;
+        const size_t cluster_off = index - it->index;
+        const size_t byte_off = offset % bytes_per_cluster;
+        auto addr = GetSectorByCluster<uint8_t>(it->cluster + cluster_off) + byte_off;
+        return {addr, (it->length - cluster_off) * bytes_per_cluster - byte_off};
     }
-}
\ No newline at end of file
+
+    // 連続したクラスタは、ボリュームのイメージ上でも連続しているので1回でコピーする
+    size_t FileDescriptor::CopyOut(void* buf, size_t len, size_t offset){
+        uint8_t* buf8 = reinterpret_cast<uint8_t*>(buf);
+        size_t total = 0;
+        while (total < len){
+            const auto [src, run] = Locate(offset + total, len - total);
+            if (run == 0){
+                break;
+            }
+            const size_t n = std::min(len - total, run);
+            // ボリュームがブロックデバイスにあれば、連続したクラスタの未読み込みの分をまとめて読み込んでおく
+            if (block_cache){
+                block_cache->Prefetch(src, n);
+            }
+            memcpy(&buf8[total], src, n);
+            total += n;
+        }
+        return total;
+    }
+}
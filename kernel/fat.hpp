@@ -4,6 +4,9 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "error.hpp"
 #include "file.hpp"
@@ -39,6 +42,17 @@ namespace fat{
         char fs_type[8];
     } __attribute__((packed));
 
+    // FAT32のFSInfoセクタ。空きクラスタ数と、空きを探し始めるクラスタのヒントを持つ
+    struct FSInfo{
+        uint32_t lead_signature; // 0x41615252
+        uint8_t reserved1[480];
+        uint32_t struct_signature; // 0x61417272
+        uint32_t free_count; // 0xffffffffなら不明
+        uint32_t next_free; // 0xffffffffなら不明
+        uint8_t reserved2[12];
+        uint32_t trail_signature; // 0xaa550000
+    } __attribute__((packed));
+
     enum class Attribute : uint8_t{
         kReadOnly = 0x01,
         kHidden = 0x02,
@@ -68,8 +82,25 @@ namespace fat{
         }
     }__attribute__((packed));
 
+    // VFATの長い名前のエントリ。短い名前のエントリの直前に、最後の部分から逆順に並ぶ
+    // 1つのエントリに名前のUTF-16で13文字が、name1, name2, name3に分かれて入る
+    struct LongNameEntry{
+        uint8_t ord; // 部分の番号（1始まり）。最後の部分には0x40を加える
+        uint8_t name1[10];
+        Attribute attr; // kLongName
+        uint8_t type;
+        uint8_t checksum; // 短い名前のチェックサム
+        uint8_t name2[12];
+        uint16_t first_cluster_low; // 常に0
+        uint8_t name3[4];
+    } __attribute__((packed));
+
+    // 長い名前の最大文字数（UTF-16）
+    static const size_t kMaxNameLength = 255;
+
     extern BPB* boot_volume_image;
     extern unsigned long bytes_per_cluster;
+    // ボリュームを設定し、FATを走査して空きクラスタのビットマップを作る
     void Initialize(void* volume_image);
 
     // 指定されたクラスタの先頭セクタが置いてあるメモリアドレスを返す
@@ -101,14 +132,12 @@ namespace fat{
     // @return 次のクラスタ番号（無い場合は kEndOfClusterchain）
     unsigned long NextCluster(unsigned long cluster);
 
-    // @param name  8+3形式のファイル名（大文字小文字は区別しない）
+    // @param name  ファイル名。長い名前と8+3形式のどちらでもよい（大文字小文字は区別しない）
     // @param directory_cluster  ディレクトリの開始クラスタ（省略するとルートディレクトリから検索する）
     // @return ファイルまたはディレクトリを表すエントリ、と末尾スラッシュを示すフラグの組。見つからなければ nullptr。
     std::pair<DirectoryEntry*, bool>
     FindFile(const char* path, unsigned long directory_cluster=0);
 
-    bool NameIsEqual(const DirectoryEntry& entry, const char* name);
-
     // ファイルの内容をバッファにコピーする
     // @param buf ファイル内容の格納先
     // @param len バッファの大きさ（バイト単位）
@@ -119,16 +148,26 @@ namespace fat{
 
     uint32_t* GetFAT();
 
+    // eoc_clusterを含むチェーンの末尾にn個のクラスタを追加し、新しい末尾のクラスタを返す
+    // 末尾のクラスタを渡せばチェーンをたどらない。空きが足りなければ確保できた分だけ追加する
     unsigned long ExtendCluster(unsigned long eoc_cluster, size_t n);
 
-    DirectoryEntry* AllocateEntry(unsigned long dir_cluster);
-
     void SetFileName(DirectoryEntry& entry, const char* name);
 
+    // ファイルを作る。8+3形式で表せない名前なら長い名前のエントリも作る
     WithError<DirectoryEntry*> CreateFile(const char* path);
 
+    // ディレクトリ内のエントリを、名前（長い名前があればそれ、無ければ8+3形式を整形したもの）と組にして順に返す
+    // 削除済みのエントリ、長い名前のエントリ、ボリュームラベルは含まない
+    std::vector<std::pair<std::string, DirectoryEntry*>> ListDirectory(unsigned long dir_cluster);
+
+    // n個のクラスタからなるチェーンを確保し、先頭のクラスタを返す。なるべく連続した空きから確保する
+    // 空きがなければ0
     unsigned long AllocateClusterChain(size_t n);
 
+    // 空いているクラスタの数
+    unsigned long CountFreeClusters();
+
     class FileDescriptor: public ::FileDescriptor{
         public:
             explicit FileDescriptor(DirectoryEntry& fat_entry);
@@ -138,12 +177,24 @@ namespace fat{
             size_t Load(void* buf, size_t len, size_t offset) override;
 
         private:
+            // 連続したクラスタの並び
+            struct Extent{
+                size_t index; // 先頭のクラスタがファイルの何番目のクラスタか
+                unsigned long cluster; // 先頭のクラスタ番号
+                size_t length; // クラスタ数
+            };
+
             DirectoryEntry& fat_entry_;
             size_t rd_off_ = 0;
-            unsigned long rd_cluster_ = 0;
-            size_t rd_cluster_off_ = 0;
             size_t wr_off_ = 0;
-            unsigned long wr_cluster_ = 0;
-            size_t wr_cluster_off_ = 0;
+            // クラスタチェーンの先頭からの対応表。必要になった分だけFATをたどって作る
+            std::vector<Extent> extents_{};
+
+            // 先頭からnum_clusters個のクラスタを対応表に載せ、載っているクラスタ数を返す
+            size_t MapClusters(size_t num_clusters);
+            // offsetのバイトのアドレスと、そこから連続して読み書きできるバイト数。無ければバイト数は0
+            // @param len  続けて読み書きしたいバイト数。その分まで対応表を作る
+            std::pair<uint8_t*, size_t> Locate(size_t offset, size_t len);
+            size_t CopyOut(void* buf, size_t len, size_t offset);
     };
 }
\ No newline at end of file
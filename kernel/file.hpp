@@ -1,16 +1,32 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include "error.hpp"
+#include "poll_event.hpp"
+
+class PollNotifier;
+class SharedMemory;
 
 class FileDescriptor{
     public:
         virtual ~FileDescriptor() = default;
         virtual size_t Read(void* buf, size_t len)= 0;
         virtual size_t Write(const void* buf, size_t len) = 0;
+        // アプリのバッファbufを書き込む。ページを丸ごとコピーせずに渡せるものはそうしてよい。既定ではWriteと同じ
+        virtual size_t Splice(const void* buf, size_t len) {return Write(buf, len);}
         virtual size_t Size() const = 0;
 
         virtual size_t Load(void* buf, size_t len, size_t offset) = 0;
+
+        // 現在の状態（POLL_EV_IN, POLL_EV_HUP）。通常のファイルはいつでも読み出せる
+        virtual uint32_t PollEvents() {return POLL_EV_IN;}
+        // 状態の変化を知らせるもの。状態が変化しなければnullptr
+        virtual PollNotifier* Notifier() {return nullptr;}
+        // 書き込んでも受け取る相手がいなければtrue（読み手が閉じたパイプなど）
+        virtual bool WriteClosed() {return false;}
+        // 共有メモリを開いたものならその共有メモリ。それ以外はnullptr
+        virtual SharedMemory* SharedMemoryObject() {return nullptr;}
 };
 
 size_t PrintToFD(FileDescriptor& fd, const char* format, ...);
\ No newline at end of file
@@ -0,0 +1,61 @@
+#include "fpu.hpp"
+
+#include "asmfunc.h"
+#include "logger.hpp"
+
+namespace {
+    enum FPUSaveMode{
+        kFXSave = 0,
+        kXSave = 1,
+        kXSaveOpt = 2,
+    };
+
+    const uint64_t kCR0MonitorCoprocessor = 1u << 1;
+    const uint64_t kCR0Emulation = 1u << 2;
+    const uint64_t kCR4OSXSave = 1u << 18;
+    const uint64_t kXCR0SupportedMask = 0b111; // x87, SSE, AVX
+
+    size_t fpu_area_bytes = 512;
+}
+
+extern "C" {
+    uint8_t* volatile fpu_owner_area = nullptr;
+    volatile uint8_t fpu_in_interrupt = 0;
+    int fpu_save_mode = kFXSave;
+    uint64_t fpu_xsave_mask = 0;
+}
+
+size_t FPUAreaBytes(){
+    return fpu_area_bytes;
+}
+
+void InitializeFPU(){
+    // TSが立っているときWAIT/FWAITでも#NMを発生させる
+    SetCR0((GetCR0() & ~kCR0Emulation) | kCR0MonitorCoprocessor);
+
+    uint32_t eax, ebx, ecx, edx;
+    ReadCPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    const bool xsave_supported = (ecx >> 26) & 1;
+    if (!xsave_supported){
+        Log(kInfo, "FPU: XSAVE is not supported, using FXSAVE\n");
+        return;
+    }
+
+    SetCR4(GetCR4() | kCR4OSXSave);
+
+    ReadCPUID(0xd, 0, &eax, &ebx, &ecx, &edx);
+    const uint64_t xcr0 = ((static_cast<uint64_t>(edx) << 32) | eax) & kXCR0SupportedMask;
+    SetXCR0(xcr0);
+    fpu_xsave_mask = xcr0;
+
+    // XCR0を設定した後のEBXが、有効な要素を全て保存するのに必要な大きさ
+    ReadCPUID(0xd, 0, &eax, &ebx, &ecx, &edx);
+    fpu_area_bytes = ebx;
+
+    ReadCPUID(0xd, 1, &eax, &ebx, &ecx, &edx);
+    const bool xsaveopt_supported = eax & 1;
+    fpu_save_mode = xsaveopt_supported ? kXSaveOpt : kXSave;
+
+    Log(kInfo, "FPU: %s, xcr0 = %lx, area = %lu bytes\n",
+        xsaveopt_supported ? "XSAVEOPT" : "XSAVE", xcr0, fpu_area_bytes);
+}
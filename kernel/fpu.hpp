@@ -0,0 +1,18 @@
+// FPU/SSEレジスタの遅延切り替え
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// タスク切り替え時にはFPUの状態を退避・復帰せず、CR0.TSを立てておく。
+// 次にFPU命令を実行したタスクで#NMが発生し、そこで初めて状態を入れ替える
+extern "C" {
+    // FPUレジスタに状態が載っているタスクの退避領域。誰のものでもなければnullptr
+    extern uint8_t* volatile fpu_owner_area;
+}
+
+// タスクごとのFPU退避領域の大きさ[バイト]。64バイト境界に置くこと
+size_t FPUAreaBytes();
+
+void InitializeFPU();
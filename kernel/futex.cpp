@@ -0,0 +1,79 @@
+#include "futex.hpp"
+
+#include <algorithm>
+
+#include "spinlock.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+std::vector<FutexTable::Waiter*>& FutexTable::Bucket(uint64_t key){
+    // 同じページ内の隣り合う値が別のバケットに散らばるよう、4バイト単位でハッシュする
+    return buckets_[((key >> 2) * 0x9e3779b97f4a7c15ull) >> 58];
+}
+
+// 書き込まれていないアプリのデータは他のプロセスとページを共有していて、書き込み時に複製（物理アドレスが変化）される。
+// 待ち合わせに使う値は、待つ前にそのプロセスから書き込まれている前提とする
+WithError<FutexWaitResult> FutexTable::Wait(const uint32_t* addr, uint32_t expected, unsigned long timeout_ticks){
+    // 先に読んでおくと、まだマップされていないページでもここでページフォルトが処理される
+    const volatile uint32_t* p = addr;
+    uint32_t value = *p;
+
+    InterruptGuard guard;
+    auto [key, err] = GetPhysicalAddress(reinterpret_cast<uint64_t>(addr));
+    if (err){
+        return {FutexWaitResult::kValueMismatch, err};
+    }
+    // 読んでから割り込みを禁止するまでにWakeされた場合に備えて読み直す
+    value = *p;
+    if (value != expected){
+        return {FutexWaitResult::kValueMismatch, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    Waiter waiter{key, &task_manager->CurrentTask(), false};
+    auto& bucket = Bucket(key);
+    bucket.push_back(&waiter);
+
+    const unsigned long deadline = timeout_ticks > 0 ? timer_manager->CurrentTick() + timeout_ticks : TaskManager::kNoDeadline;
+    auto sleep_err = task_manager->SleepUntil(deadline, [&waiter]{return waiter.woken;});
+    if (!waiter.woken){
+        bucket.erase(std::find(bucket.begin(), bucket.end(), &waiter));
+    }
+    // タイマーを設定できなければ、無期限に待たせずに失敗を返す
+    if (sleep_err){
+        return {FutexWaitResult::kTimedOut, sleep_err};
+    }
+
+    return {waiter.woken ? FutexWaitResult::kWoken : FutexWaitResult::kTimedOut,
+            MAKE_ERROR(Error::kSuccess)};
+}
+
+WithError<int> FutexTable::Wake(const uint32_t* addr, int n){
+    InterruptGuard guard;
+    auto [key, err] = GetPhysicalAddress(reinterpret_cast<uint64_t>(addr));
+    if (err){
+        return {0, err};
+    }
+
+    auto& bucket = Bucket(key);
+    int num_woken = 0;
+    auto it = bucket.begin();
+    while (it != bucket.end() && num_woken < n){
+        Waiter* w = *it;
+        if (w->key != key){
+            ++it;
+            continue;
+        }
+        w->woken = true;
+        task_manager->Wakeup(w->task);
+        it = bucket.erase(it);
+        ++num_woken;
+    }
+    return {num_woken, MAKE_ERROR(Error::kSuccess)};
+}
+
+FutexTable* futex_table;
+
+void InitializeFutex(){
+    futex_table = new FutexTable;
+}
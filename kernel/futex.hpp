@@ -0,0 +1,45 @@
+// メモリ上の値を条件にタスクを待たせるfutex風の同期機構
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "error.hpp"
+
+class Task;
+
+enum class FutexWaitResult{
+    kWoken, // Wakeで起こされた
+    kValueMismatch, // 呼び出し時に値がexpectedと異なっていた
+    kTimedOut,
+};
+
+// 待ちタスクは、待つ値の物理アドレスをキーにハッシュ表で管理する
+// 物理アドレスで区別するので、異なる仮想アドレスからでも同じ値を共有できる
+class FutexTable{
+    public:
+        static const size_t kNumBuckets = 64;
+
+        // *addrがexpectedであればWakeされるまで眠る。timeout_ticksが0なら無期限
+        // アドレスを変換できなければkNoSuchEntry、タイムアウトのタイマーを設定できなければkFull
+        WithError<FutexWaitResult> Wait(const uint32_t* addr, uint32_t expected, unsigned long timeout_ticks);
+        // addrで待っているタスクを最大n個起こし、起こした数を返す
+        WithError<int> Wake(const uint32_t* addr, int n);
+
+    private:
+        struct Waiter{
+            uint64_t key; // 物理アドレス
+            Task* task;
+            bool woken;
+        };
+
+        std::array<std::vector<Waiter*>, kNumBuckets> buckets_{};
+
+        std::vector<Waiter*>& Bucket(uint64_t key);
+};
+
+extern FutexTable* futex_table;
+
+void InitializeFutex();
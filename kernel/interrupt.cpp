@@ -5,7 +5,12 @@
 #include "asmfunc.h"
 #include "segment.hpp"
 #include "timer.hpp"
+#include "stack_pool.hpp"
 #include "task.hpp"
+#include "trace.hpp"
+#include "usb/xhci/xhci.hpp"
+#include "nvme.hpp"
+#include "worker_pool.hpp"
 #include "graphics.hpp"
 #include "font.hpp"
 
@@ -26,9 +31,42 @@ void NotifyEndOfInterrupt(){
 }
 
 namespace{
+    // アプリ実行中に割り込んだ場合、ハンドラの間だけGSのベースをカーネル用（CPUごとのデータ）に切り替える
+    // ハンドラの先頭で構築すること
+    class KernelGSGuard{
+        public:
+            explicit KernelGSGuard(const InterruptFrame* frame) : from_user_{(frame->cs & 3) == 3}{
+                if (from_user_) __asm__ volatile("swapgs");
+            }
+            ~KernelGSGuard(){
+                if (from_user_) __asm__ volatile("swapgs");
+            }
+
+        private:
+            bool from_user_;
+    };
+
+    // xHCのイベント処理は常に同じワーカーで順に行う
+    const int kXHCIWorker = 0;
+
+    void ProcessXHCIEvents(uint64_t data){
+        usb::xhci::ProcessEvents();
+    }
+
     __attribute__((interrupt))
     void IntHandlerXHCI(InterruptFrame* frame){
-        task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
+        KernelGSGuard gs{frame};
+        worker_pool->QueueOn(kXHCIWorker, ProcessXHCIEvents, 0);
+        NotifyEndOfInterrupt();
+    }
+
+    // 完了を待つタスクを起こすだけなので、割り込みハンドラ内で処理する
+    __attribute__((interrupt))
+    void IntHandlerNVMe(InterruptFrame* frame){
+        KernelGSGuard gs{frame};
+        if (nvme_controller){
+            nvme_controller->HandleInterrupt();
+        }
         NotifyEndOfInterrupt();
     }
 
@@ -69,8 +107,16 @@ namespace{
 
     __attribute__((interrupt))
     void IntHandlerPF(InterruptFrame* frame, uint64_t error_code){
+        KernelGSGuard gs{frame};
         uint64_t cr2 = GetCR2();
-        if (auto err = HandlePageFault(error_code, cr2); !err){
+        Trace(TraceType::kPageFaultBegin, cr2);
+        const uint64_t start = ReadTSC();
+        auto err = HandlePageFault(error_code, cr2);
+        if (task_manager){ // ボリュームの読み込みではタスクの初期化前にも起きる
+            task_manager->CurrentTask().AddPageFaultCycles(ReadTSC() - start);
+        }
+        Trace(TraceType::kPageFaultEnd);
+        if (!err){
             return;
         }
         KillApp(frame);
@@ -80,8 +126,19 @@ namespace{
         while (true) __asm__("hlt");
     }
 
+    // カーネルスタックがガードページに達すると、#PFの割り込みフレームを積めずに#DFになる
+    __attribute__((interrupt))
+    void IntHandlerDF(InterruptFrame* frame, uint64_t error_code){
+        PrintFrame(frame, "#DF");
+        if (stack_pool->InGuardPage(GetCR2())){
+            WriteString(*screen_writer, {500, 16*4}, "kernel stack overflow", {0,0,0});
+        }
+        while (true) __asm__("hlt");
+    }
+
     #define FaultHandlerWithError(fault_name) __attribute__((interrupt)) \
     void IntHandler ## fault_name(InterruptFrame* frame, uint64_t error_code){\
+        KernelGSGuard gs{frame};\
         KillApp(frame);\
         PrintFrame(frame, "#" #fault_name);\
         WriteString(*screen_writer, {500, 16*4}, "ERR", {0,0,0});\
@@ -91,6 +148,7 @@ namespace{
 
     #define FaultHandlerNoError(fault_name) __attribute__((interrupt))\
         void IntHandler ## fault_name(InterruptFrame* frame){\
+            KernelGSGuard gs{frame};\
             KillApp(frame);\
             PrintFrame(frame, "#" #fault_name);\
             while (true) __asm__("hlt");\
@@ -102,8 +160,7 @@ namespace{
         FaultHandlerNoError(OF)
         FaultHandlerNoError(BR)
         FaultHandlerNoError(UD)
-        FaultHandlerNoError(NM)
-        FaultHandlerWithError(DF)
+        //FaultHandlerWithError(DF)
         FaultHandlerWithError(TS)
         FaultHandlerWithError(NP)
         FaultHandlerWithError(SS)
@@ -121,6 +178,7 @@ void InitializeInterrupt(){
         SetIDTEntry(idt[irq], MakeIDTAttr(DescriptorType::kInterruptGate, 0), reinterpret_cast<uint64_t>(handler), kKernelCS);
     };
     set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI);
+    set_idt_entry(InterruptVector::kNVMe, IntHandlerNVMe);
     SetIDTEntry(idt[InterruptVector::kLAPICTimer], MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForTimer), reinterpret_cast<uint64_t>(IntHandlerLAPICTimer), kKernelCS);
     set_idt_entry(0, IntHandlerDE);
     set_idt_entry(1, IntHandlerDB);
@@ -129,7 +187,7 @@ void InitializeInterrupt(){
     set_idt_entry(5, IntHandlerBR);
     set_idt_entry(6, IntHandlerUD);
     set_idt_entry(7, IntHandlerNM);
-    set_idt_entry(8, IntHandlerDF);
+    SetIDTEntry(idt[8], MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForDoubleFault), reinterpret_cast<uint64_t>(IntHandlerDF), kKernelCS);
     set_idt_entry(10, IntHandlerTS);
     set_idt_entry(11, IntHandlerNP);
     set_idt_entry(12, IntHandlerSS);
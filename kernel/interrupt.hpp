@@ -45,6 +45,7 @@ constexpr InterruptDescriptorAttribute MakeIDTAttr(
 }
 
 const int kISTForTimer = 1;
+const int kISTForDoubleFault = 2; // カーネルスタックのオーバーフローでも処理できるよう専用のスタックを使う
 
 void SetIDTEntry(InterruptDescriptor& desc, InterruptDescriptorAttribute attr, uint64_t offset, uint16_t segment_selector);
 
@@ -53,6 +54,7 @@ class InterruptVector {
         enum Number{
             kXHCI = 0x40,
             kLAPICTimer = 0x41,
+            kNVMe = 0x42,
         };
 };
 
@@ -66,4 +68,25 @@ struct InterruptFrame {
 
 void NotifyEndOfInterrupt();
 
+// 割り込みを禁止し、禁止する前のRFLAGSを返す
+inline uint64_t SaveAndDisableInterrupts(){
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags) : : "memory");
+    return rflags;
+}
+
+// 割り込みが許可されているか
+inline bool InterruptsEnabled(){
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpop %0" : "=r"(rflags));
+    return rflags & 0x200;
+}
+
+// SaveAndDisableInterruptsの前の状態に戻す
+inline void RestoreInterrupts(uint64_t rflags){
+    if (rflags & 0x200){
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+
 void InitializeInterrupt();
\ No newline at end of file
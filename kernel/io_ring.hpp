@@ -0,0 +1,55 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // SyscallIoRingSetupで作る、システムコールをまとめて発行するためのリング
+    // 投入リング（SQ）はアプリが書いてカーネルが読み、完了リング（CQ）はカーネルが書いてアプリが読む
+    #define IO_RING_MAX_ENTRIES 256
+
+    // リングから発行できるシステムコールの番号。引数はそれぞれのシステムコールと同じ
+    #define IO_RING_OP_PUT_STRING 0x80000001
+    #define IO_RING_OP_WIN_WRITE_STRING 0x80000004
+    #define IO_RING_OP_WIN_FILL_RECTANGLE 0x80000005
+    #define IO_RING_OP_WIN_REDRAW 0x80000007
+    #define IO_RING_OP_WIN_DRAW_LINE 0x80000008
+    #define IO_RING_OP_CREATE_TIMER 0x8000000b
+    #define IO_RING_OP_READ_FILE 0x8000000d
+
+    struct IoRingSQE{
+        uint64_t op; // IO_RING_OP_*
+        uint64_t args[6];
+        uint64_t user_data; // 完了時にそのまま返す値
+    };
+
+    struct IoRingCQE{
+        uint64_t user_data;
+        uint64_t value; // システムコールの戻り値
+        int32_t error;
+        uint32_t reserved;
+    };
+
+    // リングの先頭にある管理領域。SQEとCQEの配列はそれぞれsq_offset, cq_offsetの位置にある
+    // 各位置は単調に増やし、要素数で割った余りで配列を引く
+    struct IoRing{
+        volatile uint32_t sq_head; // カーネルが進める
+        volatile uint32_t sq_tail; // アプリが進める
+        volatile uint32_t cq_head; // アプリが進める
+        volatile uint32_t cq_tail; // カーネルが進める
+        uint32_t entries; // 各リングの要素数（2のべき乗）
+        uint32_t reserved;
+        uint64_t sq_offset, cq_offset;
+    };
+
+    static inline struct IoRingSQE* IoRingSQEs(struct IoRing* ring){
+        return (struct IoRingSQE*)((char*)ring + ring->sq_offset);
+    }
+
+    static inline struct IoRingCQE* IoRingCQEs(struct IoRing* ring){
+        return (struct IoRingCQE*)((char*)ring + ring->cq_offset);
+    }
+
+#ifdef __cplusplus
+}
+#endif
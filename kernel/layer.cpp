@@ -4,6 +4,7 @@
 #include "console.hpp"
 #include "logger.hpp"
 #include "task.hpp"
+#include "trace.hpp"
 
 namespace{
     template<class T, class U>
@@ -81,10 +82,12 @@ void LayerManager::RemoveLayer(unsigned int id){
 }
 
 void LayerManager::Draw(const Rectangle<int>& area) const{
+    Trace(TraceType::kDrawBegin, 0);
     for (auto layer: layer_stack_){
         layer->DrawTo(back_buffer_, area);
     }
     screen_->Copy(area.pos, back_buffer_, area);
+    Trace(TraceType::kDrawEnd);
 }
 
 void LayerManager::Draw(unsigned int id) const {
@@ -92,6 +95,7 @@ void LayerManager::Draw(unsigned int id) const {
 }
 
 void LayerManager::Draw(unsigned int id, Rectangle<int> area) const{
+    Trace(TraceType::kDrawBegin, id);
     bool draw = false;
     Rectangle<int> window_area;
 
@@ -111,6 +115,7 @@ void LayerManager::Draw(unsigned int id, Rectangle<int> area) const{
         }
     }
     screen_->Copy(window_area.pos, back_buffer_, window_area);
+    Trace(TraceType::kDrawEnd);
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos){
@@ -254,6 +259,7 @@ void ActiveLayer::Activate(unsigned int layer_id){
 
 ActiveLayer* active_layer;
 std::map<unsigned int, uint64_t>* layer_task_map;
+Mutex layer_mutex;
 
 void InitializeLayer(){
     const auto screen_size = ScreenSize();
@@ -9,6 +9,7 @@
 #include "graphics.hpp"
 #include "window.hpp"
 #include "message.hpp"
+#include "mutex.hpp"
 
 class Layer{
     public:
@@ -86,6 +87,8 @@ class ActiveLayer{
 
 extern ActiveLayer* active_layer;
 extern std::map<unsigned int, uint64_t>* layer_task_map;
+// layer_manager, active_layer, layer_task_mapを操作するタスクはこれを保持する
+extern Mutex layer_mutex;
 
 void InitializeLayer();
 void ProcessLayerMessage(const Message& msg);
@@ -14,23 +14,30 @@
 #include "font.hpp"
 #include "console.hpp"
 #include "pci.hpp"
+#include "block.hpp"
 #include "logger.hpp"
 #include "usb/xhci/xhci.hpp"
 #include "interrupt.hpp"
 #include "asmfunc.h"
 #include "segment.hpp"
+#include "per_cpu.hpp"
 #include "paging.hpp"
 #include "memory_manager.hpp"
 #include "window.hpp"
 #include "layer.hpp"
 #include "message.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
 #include "acpi.hpp"
 #include "keyboard.hpp"
+#include "stack_pool.hpp"
 #include "task.hpp"
+#include "worker_pool.hpp"
+#include "futex.hpp"
 #include "terminal.hpp"
 #include "fat.hpp"
 #include "syscall.hpp"
+#include "fpu.hpp"
 
 // メッセージ出力する関数
 int printk(const char* format, ...){
@@ -101,6 +108,17 @@ void InputTextWindow(char c){
     layer_manager->Draw(text_window_layer_id);
 }
 
+// ターミナルを開く。タスクのスタックを確保できなければ開かずに記録だけする
+void StartTerminal(){
+    auto [task, err] = task_manager->NewTask().InitContext(TaskTerminal, 0);
+    if (err){
+        Log(kError, "failed to start terminal: %s\n", err.Name());
+        task_manager->DiscardTask(task);
+        return;
+    }
+    task.Wakeup();
+}
+
 // カーネルでのスタック領域の設定
 alignas(16) uint8_t kernel_main_stack[1024*1024];
 
@@ -116,14 +134,18 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config_
     SetLogLevel(kWarn);
 
     InitializeSegmentation(); // セグメンテーション用のデータをカーネルで管理
+    InitializePerCPU();
     InitializePaging(); // ページングテーブルをカーネルで管理
     InitializeMemoryManager(memory_map); //ヒープ領域の初期化
+    InitializeTrace();
     InitializeTSS();
     InitializeInterrupt();
 
-    fat::Initialize(volume_image);
-    InitializeFont();
     InitializePCI();
+    InitializeBlockDevice();
+    // ブロックデバイスのドライバがあれば、ローダーが読み込んだイメージではなくデバイスのボリュームを使う
+    fat::Initialize(block_cache ? block_cache->Base() : volume_image);
+    InitializeFont();
 
     InitializeLayer();
     InitializeMainWindow();
@@ -140,48 +162,59 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config_
 
     InitializeSyscall();
 
+    InitializeFPU();
+    InitializeStackPool();
     InitializeTask();
     Task& main_task = task_manager->CurrentTask();
+    InitializeWorkerPool();
+    InitializeFutex();
+    StartBlockWriteback();
 
     usb::xhci::Initialize();
     InitializeKeyboard();
     InitializeMouse();
 
     app_loads = new std::map<fat::DirectoryEntry*, AppLoadInfo>;
-    task_manager->NewTask().InitContext(TaskTerminal, 0).Wakeup();
+    StartTerminal();
 
     char str[128];
+    // 相手のメッセージボックスが満杯で送れなかったkLayerFinishの宛先。送れるまで毎回送り直す
+    // 相手がメインタスクへの送信で待っていることがあるので、メインタスクは送信で待たない
+    std::deque<uint64_t> pending_layer_finish;
 
     // queueにある割り込み処理を実行する部分
     while (true) {
-        __asm__("cli");
         const auto tick = timer_manager->CurrentTick();
-        __asm__("sti");
+
+        while (!pending_layer_finish.empty()){
+            const auto err = task_manager->TrySendMessage(pending_layer_finish.front(), Message{Message::kLayerFinish});
+            if (err.Cause() == Error::kFull){
+                break;
+            }
+            pending_layer_finish.pop_front(); // 送れたか、相手が終了した
+        }
 
         sprintf(str, "%010lu", tick);
         FillRectangle(*main_window->InnerWriter(), {20,4}, {8*10,16}, {0xc6,0xc6,0xc6});
         WriteString(*main_window->InnerWriter(), {20,4}, str, {0,0,0});
-        layer_manager->Draw(main_window_layer_id);
-
-        __asm__("cli");
-        auto msg = main_task.ReceiveMessage();
-        if (!msg){
-            main_task.Sleep();
-            __asm__("sti");
-            continue;
+        {
+            MutexGuard lock{layer_mutex};
+            layer_manager->Draw(main_window_layer_id);
         }
 
-        __asm__("sti");
+        auto msg = main_task.WaitMessage();
 
-        switch(msg->type){
-            case Message::kInterruptXHCI:
-                usb::xhci::ProcessEvents();
+        // レイヤーの操作が多いので、メッセージの処理中はまとめてロックを保持する
+        MutexGuard lock{layer_mutex};
+        switch(msg.type){
+            case Message::kMouseInput:
+                // 溜まっている報告はまとめて処理し、カーソルの再描画を1回で済ませる
+                main_task.CoalesceMessages(msg);
+                ProcessMouseInput(msg);
                 break;
             case Message::kTimerTimeout:
-                if (msg->arg.timer.value == kTextboxCursorTimer){
-                    __asm__("cli");
-                    timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer, 1});
-                    __asm__("sti");
+                if (msg.arg.timer.value == kTextboxCursorTimer){
+                    timer_manager->AddTimer(Timer{msg.arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer, 1});
                     textbox_cursor_visible = !textbox_cursor_visible;
                     DrawTextCursor(textbox_cursor_visible);
                     layer_manager->Draw(text_window_layer_id);
@@ -189,32 +222,29 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config_
                 break;
             case Message::kKeyPush:
                 if (auto act = active_layer->GetActive(); act == text_window_layer_id){
-                    if (msg->arg.keyboard.press){
-                        InputTextWindow(msg->arg.keyboard.ascii);
+                    if (msg.arg.keyboard.press){
+                        InputTextWindow(msg.arg.keyboard.ascii);
                     }
-                } else if (msg->arg.keyboard.press && msg->arg.keyboard.keycode == 59){
-                    task_manager->NewTask().InitContext(TaskTerminal, 0).Wakeup();
+                } else if (msg.arg.keyboard.press && msg.arg.keyboard.keycode == 59){
+                    StartTerminal();
                 } else {
-                    __asm__("cli");
                     auto task_it = layer_task_map->find(act);
-                    __asm__("sti");
                     if (task_it != layer_task_map->end()){
-                        __asm__("cli");
-                        task_manager->SendMessage(task_it->second, *msg);
-                        __asm__("sti");
+                        task_manager->SendMessage(task_it->second, msg);
                     } else {
-                        printk("key push not handled: keycode %02x, ascii %02x\n", msg->arg.keyboard.keycode, msg->arg.keyboard.ascii);
+                        printk("key push not handled: keycode %02x, ascii %02x\n", msg.arg.keyboard.keycode, msg.arg.keyboard.ascii);
                     }
                 }
                 break;
             case Message::kLayer:
-                ProcessLayerMessage(*msg);
-                __asm__("cli");
-                task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
-                __asm__("sti");
+                ProcessLayerMessage(msg);
+                if (!pending_layer_finish.empty() ||
+                    task_manager->TrySendMessage(msg.src_task, Message{Message::kLayerFinish}).Cause() == Error::kFull){
+                    pending_layer_finish.push_back(msg.src_task); // 先に送れなかった分を追い越さない
+                }
                 break;
             default:
-                Log(kError, "Unknown message type: %d\n", msg->type);
+                Log(kError, "Unknown message type: %d\n", msg.type);
         }
     }
 }
@@ -2,6 +2,7 @@
 
 #include <bitset>
 #include "logger.hpp"
+#include "spinlock.hpp"
 
 #include <sys/types.h>
 
@@ -9,7 +10,9 @@ BitmapMemoryManager::BitmapMemoryManager()
     : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
 }
 
+// ワーカータスクなど複数のタスクから呼ばれるため、ビットマップの操作中はロックを取る
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames){
+    SpinLockGuard guard{lock_};
     size_t start_frame_id = range_begin_.ID();
     while (true){
         size_t i=0;
@@ -34,6 +37,7 @@ WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames){
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames){
+    SpinLockGuard guard{lock_};
     for (size_t i=0; i<num_frames; ++i){
         SetBit(FrameID{start_frame.ID()+i}, false);
     }
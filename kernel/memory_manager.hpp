@@ -7,6 +7,7 @@
 
 #include "error.hpp"
 #include "memory_map.hpp"
+#include "spinlock.hpp"
 
 namespace{
     constexpr unsigned long long operator""_KiB(unsigned long long kib){
@@ -66,6 +67,7 @@ class BitmapMemoryManager{
         MemoryStat Stat() const;
     
     private:
+        SpinLock lock_{};
         std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
         FrameID range_begin_;
         FrameID range_end_;
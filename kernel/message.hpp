@@ -6,7 +6,6 @@ enum class LayerOperation{
 
 struct Message{
     enum Type {
-        kInterruptXHCI,
         kTimerTimeout,
         kKeyPush,
         kLayer,
@@ -14,7 +13,8 @@ struct Message{
         kMouseMove,
         kMouseButton,
         kWindowActive,
-        kPipe,
+        kWork,
+        kMouseInput,
     } type;
 
     uint64_t src_task;
@@ -56,8 +56,13 @@ struct Message{
         } window_active;
 
         struct {
-            char data[16];
-            uint8_t len;
-        } pipe;
+            void (*func)(uint64_t data);
+            uint64_t data;
+        } work;
+
+        struct {
+            uint8_t buttons;
+            int dx, dy; // 複数の報告をまとめることがあるため、int8_tより広くしておく
+        } mouse_input;
     }arg;
 };
\ No newline at end of file
@@ -98,7 +98,7 @@ void Mouse::SetPosition(Vector2D<int> position){
     layer_manager->Move(layer_id_, position_);
 }
 
-void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y){
+void Mouse::OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y){
     const auto oldpos = position_;
     auto newpos = position_ + Vector2D<int>{displacement_x, displacement_y};
     newpos = ElementMin(newpos, ScreenSize() + Vector2D<int>{-1, -1});
@@ -136,6 +136,10 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
     previous_buttons_ = buttons;
 }
 
+namespace{
+    std::shared_ptr<Mouse> mouse_cursor;
+}
+
 void InitializeMouse() {
     auto mouse_window = std::make_shared<Window>(kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
     mouse_window->SetTransparentColor(kMouseTransparentColor);
@@ -147,9 +151,20 @@ void InitializeMouse() {
     mouse->SetPosition({200, 200});
     layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
 
-    usb::HIDMouseDriver::default_observer = [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
-      mouse->OnInterrupt(buttons, displacement_x, displacement_y);
+    // xHCのイベント処理はワーカーで動くので、レイヤーの操作はメインタスクに任せる
+    usb::HIDMouseDriver::default_observer = [](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+      Message msg{Message::kMouseInput};
+      msg.arg.mouse_input.buttons = buttons;
+      msg.arg.mouse_input.dx = displacement_x;
+      msg.arg.mouse_input.dy = displacement_y;
+      task_manager->SendMessage(1, msg);
     };
 
+    mouse_cursor = mouse;
     active_layer->SetMouseLayer(mouse_layer_id);
+}
+
+void ProcessMouseInput(const Message& msg){
+    const auto& arg = msg.arg.mouse_input;
+    mouse_cursor->OnInterrupt(arg.buttons, arg.dx, arg.dy);
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <memory>
 
 #include "graphics.hpp"
+#include "message.hpp"
 
 const int kMouseCursorWidth = 15;
 const int kMouseCursorHeight = 24;
@@ -15,7 +16,7 @@ void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position);
 class Mouse{
     public:
         Mouse(unsigned int layer_id);
-        void OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+        void OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y);
 
         unsigned int LayerID() const {return layer_id_;}
         void SetPosition(Vector2D<int> position);
@@ -29,4 +30,6 @@ class Mouse{
         uint8_t previous_buttons_{0};
 };
 
-void InitializeMouse();
\ No newline at end of file
+void InitializeMouse();
+// HIDマウスドライバから送られたkMouseInputをメインタスクで処理する
+void ProcessMouseInput(const Message& msg);
\ No newline at end of file
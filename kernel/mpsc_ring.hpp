@@ -0,0 +1,104 @@
+// 複数の送信者と1つの受信者のための、有界でロックフリーなリングバッファ
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// 各セルに通し番号を持たせ、送信者はtail_をCASで進めてセルを予約する。
+// 割り込みハンドラや他のCPUからPushしても、割り込みを禁止する必要はない
+// @tparam T  格納する要素の型（トリビアルにコピーできること）
+// @tparam N  容量（2のべき乗）
+template <class T, size_t N>
+class MPSCRing{
+    static_assert(N >= 2 && (N & (N-1)) == 0, "capacity must be a power of 2");
+
+    public:
+        MPSCRing(){
+            for (size_t i=0; i<N; ++i){
+                cells_[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+        MPSCRing(const MPSCRing&) = delete;
+        MPSCRing& operator=(const MPSCRing&) = delete;
+
+        // 要素を追加する。どの文脈から呼び出してもよい
+        // @return 満杯で追加できなければfalse
+        bool Push(const T& value){
+            uint64_t pos = tail_.load(std::memory_order_relaxed);
+            while (true){
+                Cell& cell = cells_[pos & (N-1)];
+                const uint64_t seq = cell.seq.load(std::memory_order_acquire);
+                const int64_t diff = static_cast<int64_t>(seq - pos);
+                if (diff == 0){
+                    if (tail_.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)){
+                        cell.value = value;
+                        cell.seq.store(pos+1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0){
+                    return false;
+                } else {
+                    pos = tail_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // 先頭の要素を取り出す。受信者1つからのみ呼び出すこと
+        // 予約済みで書き込み途中のセルが先頭にある場合も空として扱う
+        std::optional<T> Pop(){
+            Cell& cell = cells_[head_ & (N-1)];
+            if (cell.seq.load(std::memory_order_acquire) != head_+1){
+                return std::nullopt;
+            }
+
+            T value = cell.value;
+            cell.seq.store(head_+N, std::memory_order_release);
+            ++head_;
+            return value;
+        }
+
+        // 先頭の要素を取り出さずに参照する。Popと同じ受信者からのみ呼び出すこと
+        const T* Peek() const{
+            const Cell& cell = cells_[head_ & (N-1)];
+            if (cell.seq.load(std::memory_order_acquire) != head_+1){
+                return nullptr;
+            }
+            return &cell.value;
+        }
+
+        // 取り出さずに、先頭から届いている要素を順に調べ、predを満たすものがあればtrue
+        // 書き込み途中のセルより後ろは調べない。Popと同じ受信者からのみ呼び出すこと
+        template <class Pred>
+        bool Any(Pred pred) const{
+            for (uint64_t pos = head_; ; ++pos){
+                const Cell& cell = cells_[pos & (N-1)];
+                if (cell.seq.load(std::memory_order_acquire) != pos+1){
+                    return false;
+                }
+                if (pred(cell.value)){
+                    return true;
+                }
+            }
+        }
+
+        // おおよその要素数。送信中の要素を含むことがある
+        size_t Size() const{
+            return tail_.load(std::memory_order_relaxed) - head_;
+        }
+
+        static constexpr size_t Capacity() {return N;}
+
+    private:
+        struct Cell{
+            std::atomic<uint64_t> seq;
+            T value;
+        };
+
+        std::array<Cell, N> cells_;
+        alignas(64) std::atomic<uint64_t> tail_{0};
+        alignas(64) uint64_t head_{0};
+};
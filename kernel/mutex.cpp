@@ -0,0 +1,32 @@
+#include "mutex.hpp"
+
+#include "spinlock.hpp"
+#include "task.hpp"
+
+void Mutex::Lock(){
+    InterruptGuard guard;
+    if (!locked_){
+        locked_ = true;
+        return;
+    }
+
+    // 並ぶのは1回だけ。メッセージの受信などUnlock以外で起こされても、渡されるまで眠り直す
+    Waiter waiter{&task_manager->CurrentTask(), false};
+    waiters_.push_back(&waiter);
+    while (!waiter.granted){
+        waiter.task->Sleep();
+    }
+}
+
+void Mutex::Unlock(){
+    InterruptGuard guard;
+    if (waiters_.empty()){
+        locked_ = false;
+        return;
+    }
+    // locked_は立てたまま、先頭の待ち手にロックを渡す
+    Waiter* waiter = waiters_.front();
+    waiters_.erase(waiters_.begin());
+    waiter->granted = true;
+    task_manager->Wakeup(waiter->task);
+}
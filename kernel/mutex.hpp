@@ -0,0 +1,36 @@
+// 待つ間スリープする排他ロック
+
+#pragma once
+
+#include <vector>
+
+class Task;
+
+// 長くかかる処理（レイヤーの描画など）を守るためのロック
+// 割り込みを禁止したままにしないので、割り込みハンドラからは使えない
+class Mutex{
+    public:
+        void Lock();
+        void Unlock();
+
+    private:
+        // 待っているタスク。Unlockはロックを解放せずに先頭の待ち手へ直接渡し、grantedを立てる
+        struct Waiter{
+            Task* task;
+            bool granted;
+        };
+
+        bool locked_{false};
+        std::vector<Waiter*> waiters_{};
+};
+
+class MutexGuard{
+    public:
+        explicit MutexGuard(Mutex& mutex) : mutex_{mutex} {mutex_.Lock();}
+        ~MutexGuard() {mutex_.Unlock();}
+        MutexGuard(const MutexGuard&) = delete;
+        MutexGuard& operator=(const MutexGuard&) = delete;
+
+    private:
+        Mutex& mutex_;
+};
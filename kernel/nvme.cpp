@@ -0,0 +1,473 @@
+#include "nvme.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+
+nvme::Controller* nvme_controller;
+
+namespace {
+    // コントローラのレジスタ（BAR0からのオフセット）
+    const size_t kCAP = 0x00;
+    const size_t kCC = 0x14;
+    const size_t kCSTS = 0x1c;
+    const size_t kAQA = 0x24;
+    const size_t kASQ = 0x28;
+    const size_t kACQ = 0x30;
+    const size_t kDoorbellBase = 0x1000;
+
+    // 管理コマンド
+    const uint8_t kAdminCreateIOSQ = 0x01;
+    const uint8_t kAdminCreateIOCQ = 0x05;
+    const uint8_t kAdminIdentify = 0x06;
+    const uint8_t kAdminSetFeatures = 0x09;
+    const uint32_t kFeatureNumberOfQueues = 0x07;
+    const uint32_t kFeatureInterruptCoalescing = 0x08;
+
+    // I/Oコマンド
+    const uint8_t kCommandWrite = 0x01;
+    const uint8_t kCommandRead = 0x02;
+
+    const uint32_t kNamespaceID = 1;
+    // レジスタの状態が変わるのを待つ回数の上限。タイマーの初期化前にも使うので、時間ではなく回数で数える
+    const unsigned long kMaxWaitLoops = 100'000'000;
+
+    uint64_t AllocateZeroedFrame(){
+        auto [frame, err] = memory_manager->Allocate(1);
+        if (err){
+            return 0;
+        }
+        memset(frame.Frame(), 0, kBytesPerFrame);
+        return reinterpret_cast<uint64_t>(frame.Frame());
+    }
+}
+
+namespace nvme{
+    std::unique_ptr<Controller> Controller::Probe(pci::Device& dev){
+        if (!dev.class_code.Match(0x01u, 0x08u, 0x02u)){ // 大容量記憶装置, NVM, NVMe
+            return nullptr;
+        }
+
+        auto [bar, err] = pci::ReadBar(dev, 0);
+        const uint64_t mmio = bar & ~static_cast<uint64_t>(0xf);
+        if (err || (bar & 1) != 0 || mmio >= kPageDirectoryCount * (1ul << 30)){
+            Log(kError, "nvme %d.%d.%d: BAR0 %lx is not reachable\n", dev.bus, dev.device, dev.function, bar);
+            return nullptr;
+        }
+        // コマンドレジスタでメモリ空間とバスマスタを有効にする
+        pci::WriteConfReg(dev, 0x04, pci::ReadConfReg(dev, 0x04) | 0x06);
+
+        std::unique_ptr<Controller> ctrl{new Controller{mmio, dev}};
+        if (auto err = ctrl->Initialize()){
+            Log(kError, "nvme %d.%d.%d: %s\n", dev.bus, dev.device, dev.function, err.Name());
+            return nullptr;
+        }
+        if (ctrl->interrupts_ && nvme_controller == nullptr){
+            nvme_controller = ctrl.get();
+        }
+        return ctrl;
+    }
+
+    Controller::~Controller(){
+        // 割り込みを止めてから、コントローラを止めてDMAを終わらせる
+        if (interrupts_){
+            pci::DisableMSI(dev_);
+        }
+        if (nvme_controller == this){
+            nvme_controller = nullptr;
+        }
+        auto cc = reinterpret_cast<volatile uint32_t*>(mmio_ + kCC);
+        *cc = *cc & ~1u;
+        if (!WaitReady(false)){
+            // まだDMAするかもしれないので、キューのメモリは解放しない
+            Log(kError, "nvme %d.%d.%d: controller did not stop\n", dev_.bus, dev_.device, dev_.function);
+            return;
+        }
+
+        FreeQueuePair(admin_);
+        for (auto& qp : io_){
+            FreeQueuePair(qp);
+        }
+    }
+
+    Error Controller::Read(uint64_t sector, void* buf, size_t num_sectors){
+        const uint64_t addr = reinterpret_cast<uint64_t>(buf);
+        Buffer b{{}, addr % kFrameBytes};
+        for (uint64_t page = addr - b.offset; page < addr + num_sectors * kSectorBytes; page += kFrameBytes){
+            b.pages.push_back(page);
+        }
+        return Transfer(kCommandRead, sector, b, num_sectors);
+    }
+
+    Error Controller::Write(uint64_t sector, const void* buf, size_t num_sectors){
+        const uint64_t addr = reinterpret_cast<uint64_t>(buf);
+        Buffer b{{}, addr % kFrameBytes};
+        for (uint64_t page = addr - b.offset; page < addr + num_sectors * kSectorBytes; page += kFrameBytes){
+            b.pages.push_back(page);
+        }
+        return Transfer(kCommandWrite, sector, b, num_sectors);
+    }
+
+    Error Controller::ReadFrames(uint64_t sector, const std::vector<uint64_t>& frames, size_t num_sectors){
+        return Transfer(kCommandRead, sector, Buffer{frames, 0}, num_sectors);
+    }
+
+    void Controller::HandleInterrupt(){
+        {
+            SpinLockGuard lock{admin_.lock};
+            Reap(admin_);
+        }
+        for (int i = 0; i < num_io_; ++i){
+            SpinLockGuard lock{io_[i].lock};
+            Reap(io_[i]);
+        }
+    }
+
+    Error Controller::Initialize(){
+        auto reg32 = [this](size_t offset){return reinterpret_cast<volatile uint32_t*>(mmio_ + offset);};
+        auto reg64 = [this](size_t offset){return reinterpret_cast<volatile uint64_t*>(mmio_ + offset);};
+
+        const uint64_t cap = *reg64(kCAP);
+        doorbell_stride_ = 4u << ((cap >> 32) & 0xf);
+        const uint16_t depth = std::min<uint32_t>(kMaxQueueDepth, (cap & 0xffff) + 1);
+
+        *reg32(kCC) = *reg32(kCC) & ~1u;
+        if (!WaitReady(false)){
+            return MAKE_ERROR(Error::kUnknownDevice);
+        }
+
+        if (auto err = SetupQueuePair(admin_, 0, depth)){
+            return err;
+        }
+        *reg32(kAQA) = (depth - 1u) << 16 | (depth - 1u);
+        *reg64(kASQ) = reinterpret_cast<uint64_t>(admin_.sq);
+        *reg64(kACQ) = reinterpret_cast<uint64_t>(admin_.cq);
+        // EN=1, 4KiBページ、NVMコマンドセット、投入エントリ64バイト（2^6）、完了エントリ16バイト（2^4）
+        *reg32(kCC) = 1u | 6u << 16 | 4u << 20;
+        if (!WaitReady(true)){
+            return MAKE_ERROR(Error::kUnknownDevice);
+        }
+
+        const uint64_t identify = AllocateZeroedFrame();
+        if (identify == 0){
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+        auto id_data = reinterpret_cast<const uint8_t*>(identify);
+        auto free_identify = [identify]{memory_manager->Free(FrameID{identify / kBytesPerFrame}, 1);};
+
+        // コントローラの情報: MDTS（最大転送サイズ、最小ページの2のべき乗倍）
+        SubmissionEntry cmd{};
+        cmd.cdw0 = kAdminIdentify;
+        cmd.prp1 = identify;
+        cmd.cdw10 = 1;
+        if (auto [dw0, err] = AdminCommand(cmd); err){
+            free_identify();
+            return err;
+        }
+        if (const uint8_t mdts = id_data[77]; mdts != 0 && mdts < 20){
+            max_transfer_bytes_ = std::min<size_t>(kMaxTransferBytes, kFrameBytes << mdts);
+        }
+
+        // 名前空間の情報: 大きさとLBAの形式
+        cmd = {};
+        cmd.cdw0 = kAdminIdentify;
+        cmd.nsid = kNamespaceID;
+        cmd.prp1 = identify;
+        cmd.cdw10 = 0;
+        if (auto [dw0, err] = AdminCommand(cmd); err){
+            free_identify();
+            return err;
+        }
+        uint64_t nsze;
+        memcpy(&nsze, &id_data[0], sizeof(nsze));
+        uint32_t lbaf;
+        memcpy(&lbaf, &id_data[128 + 4 * (id_data[26] & 0xf)], sizeof(lbaf));
+        free_identify();
+        if (((lbaf >> 16) & 0xff) != 9){ // LBAが512バイトの名前空間にのみ対応する
+            return MAKE_ERROR(Error::kNotImplemented);
+        }
+        num_sectors_ = nsze;
+
+        // I/OキューをCPUの数だけ要求する。応答は実際に割り当てられた数（0始まり）
+        const uint32_t want = std::min(NumCPUs(), kMaxCPUs);
+        cmd = {};
+        cmd.cdw0 = kAdminSetFeatures;
+        cmd.cdw10 = kFeatureNumberOfQueues;
+        cmd.cdw11 = (want - 1) << 16 | (want - 1);
+        auto [num_queues, err] = AdminCommand(cmd);
+        if (err){
+            return err;
+        }
+        num_io_ = std::min({want, (num_queues & 0xffff) + 1, (num_queues >> 16) + 1});
+
+        // 全ての完了キューで割り込みベクタ0を使う。MSIもMSI-Xも使えなければポーリングだけで動かす
+        interrupts_ = !pci::ConfigureMSIFixedDestination(
+            dev_, ThisCPU().lapic_id, pci::MSITriggerMode::kEdge,
+            pci::MSIDeliveryMode::kFixed, InterruptVector::kNVMe, 0);
+        if (interrupts_){
+            cmd = {};
+            cmd.cdw0 = kAdminSetFeatures;
+            cmd.cdw10 = kFeatureInterruptCoalescing;
+            cmd.cdw11 = static_cast<uint32_t>(kCoalescingTime) << 8 | (kCoalescingThreshold - 1);
+            if (auto [dw0, err] = AdminCommand(cmd); err){
+                return err;
+            }
+        }
+
+        for (int i = 0; i < num_io_; ++i){
+            const uint16_t qid = i + 1;
+            if (auto err = SetupQueuePair(io_[i], qid, depth)){
+                return err;
+            }
+
+            cmd = {};
+            cmd.cdw0 = kAdminCreateIOCQ;
+            cmd.prp1 = reinterpret_cast<uint64_t>(io_[i].cq);
+            cmd.cdw10 = (depth - 1u) << 16 | qid;
+            cmd.cdw11 = (interrupts_ ? 2u : 0u) | 1u; // IEN, PC（物理的に連続）。割り込みベクタは0
+            if (auto [dw0, err] = AdminCommand(cmd); err){
+                return err;
+            }
+
+            cmd = {};
+            cmd.cdw0 = kAdminCreateIOSQ;
+            cmd.prp1 = reinterpret_cast<uint64_t>(io_[i].sq);
+            cmd.cdw10 = (depth - 1u) << 16 | qid;
+            cmd.cdw11 = static_cast<uint32_t>(qid) << 16 | 1u; // 対応する完了キュー, PC
+            if (auto [dw0, err] = AdminCommand(cmd); err){
+                return err;
+            }
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Error Controller::SetupQueuePair(QueuePair& qp, uint16_t id, uint16_t depth){
+        qp.sq = reinterpret_cast<volatile SubmissionEntry*>(AllocateZeroedFrame());
+        qp.cq = reinterpret_cast<volatile CompletionEntry*>(AllocateZeroedFrame());
+        if (qp.sq == nullptr || qp.cq == nullptr){
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+
+        qp.id = id;
+        qp.depth = depth;
+        qp.sq_doorbell = reinterpret_cast<volatile uint32_t*>(mmio_ + kDoorbellBase + (2 * id) * doorbell_stride_);
+        qp.cq_doorbell = reinterpret_cast<volatile uint32_t*>(mmio_ + kDoorbellBase + (2 * id + 1) * doorbell_stride_);
+        qp.slots.resize(depth - 1);
+        for (auto& slot : qp.slots){
+            slot = {false, false, 0, 0, nullptr, false, reinterpret_cast<uint64_t*>(AllocateZeroedFrame())};
+            if (slot.prp_list == nullptr){
+                return MAKE_ERROR(Error::kNoEnoughMemory);
+            }
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    void Controller::FreeQueuePair(QueuePair& qp){
+        auto free_frame = [](const volatile void* p){
+            if (p){
+                memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(p) / kBytesPerFrame}, 1);
+            }
+        };
+        free_frame(qp.sq);
+        free_frame(qp.cq);
+        for (auto& slot : qp.slots){
+            free_frame(slot.prp_list);
+        }
+        qp.sq = nullptr;
+        qp.cq = nullptr;
+        qp.slots.clear();
+    }
+
+    bool Controller::WaitReady(bool ready){
+        auto csts = reinterpret_cast<volatile uint32_t*>(mmio_ + kCSTS);
+        for (unsigned long i = 0; i < kMaxWaitLoops; ++i){
+            if (*csts & 2){ // CFS: 致命的な状態
+                return false;
+            }
+            if ((*csts & 1) == ready){
+                return true;
+            }
+            __asm__ volatile("pause");
+        }
+        return false;
+    }
+
+    WithError<uint32_t> Controller::AdminCommand(SubmissionEntry cmd){
+        int slot;
+        unsigned long loops = 0;
+        while ((slot = Submit(admin_, cmd, {}, false)) < 0){
+            if (++loops >= kMaxWaitLoops){
+                return {0, MAKE_ERROR(Error::kTransferFailed)};
+            }
+            {
+                SpinLockGuard lock{admin_.lock};
+                Reap(admin_);
+            }
+            __asm__ volatile("pause");
+        }
+        return Wait(admin_, slot, false);
+    }
+
+    int Controller::Submit(QueuePair& qp, SubmissionEntry cmd, const std::vector<uint64_t>& prp_list, bool sleep){
+        SpinLockGuard lock{qp.lock};
+        const auto end = sleep && qp.slots.size() > 1 ? qp.slots.end() - 1 : qp.slots.end();
+        auto it = std::find_if(qp.slots.begin(), end, [](const auto& s){return !s.busy;});
+        if (it == end){
+            return -1;
+        }
+        const int slot = it - qp.slots.begin();
+
+        if (!prp_list.empty()){
+            memcpy(it->prp_list, prp_list.data(), prp_list.size() * sizeof(uint64_t));
+            cmd.prp2 = reinterpret_cast<uint64_t>(it->prp_list);
+        }
+
+        it->busy = true;
+        it->done = false;
+        it->abandoned = false;
+        it->waiter = sleep ? &task_manager->CurrentTask() : nullptr;
+        cmd.cdw0 = (cmd.cdw0 & 0xffff) | static_cast<uint32_t>(slot) << 16;
+        const_cast<SubmissionEntry&>(qp.sq[qp.sq_tail]) = cmd;
+        qp.sq_tail = (qp.sq_tail + 1) % qp.depth;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        *qp.sq_doorbell = qp.sq_tail;
+        return slot;
+    }
+
+    void Controller::Reap(QueuePair& qp){
+        bool reaped = false;
+        while ((qp.cq[qp.cq_head].status & 1) == qp.phase){
+            const uint16_t cid = qp.cq[qp.cq_head].cid;
+            if (cid < qp.slots.size()){
+                auto& slot = qp.slots[cid];
+                slot.status = qp.cq[qp.cq_head].status >> 1;
+                slot.result = qp.cq[qp.cq_head].dw0;
+                slot.done = true;
+                if (slot.abandoned){
+                    slot.busy = false;
+                } else if (slot.waiter){
+                    task_manager->Wakeup(slot.waiter);
+                }
+            }
+            if (++qp.cq_head == qp.depth){
+                qp.cq_head = 0;
+                qp.phase ^= 1;
+            }
+            reaped = true;
+        }
+        if (reaped){
+            *qp.cq_doorbell = qp.cq_head;
+        }
+    }
+
+    WithError<uint32_t> Controller::Wait(QueuePair& qp, int slot, bool sleep){
+        auto& s = qp.slots[slot];
+        if (sleep){
+            // 確かめてから眠るまでの間に完了の割り込みが来ないよう、割り込みを禁止しておく
+            InterruptGuard guard;
+            while (!s.done){
+                task_manager->CurrentTask().Sleep();
+            }
+        } else {
+            // #PFの処理中など割り込み禁止で呼ばれるので、応答しないコントローラを待ち続けない
+            for (unsigned long i = 0; ; ++i){
+                {
+                    SpinLockGuard lock{qp.lock};
+                    Reap(qp);
+                    if (s.done){
+                        break;
+                    }
+                    if (i >= kMaxWaitLoops){
+                        s.abandoned = true;
+                        Log(kError, "nvme: queue %d command timed out\n", qp.id);
+                        return {0, MAKE_ERROR(Error::kTransferFailed)};
+                    }
+                }
+                __asm__ volatile("pause");
+            }
+        }
+
+        SpinLockGuard lock{qp.lock};
+        s.busy = false;
+        if (s.status != 0){
+            Log(kWarn, "nvme: queue %d command failed: status %04x\n", qp.id, s.status);
+            return {s.result, MAKE_ERROR(Error::kTransferFailed)};
+        }
+        return {s.result, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    Error Controller::Transfer(uint8_t opcode, uint64_t sector, const Buffer& buf, size_t num_sectors){
+        if (sector + num_sectors > num_sectors_){
+            return MAKE_ERROR(Error::kIndexOutOfRange);
+        }
+
+        const bool sleep = interrupts_ && task_manager && InterruptsEnabled();
+        QueuePair& qp = io_[ThisCPU().id % num_io_];
+        const size_t max_sectors = max_transfer_bytes_ / kSectorBytes;
+        std::vector<uint64_t> prp_list;
+
+        // 空いた枠がある限りコマンドを投入し、古いものから完了を待つ
+        std::deque<int> inflight;
+        Error result = MAKE_ERROR(Error::kSuccess);
+        size_t submitted = 0;
+        unsigned long idle_loops = 0;
+        while ((submitted < num_sectors && !result) || !inflight.empty()){
+            while (submitted < num_sectors && !result){
+                const size_t n = std::min(num_sectors - submitted, max_sectors);
+                const size_t begin = buf.offset + submitted * kSectorBytes;
+                const size_t first_page = begin / kFrameBytes;
+                const size_t last_page = (begin + n * kSectorBytes - 1) / kFrameBytes;
+
+                // PRP1は先頭のページ（途中からでよい）。2ページならPRP2に2ページ目、
+                // 3ページ以上ならPRP2は2ページ目以降を並べたPRPリストを指す
+                SubmissionEntry cmd{};
+                cmd.cdw0 = opcode;
+                cmd.nsid = kNamespaceID;
+                cmd.prp1 = buf.pages[first_page] + begin % kFrameBytes;
+                prp_list.clear();
+                if (last_page == first_page + 1){
+                    cmd.prp2 = buf.pages[last_page];
+                } else if (last_page > first_page + 1){
+                    prp_list.assign(&buf.pages[first_page + 1], &buf.pages[last_page] + 1);
+                }
+                const uint64_t lba = sector + submitted;
+                cmd.cdw10 = lba & 0xffffffffu;
+                cmd.cdw11 = lba >> 32;
+                cmd.cdw12 = n - 1;
+
+                const int slot = Submit(qp, cmd, prp_list, sleep);
+                if (slot < 0){
+                    break;
+                }
+                inflight.push_back(slot);
+                submitted += n;
+            }
+
+            if (inflight.empty()){
+                // 他のタスクのコマンドで枠が埋まっている
+                if (++idle_loops >= kMaxWaitLoops){
+                    return MAKE_ERROR(Error::kTransferFailed);
+                }
+                {
+                    SpinLockGuard lock{qp.lock};
+                    Reap(qp);
+                }
+                __asm__ volatile("pause");
+                continue;
+            }
+            idle_loops = 0;
+            auto [dw0, err] = Wait(qp, inflight.front(), sleep);
+            inflight.pop_front();
+            if (err && !result){
+                result = err;
+            }
+        }
+        return result;
+    }
+}
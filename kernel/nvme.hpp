@@ -0,0 +1,130 @@
+// NVMeのドライバ
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "block.hpp"
+#include "pci.hpp"
+#include "per_cpu.hpp"
+#include "spinlock.hpp"
+
+class Task;
+
+namespace nvme{
+    struct SubmissionEntry{
+        uint32_t cdw0; // 7:0: オペコード、31:16: コマンドID
+        uint32_t nsid;
+        uint32_t cdw2, cdw3;
+        uint64_t mptr;
+        uint64_t prp1, prp2;
+        uint32_t cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+    } __attribute__((packed));
+
+    struct CompletionEntry{
+        uint32_t dw0;
+        uint32_t dw1;
+        uint16_t sq_head;
+        uint16_t sq_id;
+        uint16_t cid;
+        uint16_t status; // 0: フェーズタグ、15:1: 状態
+    } __attribute__((packed));
+
+    // 投入キューと完了キューの組。管理用（ID 0）と、CPUごとのI/O用がある
+    struct QueuePair{
+        // 投入したコマンドの完了を待つための枠。コマンドIDは枠の番号
+        struct Slot{
+            bool busy;
+            volatile bool done;
+            uint16_t status;
+            uint32_t result; // 完了エントリのDW0
+            Task* waiter; // 完了時に起こすタスク。ポーリングで待つならnullptr
+            bool abandoned; // 待ちきれずに諦めた。完了が届いたらReapで空ける
+            uint64_t* prp_list; // 3ページ以上にまたがる転送に使うPRPリスト（1フレーム）
+        };
+
+        uint16_t id{0};
+        uint16_t depth{0};
+        volatile SubmissionEntry* sq{nullptr};
+        volatile CompletionEntry* cq{nullptr};
+        volatile uint32_t* sq_doorbell{nullptr};
+        volatile uint32_t* cq_doorbell{nullptr};
+        uint16_t sq_tail{0}, cq_head{0};
+        uint16_t phase{1};
+        SpinLock lock{};
+        std::vector<Slot> slots{}; // depth-1個。投入キューが溢れることはない。最後の枠はポーリングで待つ側に残す
+    };
+
+    // PCIのNVMeコントローラの名前空間1を、ブロックデバイスとして読み書きする
+    // I/OキューはCPUごとに1組作り、コマンドは実行中のCPUの組へ投入する
+    // 割り込み（MSI/MSI-X）が使えて、呼び出し時に割り込みが許可されていれば完了までスリープし、
+    // そうでなければ（ページフォールトの処理中など）完了キューをポーリングする
+    class Controller : public BlockDevice{
+        public:
+            // 割り込みの集約: 完了がこの数だけ溜まるか、この時間（100マイクロ秒単位）が経つまで割り込みを遅らせる
+            static const uint8_t kCoalescingThreshold = 8;
+            static const uint8_t kCoalescingTime = 1;
+            static const uint16_t kMaxQueueDepth = 64;
+            static const size_t kMaxTransferBytes = 256 * 1024; // 1つのコマンドで転送する最大バイト数
+
+            // devがNVMeコントローラなら初期化して返す。違うか初期化に失敗すればnullptr
+            static std::unique_ptr<Controller> Probe(pci::Device& dev);
+            // コントローラと割り込みを止め、キューのフレームを解放する
+            ~Controller();
+
+            uint64_t NumSectors() const override {return num_sectors_;}
+            Error Read(uint64_t sector, void* buf, size_t num_sectors) override;
+            Error Write(uint64_t sector, const void* buf, size_t num_sectors) override;
+            // 全体を1つの転送として、最大kMaxTransferBytesずつのコマンドに分けて並行に投入する
+            Error ReadFrames(uint64_t sector, const std::vector<uint64_t>& frames, size_t num_sectors) override;
+
+            // 割り込みハンドラから呼ぶ。全ての完了キューを処理し、完了を待つタスクを起こす
+            void HandleInterrupt();
+
+        private:
+            // 転送するメモリ。pagesはページ境界のアドレスの並びで、データはpages[0]+offsetから始まる
+            struct Buffer{
+                std::vector<uint64_t> pages;
+                size_t offset;
+            };
+
+            volatile uint8_t* mmio_;
+            pci::Device dev_;
+            uint32_t doorbell_stride_{4};
+            bool interrupts_{false};
+            size_t max_transfer_bytes_{kMaxTransferBytes};
+            uint64_t num_sectors_{0};
+            QueuePair admin_{};
+            std::array<QueuePair, kMaxCPUs> io_{};
+            int num_io_{0};
+
+            Controller(uintptr_t mmio, const pci::Device& dev)
+                : mmio_{reinterpret_cast<volatile uint8_t*>(mmio)}, dev_{dev} {}
+            Error Initialize();
+            // CSTS.RDYがreadyになるのを待つ。致命的な状態になるか、待ちきれなければfalse
+            bool WaitReady(bool ready);
+            // 確保できたフレームは、失敗してもqpに記録する（デストラクタで解放する）
+            Error SetupQueuePair(QueuePair& qp, uint16_t id, uint16_t depth);
+            void FreeQueuePair(QueuePair& qp);
+            // 管理コマンドを実行し、完了エントリのDW0を返す
+            WithError<uint32_t> AdminCommand(SubmissionEntry cmd);
+
+            // 空いた枠があればコマンドを投入して枠の番号を返す。無ければ-1
+            // sleepなら最後の枠は使わない（#PF内などでポーリングする側が、眠ったタスクの持つ枠を待ち続けないように）
+            // prp_listが空でなければ枠のPRPリストへ写し、PRP2をそのリストに向ける
+            int Submit(QueuePair& qp, SubmissionEntry cmd, const std::vector<uint64_t>& prp_list, bool sleep);
+            // 完了キューに届いた完了エントリを処理する。qp.lockを取ってから呼ぶこと
+            void Reap(QueuePair& qp);
+            // 枠のコマンドの完了を待って枠を空け、結果を返す
+            // ポーリングではkMaxWaitLoops回までしか待たず、完了しなければ枠を諦めてkTransferFailedを返す
+            WithError<uint32_t> Wait(QueuePair& qp, int slot, bool sleep);
+            Error Transfer(uint8_t opcode, uint64_t sector, const Buffer& buf, size_t num_sectors);
+    };
+}
+
+// 割り込みを受けるNVMeコントローラ。無ければnullptr
+extern nvme::Controller* nvme_controller;
@@ -1,9 +1,12 @@
 #include "paging.hpp"
 
 #include <array>
+#include <map>
 
 #include "asmfunc.h"
+#include "block.hpp"
 #include "memory_manager.hpp"
+#include "spinlock.hpp"
 #include "task.hpp"
 
 #include "logger.hpp"
@@ -27,7 +30,8 @@ void SetupIdentityPageTable(){
         }
     }
     ResetCR3();
-    SetCR0(GetCR0() & 0xfffeffff);
+    // CR0.WP: カーネルからの書き込みでも書き込み禁止のページではコピーオンライトを起こす
+    SetCR0(GetCR0() | 0x10000);
 }
 
 void InitializePaging(){
@@ -39,6 +43,31 @@ void ResetCR3(){
 }
 
 namespace {
+    // コピーせずに共有しているフレームの参照数。キー: フレームの物理アドレス
+    // 書き込み可能なページのフレームはそのページが専有しているので、ここには載らない
+    SpinLock shared_frames_lock;
+    std::map<uint64_t, unsigned int>* shared_frames;
+
+    // 参照を1つ手放し、最後の参照ならフレームを解放する。共有していないフレームならfalse
+    bool ReleaseFrameRef(uint64_t frame_addr){
+        {
+            SpinLockGuard lock{shared_frames_lock};
+            if (shared_frames == nullptr){
+                return false;
+            }
+            auto it = shared_frames->find(frame_addr);
+            if (it == shared_frames->end()){
+                return false;
+            }
+            if (--it->second > 0){
+                return true;
+            }
+            shared_frames->erase(it);
+        }
+        memory_manager->Free(FrameID{frame_addr / kBytesPerFrame}, 1);
+        return true;
+    }
+
     WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry){
         if (entry.bits.present){
             return {entry.Pointer(), MAKE_ERROR(Error::kSuccess)};
@@ -55,7 +84,7 @@ namespace {
         return {child_map, MAKE_ERROR(Error::kSuccess)};
     }
 
-    WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kpages, bool writable){
+    WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kpages, bool writable, bool user = true){
         while (num_4kpages > 0){
             const auto entry_index = addr.Part(page_map_level);
 
@@ -63,14 +92,14 @@ namespace {
             if (err){
                 return {num_4kpages, err};
             }
-            page_map[entry_index].bits.user = 1;
+            page_map[entry_index].bits.user = user;
 
             if (page_map_level == 1){
                 page_map[entry_index].bits.writable = writable;
                 --num_4kpages;
             } else {
                 page_map[entry_index].bits.writable = true;
-                auto [num_remain_pages, err] = SetupPageMap(child_map, page_map_level-1, addr, num_4kpages, writable);
+                auto [num_remain_pages, err] = SetupPageMap(child_map, page_map_level-1, addr, num_4kpages, writable, user);
                 if (err){
                     return {num_4kpages, err};
                 }
@@ -103,12 +132,16 @@ namespace {
                 }
             }
 
-            if (entry.bits.writable){
-                const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
+            const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
+            if (page_map_level == 1 && entry.bits.shared){
+                ReleaseFrameRef(entry_addr);
+            } else if (entry.bits.writable){
                 const FrameID map_frame(entry_addr / kBytesPerFrame);
                 if (auto err = memory_manager->Free(map_frame, 1)){
                     return err;
                 }
+            } else if (page_map_level == 1){
+                ReleaseFrameRef(entry_addr);
             }
             page_map[i].data = 0;
         }
@@ -150,14 +183,53 @@ namespace {
         return SetPageContent(table[i].Pointer(), part-1, addr, content);
     }
 
+    // pml4の下でvaddrを含む4KiBページのエントリを返す。マップされていなければnullptr
+    PageMapEntry* FindPageEntry(PageMapEntry* pml4, uint64_t vaddr){
+        const LinearAddress4Level addr{vaddr};
+        auto table = pml4;
+        for (int level = 4; level > 1; --level){
+            const auto entry = table[addr.Part(level)];
+            if (!entry.bits.present || entry.bits.huge_page){
+                return nullptr;
+            }
+            table = entry.Pointer();
+        }
+        PageMapEntry* entry = &table[addr.Part(1)];
+        return entry->bits.present ? entry : nullptr;
+    }
+
+    // 現在のCR3でvaddrを含む4KiBページのエントリを返す。マップされていなければnullptr
+    PageMapEntry* FindPageEntry(uint64_t vaddr){
+        return FindPageEntry(reinterpret_cast<PageMapEntry*>(GetCR3()), vaddr);
+    }
+
     Error CopyOnePage(uint64_t causal_addr){
+        const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
+        if (PageMapEntry* entry = FindPageEntry(aligned_addr)){
+            const auto frame_addr = reinterpret_cast<uint64_t>(entry->Pointer());
+            SpinLockGuard lock{shared_frames_lock};
+            if (shared_frames){
+                // 共有していた相手が全て手放していれば、コピーせずにこのページの専有に戻す
+                if (auto it = shared_frames->find(frame_addr); it != shared_frames->end() && it->second == 1){
+                    shared_frames->erase(it);
+                    entry->bits.writable = 1;
+                    InvalidateTLB(aligned_addr);
+                    return MAKE_ERROR(Error::kSuccess);
+                }
+            }
+        }
+
         auto [p, err] = NewPageMap();
         if (err){
             return err;
         }
-        const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
         memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
-        return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4, LinearAddress4Level{causal_addr}, p);
+        const auto old_frame = FindPageEntry(aligned_addr)->Pointer();
+        if (auto err = SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4, LinearAddress4Level{causal_addr}, p)){
+            return err;
+        }
+        ReleaseFrameRef(reinterpret_cast<uint64_t>(old_frame));
+        return MAKE_ERROR(Error::kSuccess);
     }
 }
 
@@ -182,11 +254,64 @@ Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable)
     return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
 }
 
+Error ReserveKernelPageMap(LinearAddress4Level addr){
+    auto& entry = reinterpret_cast<PageMapEntry*>(&pml4_table[0])[addr.parts.pml4];
+    if (auto [child_map, err] = SetNewPageMapIfNotPresent(entry); err){
+        return err;
+    }
+    entry.bits.writable = 1;
+    entry.bits.user = 0;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error SetupKernelPageMaps(LinearAddress4Level addr, size_t num_4kpages){
+    auto kernel_pml4 = reinterpret_cast<PageMapEntry*>(&pml4_table[0]);
+    return SetupPageMap(kernel_pml4, 4, addr, num_4kpages, true, false).error;
+}
+
+Error MapKernelFrame(LinearAddress4Level addr, uint64_t frame_addr){
+    auto table = reinterpret_cast<PageMapEntry*>(&pml4_table[0]);
+    for (int level = 4; level > 1; --level){
+        auto& entry = table[addr.Part(level)];
+        auto [child_map, err] = SetNewPageMapIfNotPresent(entry);
+        if (err){
+            return err;
+        }
+        entry.bits.writable = 1;
+        entry.bits.user = 0;
+        table = child_map;
+    }
+
+    auto& entry = table[addr.Part(1)];
+    entry.data = 0;
+    entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame_addr));
+    entry.bits.present = 1;
+    entry.bits.writable = 1;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+bool TestAndClearKernelPageDirty(uint64_t vaddr){
+    auto entry = FindPageEntry(reinterpret_cast<PageMapEntry*>(&pml4_table[0]), vaddr);
+    if (entry == nullptr || !entry->bits.dirty){
+        return false;
+    }
+    // CPUがダーティビットを立てるのと競合しないよう、アトミックに落とす
+    PageMapEntry dirty{};
+    dirty.bits.dirty = 1;
+    __atomic_fetch_and(&entry->data, ~dirty.data, __ATOMIC_SEQ_CST);
+    InvalidateTLB(vaddr);
+    return true;
+}
+
 Error CleanPageMaps(LinearAddress4Level addr){
     auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
     return CleanPageMap(pml4_table, 4, addr);
 }
 
+Error CleanPageMaps(PageMapEntry* pml4, LinearAddress4Level addr){
+    return CleanPageMap(pml4, 4, addr);
+}
+
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start){
     if (part == 1){
         for (int i = start; i<512; ++i){
@@ -217,11 +342,19 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start){
 }
 
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr){
-    auto& task = task_manager->CurrentTask();
     const bool present = (error_code >> 0) & 1;
     const bool rw = (error_code >> 1) & 1;
     const bool user = (error_code >> 2) & 1;
-    if (present && rw && user){
+    // ボリュームはタスクの初期化前から読むので、タスクに関係なく先に処理する
+    // アプリからの参照では読み込まない（ディスクの内容を読ませないため、通常の失敗にする）
+    if (!present && !user && block_cache && block_cache->Contains(causal_addr)){
+        return block_cache->HandleFault(causal_addr);
+    }
+
+    auto& task = task_manager->CurrentTask();
+    // アプリの領域（後半）への書き込みはシステムコール中のカーネルからでもコピーオンライトする
+    const bool app_addr = LinearAddress4Level{causal_addr}.parts.pml4 >= 256;
+    if (present && rw && (user || app_addr)){
         return CopyOnePage(causal_addr);
     } else if (present){
         return MAKE_ERROR(Error::kAlreadyAllocated);
@@ -233,4 +366,120 @@ Error HandlePageFault(uint64_t error_code, uint64_t causal_addr){
         return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
     }
     return MAKE_ERROR(Error::kIndexOutOfRange);
-}
\ No newline at end of file
+}
+
+WithError<uint64_t> ShareUserPage(uint64_t vaddr){
+    PageMapEntry* entry = FindPageEntry(vaddr);
+    if (entry == nullptr || !entry->bits.user || entry->bits.shared || vaddr % 4096 != 0){
+        return {0, MAKE_ERROR(Error::kNoSuchEntry)};
+    }
+
+    const auto frame_addr = reinterpret_cast<uint64_t>(entry->Pointer());
+    SpinLockGuard lock{shared_frames_lock};
+    if (shared_frames == nullptr){
+        shared_frames = new std::map<uint64_t, unsigned int>;
+    }
+    if (entry->bits.writable){
+        // このページの専有だったフレームを、ページと呼び出し元の2者で共有する
+        shared_frames->insert(std::make_pair(frame_addr, 2u));
+        entry->bits.writable = 0;
+        InvalidateTLB(vaddr);
+        return {frame_addr, MAKE_ERROR(Error::kSuccess)};
+    }
+    // 書き込み禁止のページは、既に共有しているフレームのときだけ参照を増やせる（アプリのイメージなどは不可）
+    if (auto it = shared_frames->find(frame_addr); it != shared_frames->end()){
+        ++it->second;
+        return {frame_addr, MAKE_ERROR(Error::kSuccess)};
+    }
+    return {0, MAKE_ERROR(Error::kInvalidDescriptor)};
+}
+
+void ReleaseSharedFrame(uint64_t frame_addr){
+    ReleaseFrameRef(frame_addr);
+}
+
+void AcquireSharedFrame(uint64_t frame_addr){
+    SpinLockGuard lock{shared_frames_lock};
+    if (shared_frames == nullptr){
+        shared_frames = new std::map<uint64_t, unsigned int>;
+    }
+    ++(*shared_frames)[frame_addr];
+}
+
+Error MapSharedFrames(LinearAddress4Level addr, const std::vector<uint64_t>& frames){
+    // 既にマップされたページがあれば、何もマップせずに失敗する
+    for (size_t i = 0; i < frames.size(); ++i){
+        if (FindPageEntry(addr.value + i * 4096)){
+            return MAKE_ERROR(Error::kAlreadyAllocated);
+        }
+    }
+
+    auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+    const LinearAddress4Level begin = addr;
+    for (size_t i = 0; i < frames.size(); ++i, addr.value += 4096){
+        PageMapEntry* table = pml4_table;
+        for (int level = 4; level > 1; --level){
+            auto& entry = table[addr.Part(level)];
+            auto [child_map, err] = SetNewPageMapIfNotPresent(entry);
+            if (err){
+                // ページテーブルを確保できなければ、ここまでにマップした分だけ外す
+                UnmapPages(begin, i);
+                return err;
+            }
+            entry.bits.writable = 1;
+            entry.bits.user = 1;
+            table = child_map;
+        }
+
+        auto& entry = table[addr.Part(1)];
+        AcquireSharedFrame(frames[i]);
+        entry.data = 0;
+        entry.SetPointer(reinterpret_cast<PageMapEntry*>(frames[i]));
+        entry.bits.present = 1;
+        entry.bits.writable = 1;
+        entry.bits.user = 1;
+        entry.bits.shared = 1;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages){
+    for (size_t i = 0; i < num_4kpages; ++i, addr.value += 4096){
+        PageMapEntry* entry = FindPageEntry(addr.value);
+        if (entry == nullptr){
+            continue;
+        }
+        const auto frame_addr = reinterpret_cast<uint64_t>(entry->Pointer());
+        const bool owned = entry->bits.writable && !entry->bits.shared;
+        entry->data = 0;
+        InvalidateTLB(addr.value);
+        if (owned){
+            if (auto err = memory_manager->Free(FrameID{frame_addr / kBytesPerFrame}, 1)){
+                return err;
+            }
+        } else {
+            ReleaseFrameRef(frame_addr);
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<uint64_t> GetPhysicalAddress(uint64_t vaddr){
+    const LinearAddress4Level addr{vaddr};
+    auto table = reinterpret_cast<PageMapEntry*>(GetCR3());
+    for (int level = 4; level >= 1; --level){
+        const auto entry = table[addr.Part(level)];
+        if (!entry.bits.present){
+            return {0, MAKE_ERROR(Error::kNoSuchEntry)};
+        }
+
+        // 1GiB/2MiBページ（アイデンティティマップ）と4KiBページ
+        if (level == 1 || (level <= 3 && entry.bits.huge_page)){
+            const uint64_t page_bytes = kPageSize4K << (9 * (level-1));
+            const uint64_t page_base = (static_cast<uint64_t>(entry.bits.addr) << 12) & ~(page_bytes - 1);
+            return {page_base | (vaddr & (page_bytes - 1)), MAKE_ERROR(Error::kSuccess)};
+        }
+        table = entry.Pointer();
+    }
+    return {0, MAKE_ERROR(Error::kNoSuchEntry)};
+}
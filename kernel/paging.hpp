@@ -2,6 +2,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <vector>
 
 #include "error.hpp"
 
@@ -63,7 +64,8 @@ union PageMapEntry {
         uint64_t dirty : 1;
         uint64_t huge_page : 1;
         uint64_t global : 1;
-        uint64_t : 3;
+        uint64_t shared : 1; // ソフトウェア用のビット。共有メモリのページ（書き込めるが専有していない）
+        uint64_t : 2;
 
         uint64_t addr : 40;
         uint64_t : 12;
@@ -81,6 +83,31 @@ union PageMapEntry {
 WithError<PageMapEntry*> NewPageMap();
 Error FreePageMap(PageMapEntry* table);
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable=true);
+// カーネルのPML4にaddrを含むPML4エントリを用意する。
+// アプリ用のPML4は前半256エントリをコピーして作るため、アプリ起動前に呼んでおくこと
+Error ReserveKernelPageMap(LinearAddress4Level addr);
+// カーネルのPML4に、スーパーバイザ専用のページを割り当ててマップする
+Error SetupKernelPageMaps(LinearAddress4Level addr, size_t num_4kpages);
+// カーネルのPML4で、未マップのページaddrにフレームframe_addrを書き込み可能にマップする
+Error MapKernelFrame(LinearAddress4Level addr, uint64_t frame_addr);
+// カーネルのPML4で、ページvaddrのダーティビットが立っていれば落としてtrueを返す
+bool TestAndClearKernelPageDirty(uint64_t vaddr);
 Error CleanPageMaps(LinearAddress4Level addr);
+// 現在のCR3ではないPML4を対象にする
+Error CleanPageMaps(PageMapEntry* pml4, LinearAddress4Level addr);
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
-Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
\ No newline at end of file
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+// 現在のCR3でアプリのページvaddr（4KiB境界）のフレームを、コピーせずに共有する
+// ページは書き込み禁止になり、次に書き込まれたときにコピーされる（コピーオンライト）
+// @return フレームの物理アドレス。使い終わったらReleaseSharedFrameで参照を手放すこと
+WithError<uint64_t> ShareUserPage(uint64_t vaddr);
+void ReleaseSharedFrame(uint64_t frame_addr);
+// フレームの参照を1つ増やす。初めて参照するフレームなら参照数1で登録する
+void AcquireSharedFrame(uint64_t frame_addr);
+// 現在のCR3で、addrから共有メモリのフレームを書き込み可能にマップし、それぞれの参照を増やす
+// 範囲に既にマップされたページがあればkAlreadyAllocated。失敗したときは何もマップしない
+Error MapSharedFrames(LinearAddress4Level addr, const std::vector<uint64_t>& frames);
+// 現在のCR3でaddrからnum_4kpagesページのマップを外す。専有していたフレームは解放し、共有していたフレームは参照を手放す
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages);
+// 現在のCR3で仮想アドレスを物理アドレスに変換する。マップされていなければkNoSuchEntry
+WithError<uint64_t> GetPhysicalAddress(uint64_t vaddr);
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "pci.hpp"
 
+#include <algorithm>
+
 #include "asmfunc.h"
 #include "logger.hpp"
 
@@ -142,8 +144,28 @@ namespace{
         return MAKE_ERROR(Error::kSuccess);
     }
 
+    // MSI-Xのテーブルの先頭から2^num_vector_exponent個（テーブルの大きさまで）のエントリに同じメッセージを設定する
     Error ConfigureMSIXRegister(const Device& dev, uint8_t cap_addr, uint32_t msg_addr, uint32_t msg_data, unsigned int num_vector_exponent){
-        return MAKE_ERROR(Error::kNotImplemented);
+        const uint32_t header = pci::ReadConfReg(dev, cap_addr);
+        const uint32_t table_reg = pci::ReadConfReg(dev, cap_addr + 4); // 2:0: BAR番号、31:3: BAR内のオフセット
+        auto [bar, err] = pci::ReadBar(const_cast<Device&>(dev), table_reg & 0x7u);
+        if (err){
+            return err;
+        }
+
+        const unsigned int table_size = ((header >> 16) & 0x7ffu) + 1;
+        const unsigned int num_vectors = std::min(table_size, 1u << num_vector_exponent);
+        auto table = reinterpret_cast<volatile uint32_t*>((bar & ~0xfull) + (table_reg & ~0x7u));
+        for (unsigned int i = 0; i < num_vectors; ++i){
+            table[4*i + 0] = msg_addr;
+            table[4*i + 1] = 0;
+            table[4*i + 2] = msg_data;
+            table[4*i + 3] = 0; // マスクを解除
+        }
+
+        // メッセージ制御のMSI-X Enable（ビット15）を立て、Function Mask（ビット14）を落とす
+        pci::WriteConfReg(dev, cap_addr, (header | (1u << 31)) & ~(1u << 30));
+        return MAKE_ERROR(Error::kSuccess);
     }
 }
 
@@ -284,6 +306,19 @@ namespace pci{
         }
         return ConfigureMSI(dev, msg_addr, msg_data, num_vector_exponent);
     }
+
+    void DisableMSI(const Device& dev){
+        uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
+        while (cap_addr != 0){
+            auto header = ReadCapabilityHeader(dev, cap_addr);
+            if (header.bits.cap_id == kCapabilityMSI){
+                WriteConfReg(dev, cap_addr, header.data & ~(1u << 16)); // MSI Enable
+            } else if (header.bits.cap_id == kCapabilityMSIX){
+                WriteConfReg(dev, cap_addr, header.data & ~(1u << 31)); // MSI-X Enable
+            }
+            cap_addr = header.bits.next_ptr;
+        }
+    }
 }
 
 void InitializePCI() {
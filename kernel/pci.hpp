@@ -123,6 +123,9 @@ namespace pci {
 
     Error ConfigureMSIFixedDestination(const Device& dev, uint8_t apic_id, MSITriggerMode trigger_mode,
         MSIDeliveryMode delivery_mode, uint8_t vector, unsigned int num_vector_exponent);
+
+    // MSIとMSI-Xによる割り込みを止める（ケーパビリティのEnableビットを落とす）
+    void DisableMSI(const Device& dev);
 }
 
 void InitializePCI();
\ No newline at end of file
@@ -0,0 +1,29 @@
+#include "per_cpu.hpp"
+
+#include <array>
+
+#include "asmfunc.h"
+#include "msr.hpp"
+
+namespace{
+    alignas(64) std::array<PerCPU, kMaxCPUs> cpus;
+    int num_cpus;
+}
+
+int NumCPUs(){
+    return num_cpus;
+}
+
+void InitializePerCPU(){
+    PerCPU& bsp = cpus[0];
+    bsp.self = &bsp;
+    bsp.id = 0;
+    bsp.lapic_id = *reinterpret_cast<volatile uint32_t*>(0xfee00020) >> 24;
+    num_cpus = 1;
+
+    // GSセレクタを読み込むとベースが上書きされるため、以降はヌルセレクタのままにする
+    // （コンテキスト切り替えでもGSは読み込まない）
+    __asm__ volatile("mov %0, %%gs" : : "r"(0));
+    WriteMSR(kIA32_GS_BASE, reinterpret_cast<uint64_t>(&bsp));
+    WriteMSR(kIA32_KERNEL_GS_BASE, 0); // アプリ用のGSのベース
+}
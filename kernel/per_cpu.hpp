@@ -0,0 +1,45 @@
+// CPUごとのデータ
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class Task;
+
+// カーネル実行中はGSのベースがこの構造体を指す（アプリ実行中はswapgsでIA32_KERNEL_GS_BASEに退避）
+// アセンブリからも参照するので、先頭のメンバの並びは変えないこと
+struct PerCPU{
+    PerCPU* self; // GS:0から自身のアドレスを得るためのもの
+    Task* current_task;
+    uint64_t os_stack_ptr; // 実行中のタスクのシステムコール用スタック（Task::OSStackPointerの写し）
+    uint64_t user_rsp; // システムコールの入口でアプリのRSPを一時的に置く
+    uint32_t id; // 0: BSP
+    uint32_t lapic_id;
+};
+
+static_assert(offsetof(PerCPU, current_task) == 0x08);
+static_assert(offsetof(PerCPU, os_stack_ptr) == 0x10);
+static_assert(offsetof(PerCPU, user_rsp) == 0x18);
+
+const int kMaxCPUs = 16;
+
+// 実行中のCPUのデータ。InitializePerCPUより後で呼ぶこと
+inline PerCPU& ThisCPU(){
+    PerCPU* cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return *cpu;
+}
+
+// 実行中のCPUで動いているタスク。GS相対の1回の読み込みで済む
+inline Task* ThisCPUTask(){
+    Task* task;
+    __asm__ volatile("mov %%gs:8, %0" : "=r"(task));
+    return task;
+}
+
+// 動いているCPUの数。今はBSPのみ
+int NumCPUs();
+
+// BSPのデータを用意してGSのベースに設定する
+void InitializePerCPU();
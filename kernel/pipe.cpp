@@ -0,0 +1,215 @@
+#include "pipe.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "paging.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+namespace {
+    size_t RoundCapacity(size_t capacity){
+        capacity = std::clamp(capacity, PipeDescriptor::kMinBytes, PipeDescriptor::kMaxBytes);
+        size_t bytes = PipeDescriptor::kMinBytes;
+        while (bytes < capacity){
+            bytes <<= 1;
+        }
+        return bytes;
+    }
+}
+
+// 下限水位は上限水位より1ページ分下に抑える。眠った書き手が起きたときに、ページを丸ごと渡せるように
+PipeDescriptor::PipeDescriptor(size_t capacity, size_t low_watermark, size_t high_watermark)
+    : ring_{RoundCapacity(capacity)},
+      high_{std::clamp(high_watermark == 0 ? ring_.Capacity() : high_watermark, kPageBytes, ring_.Capacity())},
+      low_{std::min(low_watermark == 0 ? high_ / 2 : low_watermark, high_ - kPageBytes)},
+      pages_(ring_.Capacity() / kPageBytes) {
+}
+
+PipeDescriptor::~PipeDescriptor(){
+    for (uint64_t i = page_head_.load(); i != page_tail_.load(); ++i){
+        ReleaseSharedFrame(pages_[i % pages_.size()].frame);
+    }
+}
+
+size_t PipeDescriptor::Read(void* buf, size_t len){
+    while (true){
+        if (const size_t n = ReadSome(buf, len)){
+            bytes_read_.fetch_add(n);
+            // 下限水位まで減るまでは書き手を起こさない。少しずつ読むたびに起床と睡眠を繰り返さないため
+            if (Fill() <= low_){
+                WakeWriter();
+            }
+            return n;
+        }
+        if (closed_.load(std::memory_order_acquire)){
+            // 閉じる直前に書かれたデータを取りこぼさないよう読み直す
+            const size_t n = ReadSome(buf, len);
+            bytes_read_.fetch_add(n);
+            WakeWriter();
+            return n;
+        }
+
+        // 待ちを表明してから空であることを確かめ直す。表明の前に書かれていれば眠らない
+        InterruptGuard guard;
+        Task& task = task_manager->CurrentTask();
+        waiting_reader_.store(&task, std::memory_order_seq_cst);
+        if (Fill() > 0 || closed_.load(std::memory_order_acquire)){
+            waiting_reader_.store(nullptr, std::memory_order_relaxed);
+            continue;
+        }
+        reader_stalls_.fetch_add(1, std::memory_order_relaxed);
+        task.Sleep();
+    }
+}
+
+size_t PipeDescriptor::Write(const void* buf, size_t len){
+    return WriteBytes(buf, len, false);
+}
+
+size_t PipeDescriptor::Splice(const void* buf, size_t len){
+    return WriteBytes(buf, len, true);
+}
+
+size_t PipeDescriptor::WriteBytes(const void* buf, size_t len, bool splice){
+    auto bufc = reinterpret_cast<const uint8_t*>(buf);
+    size_t written = 0;
+    while (written < len){
+        if (read_closed_.load(std::memory_order_acquire)){
+            break;
+        }
+
+        const size_t fill = Fill();
+        const size_t room = fill < high_ ? high_ - fill : 0;
+        const size_t remain = len - written;
+        const auto addr = reinterpret_cast<uint64_t>(&bufc[written]);
+        size_t n = 0;
+        if (splice && remain >= kPageBytes && addr % kPageBytes == 0){
+            // 丸ごと渡せるページ。空きが1ページ分できるまで待つ
+            if (room >= kPageBytes){
+                if (!PushPage(addr)){
+                    splice = false; // 共有できないページ（アプリのイメージなど）なので、以降はコピーする
+                    continue;
+                }
+                n = kPageBytes;
+            }
+        } else if (room > 0){
+            size_t chunk = std::min(remain, room);
+            if (splice && remain >= kPageBytes){
+                chunk = std::min(chunk, kPageBytes - addr % kPageBytes); // 次のページ境界まではコピーする
+            }
+            n = ring_.Write(&bufc[written], chunk);
+            bytes_written_.fetch_add(n);
+        }
+
+        if (n > 0){
+            written += n;
+            size_t max_fill = max_fill_.load(std::memory_order_relaxed);
+            while (fill + n > max_fill &&
+                   !max_fill_.compare_exchange_weak(max_fill, fill + n, std::memory_order_relaxed)){
+            }
+            WakeReader();
+            notifier_.Notify();
+            continue;
+        }
+
+        // 待ちを表明してから水位を確かめ直す。表明の前に下限まで読まれていれば眠らない
+        InterruptGuard guard;
+        Task& task = task_manager->CurrentTask();
+        waiting_writer_.store(&task, std::memory_order_seq_cst);
+        if (Fill() <= low_ || read_closed_.load(std::memory_order_acquire)){
+            waiting_writer_.store(nullptr, std::memory_order_relaxed);
+            continue;
+        }
+        writer_stalls_.fetch_add(1, std::memory_order_relaxed);
+        task.Sleep();
+    }
+    return written;
+}
+
+// 溜まっているのは高々high_ - kPageBytesバイトなので、ページの列が満杯になることはない
+bool PipeDescriptor::PushPage(uint64_t vaddr){
+    auto [frame, err] = ShareUserPage(vaddr);
+    if (err){
+        return false;
+    }
+    // 読み手に見せる前にバイト数へ含める。見せてから数えると、読み手がページを読んだ直後のFill()が負になる
+    const uint64_t pos = bytes_written_.fetch_add(kPageBytes);
+    const uint64_t tail = page_tail_.load(std::memory_order_relaxed);
+    pages_[tail % pages_.size()] = {frame, pos};
+    page_tail_.store(tail + 1, std::memory_order_release);
+    spliced_pages_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// 次に読むべき位置から読めるだけ読む。共有したページとリングバッファのバイト列は書き込んだ順に読む
+size_t PipeDescriptor::ReadSome(void* buf, size_t len){
+    // リングバッファの量を先に見る。ページより後に書かれたバイトが見えていれば、そのページも見えている
+    const size_t ring_bytes = ring_.Size();
+    const uint64_t pos = bytes_read_.load(std::memory_order_relaxed);
+    const uint64_t head = page_head_.load(std::memory_order_relaxed);
+    if (head != page_tail_.load(std::memory_order_acquire)){
+        const SplicedPage& page = pages_[head % pages_.size()];
+        if (page.pos <= pos){
+            const size_t offset = pos - page.pos;
+            const size_t n = std::min(len, kPageBytes - offset);
+            memcpy(buf, reinterpret_cast<const uint8_t*>(page.frame) + offset, n);
+            if (offset + n == kPageBytes){
+                ReleaseSharedFrame(page.frame);
+                page_head_.store(head + 1, std::memory_order_release);
+            }
+            return n;
+        }
+        len = std::min<size_t>(len, page.pos - pos);
+    }
+    return ring_.Read(buf, std::min(len, ring_bytes));
+}
+
+void PipeDescriptor::FinishWrite(){
+    closed_.store(true, std::memory_order_release);
+    WakeReader();
+    notifier_.Notify();
+}
+
+void PipeDescriptor::FinishRead(){
+    read_closed_.store(true, std::memory_order_release);
+    WakeWriter();
+}
+
+PipeStat PipeDescriptor::Stat() const{
+    return {
+        ring_.Capacity(), low_, high_,
+        bytes_written_.load(std::memory_order_relaxed),
+        bytes_read_.load(std::memory_order_relaxed),
+        writer_stalls_.load(std::memory_order_relaxed),
+        reader_stalls_.load(std::memory_order_relaxed),
+        max_fill_.load(std::memory_order_relaxed),
+        spliced_pages_.load(std::memory_order_relaxed),
+    };
+}
+
+uint32_t PipeDescriptor::PollEvents(){
+    const bool closed = closed_.load(std::memory_order_acquire);
+    uint32_t events = 0;
+    if (Fill() > 0 || closed){
+        events |= POLL_EV_IN;
+    }
+    if (closed){
+        events |= POLL_EV_HUP;
+    }
+    return events;
+}
+
+void PipeDescriptor::WakeReader(){
+    if (Task* reader = waiting_reader_.exchange(nullptr, std::memory_order_seq_cst)){
+        InterruptGuard guard;
+        task_manager->Wakeup(reader);
+    }
+}
+
+void PipeDescriptor::WakeWriter(){
+    if (Task* writer = waiting_writer_.exchange(nullptr, std::memory_order_seq_cst)){
+        InterruptGuard guard;
+        task_manager->Wakeup(writer);
+    }
+}
@@ -0,0 +1,92 @@
+// タスク間のパイプ
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "file.hpp"
+#include "poll.hpp"
+#include "spsc_ring.hpp"
+
+class Task;
+
+struct PipeStat{
+    size_t capacity;
+    size_t low_watermark, high_watermark;
+    uint64_t bytes_written, bytes_read;
+    uint64_t writer_stalls; // 書き手が満杯のため眠った回数
+    uint64_t reader_stalls; // 読み手が空のため眠った回数
+    size_t max_fill; // 溜まったバイト数の最大値
+    uint64_t spliced_pages; // コピーせずに受け渡したページ数
+};
+
+// 書き手と読み手が1つずつのパイプ。データはリングバッファでやり取りし、メッセージボックスは使わない
+// 書き手は溜まったバイト数が上限水位に達すると眠り、読み手が下限水位まで読み出すと起こされる
+// 空なら読み手が眠る。相手を起こすのは相手が待っているときだけ
+// Spliceでは、ページ境界に揃ったアプリのバッファをページごとコピーオンライトで共有して渡す
+// バイト列はリングバッファに、共有したページはページの列に入れ、書き込んだ位置の順に読み出す
+class PipeDescriptor : public FileDescriptor{
+    public:
+        static const size_t kPageBytes = 4096;
+        static const size_t kDefaultBytes = 16 * 4096;
+        static const size_t kMinBytes = 2 * kPageBytes;
+        static const size_t kMaxBytes = 256 * 4096;
+
+        // @param capacity  バッファの大きさ。2のべき乗に切り上げ、kMinBytes〜kMaxBytesに丸める
+        // @param low_watermark  眠った書き手を起こす水位。0なら上限水位の半分
+        // @param high_watermark  書き手が眠る水位。0ならバッファの大きさ。kPageBytes〜バッファの大きさに丸める
+        explicit PipeDescriptor(size_t capacity = kDefaultBytes, size_t low_watermark = 0, size_t high_watermark = 0);
+        ~PipeDescriptor() override;
+        size_t Read(void* buf, size_t len) override;
+        size_t Write(const void* buf, size_t len) override;
+        size_t Splice(const void* buf, size_t len) override;
+        size_t Size() const override { return 0;}
+        size_t Load(void* buf, size_t len, size_t offset) override {return 0;}
+        uint32_t PollEvents() override;
+        PollNotifier* Notifier() override {return &notifier_;}
+        bool WriteClosed() override {return read_closed_.load(std::memory_order_acquire);}
+
+        // 書き込みの終わりを知らせる。以降、空になった後のReadは0を返す
+        void FinishWrite();
+        // 読み出しの終わりを知らせる。以降のWriteは書き込まずに戻り、WriteClosedはtrueになる
+        void FinishRead();
+        PipeStat Stat() const;
+
+    private:
+        struct SplicedPage{
+            uint64_t frame; // 共有したフレームの物理アドレス
+            uint64_t pos; // このページの先頭の、書き込み全体での位置
+        };
+
+        SPSCByteRing ring_;
+        const size_t high_, low_;
+        // 共有したページの列。page_head_は読み手が、page_tail_は書き手が進める
+        std::vector<SplicedPage> pages_;
+        std::atomic<uint64_t> page_head_{0}, page_tail_{0};
+        std::atomic<bool> closed_{false}, read_closed_{false};
+        // 空（満杯）を見て眠ろうとしている読み手（書き手）。起こす必要があるときだけ非nullptr
+        std::atomic<Task*> waiting_reader_{nullptr};
+        std::atomic<Task*> waiting_writer_{nullptr};
+        PollNotifier notifier_{};
+
+        std::atomic<uint64_t> bytes_written_{0}, bytes_read_{0};
+        std::atomic<uint64_t> writer_stalls_{0}, reader_stalls_{0};
+        std::atomic<size_t> max_fill_{0};
+        std::atomic<uint64_t> spliced_pages_{0};
+
+        // 溜まっているバイト数。共有したページの分も含む
+        // リングバッファのバイトは書き込んでから数えるので、読み手が先に数えた直後は0とみなす
+        size_t Fill() const {
+            const uint64_t read = bytes_read_.load();
+            const uint64_t written = bytes_written_.load();
+            return written > read ? written - read : 0;
+        }
+        size_t WriteBytes(const void* buf, size_t len, bool splice);
+        bool PushPage(uint64_t vaddr);
+        size_t ReadSome(void* buf, size_t len);
+        void WakeReader();
+        void WakeWriter();
+};
@@ -0,0 +1,213 @@
+#include "poll.hpp"
+
+#include <algorithm>
+
+#include "file.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace{
+    // 状態が変化しないファイルの通知元。登録されるだけで通知はしない
+    PollNotifier never_notifies;
+}
+
+void PollNotifier::Add(PollSet* set, int fd){
+    SpinLockGuard guard{lock_};
+    watchers_.push_back({set, fd});
+    num_watchers_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PollNotifier::Remove(PollSet* set, int fd){
+    SpinLockGuard guard{lock_};
+    auto it = std::find(watchers_.begin(), watchers_.end(), std::make_pair(set, fd));
+    if (it != watchers_.end()){
+        watchers_.erase(it);
+        num_watchers_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void PollNotifier::Notify(){
+    if (num_watchers_.load(std::memory_order_relaxed) == 0){
+        return;
+    }
+
+    SpinLockGuard guard{lock_};
+    for (auto [set, fd] : watchers_){
+        set->Notify(fd);
+    }
+}
+
+PollSet::PollSet(Task& task) : task_{task}{
+}
+
+PollSet::~PollSet(){
+    for (auto& [fd, entry] : entries_){
+        entry.notifier->Remove(this, fd);
+    }
+}
+
+Error PollSet::Control(int op, int fd, uint32_t events, uint64_t data){
+    auto it = entries_.find(fd);
+    if (op == POLL_CTL_DEL){
+        if (it == entries_.end()){
+            return MAKE_ERROR(Error::kNoSuchEntry);
+        }
+        // 通知元の一覧から先に外し、以降はNotifyから参照されないようにする
+        it->second.notifier->Remove(this, fd);
+        SpinLockGuard guard{lock_};
+        Unlink(it->second);
+        entries_.erase(it);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    if (op == POLL_CTL_MOD){
+        if (it == entries_.end()){
+            return MAKE_ERROR(Error::kNoSuchEntry);
+        }
+        SpinLockGuard guard{lock_};
+        it->second.events = events;
+        it->second.data = data;
+        if (Level(it->second) & events){
+            Enqueue(it->second);
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    if (op != POLL_CTL_ADD){
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    if (it != entries_.end()){
+        return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+
+    Entry entry{fd, events, data, nullptr, nullptr, false, nullptr};
+    if (fd == POLL_FD_EVENTS){
+        entry.notifier = &task_.MailboxNotifier();
+    } else {
+        auto& files = task_.Files();
+        if (fd < 0 || files.size() <= static_cast<size_t>(fd) || !files[fd]){
+            return MAKE_ERROR(Error::kInvalidFile);
+        }
+        entry.file = files[fd];
+        entry.notifier = entry.file->Notifier();
+        if (entry.notifier == nullptr){
+            // 登録時に一度だけ報告される
+            entry.notifier = &never_notifies;
+        }
+    }
+
+    {
+        SpinLockGuard guard{lock_};
+        auto& e = entries_.insert({fd, std::move(entry)}).first->second;
+        if (Level(e) & events){
+            Enqueue(e);
+        }
+    }
+    entries_.at(fd).notifier->Add(this, fd);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<size_t> PollSet::Wait(PollEvent* out, size_t max, long timeout_ticks){
+    const unsigned long deadline = timeout_ticks > 0 ? timer_manager->CurrentTick() + timeout_ticks : TaskManager::kNoDeadline;
+    while (true){
+        const size_t n = Collect(out, max);
+        if (n > 0 || timeout_ticks == 0){
+            return {n, MAKE_ERROR(Error::kSuccess)};
+        }
+        if (deadline != TaskManager::kNoDeadline && timer_manager->CurrentTick() >= deadline){
+            return {0, MAKE_ERROR(Error::kSuccess)};
+        }
+
+        // 準備完了の列が空であることを確かめてから眠る。Notifyはwaiting_を見て起こす
+        auto err = task_manager->SleepUntil(deadline, [this]{
+            SpinLockGuard guard{lock_};
+            waiting_ = ready_head_ == nullptr;
+            return !waiting_;
+        });
+        waiting_ = false;
+        if (err){
+            // 起こすタイマーがなければ期限が来ても眠ったままになる
+            return {0, err};
+        }
+    }
+}
+
+void PollSet::Notify(int fd){
+    SpinLockGuard guard{lock_};
+    auto it = entries_.find(fd);
+    if (it == entries_.end()){
+        return;
+    }
+    Enqueue(it->second);
+    if (waiting_){
+        waiting_ = false;
+        task_manager->Wakeup(&task_);
+    }
+}
+
+uint32_t PollSet::Level(const Entry& entry) const{
+    if (entry.file){
+        return entry.file->PollEvents();
+    }
+    return task_.Mailbox().queued > 0 ? POLL_EV_IN : 0;
+}
+
+void PollSet::Enqueue(Entry& entry){
+    if (entry.queued){
+        return;
+    }
+    entry.queued = true;
+    entry.next_ready = nullptr;
+    if (ready_tail_){
+        ready_tail_->next_ready = &entry;
+    } else {
+        ready_head_ = &entry;
+    }
+    ready_tail_ = &entry;
+}
+
+void PollSet::Unlink(Entry& entry){
+    if (!entry.queued){
+        return;
+    }
+    Entry* prev = nullptr;
+    for (Entry* e = ready_head_; e; prev = e, e = e->next_ready){
+        if (e != &entry){
+            continue;
+        }
+        (prev ? prev->next_ready : ready_head_) = e->next_ready;
+        if (ready_tail_ == e){
+            ready_tail_ = prev;
+        }
+        break;
+    }
+    entry.queued = false;
+}
+
+size_t PollSet::Collect(PollEvent* out, size_t max){
+    size_t n = 0;
+    while (n < max){
+        uint32_t events;
+        uint64_t data;
+        {
+            SpinLockGuard guard{lock_};
+            Entry* entry = ready_head_;
+            if (entry == nullptr){
+                break;
+            }
+            ready_head_ = entry->next_ready;
+            if (ready_head_ == nullptr){
+                ready_tail_ = nullptr;
+            }
+            entry->queued = false;
+            events = Level(*entry) & entry->events;
+            data = entry->data;
+        }
+
+        // 通知の後で読み出されていれば報告しない
+        if (events){
+            out[n++] = {events, data};
+        }
+    }
+    return n;
+}
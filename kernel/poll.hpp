@@ -0,0 +1,73 @@
+// 複数のファイルディスクリプタとイベントをまとめて待つ仕組み（epoll風）
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "error.hpp"
+#include "poll_event.hpp"
+#include "spinlock.hpp"
+
+class FileDescriptor;
+class PollSet;
+class Task;
+
+// データの到着などを、登録しているPollSetへ知らせる。割り込みハンドラからも呼び出せる
+class PollNotifier{
+    public:
+        void Add(PollSet* set, int fd);
+        void Remove(PollSet* set, int fd);
+        void Notify();
+
+    private:
+        SpinLock lock_{};
+        std::atomic<int> num_watchers_{0}; // 誰も待っていなければロックを取らずに済ませる
+        std::vector<std::pair<PollSet*, int>> watchers_{};
+};
+
+// タスクごとの待ち合わせ対象の集合。エッジトリガで、通知された対象だけを準備完了の列に積む
+// Waitの手間は準備のできた対象の数に比例し、登録数には依存しない
+class PollSet{
+    public:
+        explicit PollSet(Task& task);
+        ~PollSet();
+        PollSet(const PollSet&) = delete;
+        PollSet& operator=(const PollSet&) = delete;
+
+        // opはPOLL_CTL_*。fdにPOLL_FD_EVENTSを指定するとタスクのメッセージボックスを対象にする
+        // 登録時にすでに準備ができていれば、最初のWaitで報告される
+        Error Control(int op, int fd, uint32_t events, uint64_t data);
+        // 通知された対象のうち準備のできたものを最大max個outに書き、その数を返す
+        // timeout_ticksが負なら無期限に待ち、0なら待たない。タイマーを確保できなければエラーを返す
+        WithError<size_t> Wait(PollEvent* out, size_t max, long timeout_ticks);
+        // 対象fdに変化があったことを知らせる。PollNotifierから呼ばれる
+        void Notify(int fd);
+
+    private:
+        struct Entry{
+            int fd;
+            uint32_t events;
+            uint64_t data;
+            std::shared_ptr<::FileDescriptor> file; // POLL_FD_EVENTSならnullptr
+            PollNotifier* notifier;
+            bool queued;
+            Entry* next_ready;
+        };
+
+        Task& task_;
+        SpinLock lock_{};
+        std::map<int, Entry> entries_{};
+        // 準備完了の列。割り込みハンドラからも積むので、メモリを確保しないようEntryを直接つなぐ
+        Entry* ready_head_{nullptr};
+        Entry* ready_tail_{nullptr};
+        bool waiting_{false};
+
+        uint32_t Level(const Entry& entry) const;
+        void Enqueue(Entry& entry);
+        void Unlink(Entry& entry);
+        size_t Collect(PollEvent* out, size_t max);
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // SyscallPollCtlのfdにこれを指定すると、アプリのイベント（ReadEventで読むもの）の到着を待てる
+    #define POLL_FD_EVENTS -1
+
+    #define POLL_EV_IN 0x1 // 読み出せるデータが届いた
+    #define POLL_EV_HUP 0x2 // 書き込み側が閉じられた
+
+    #define POLL_CTL_ADD 1
+    #define POLL_CTL_MOD 2
+    #define POLL_CTL_DEL 3
+
+    struct PollEvent{
+        uint32_t events; // POLL_EV_IN, POLL_EV_HUPの組み合わせ
+        uint64_t data; // 登録時に指定した値
+    };
+
+#ifdef __cplusplus
+}
+#endif
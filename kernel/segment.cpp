@@ -77,6 +77,7 @@ void InitializeSegmentation() {
 void InitializeTSS(){
     SetTSS(1, AllocateStackArea(8));
     SetTSS(7 + 2*kISTForTimer, AllocateStackArea(8));
+    SetTSS(7 + 2*kISTForDoubleFault, AllocateStackArea(8));
 
     uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
     SetSystemSegment(gdt[kTSS>>3], DescriptorType::kTSSAvailable, 0, tss_addr&0xffffffff, sizeof(tss)-1);
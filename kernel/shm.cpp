@@ -0,0 +1,77 @@
+#include "shm.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include "mutex.hpp"
+#include "paging.hpp"
+
+namespace {
+    Mutex shm_mutex;
+    std::map<std::string, std::weak_ptr<SharedMemory>>* shm_objects;
+}
+
+WithError<std::shared_ptr<SharedMemory>> SharedMemory::Create(size_t bytes){
+    if (bytes == 0 || bytes > kMaxBytes){
+        return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    std::shared_ptr<SharedMemory> shm{new SharedMemory};
+    const size_t num_pages = (bytes + 4095) / 4096;
+    shm->frames_.reserve(num_pages);
+    for (size_t i = 0; i < num_pages; ++i){
+        auto [frame, err] = NewPageMap();
+        if (err){
+            return {nullptr, err};
+        }
+        const auto frame_addr = reinterpret_cast<uint64_t>(frame);
+        AcquireSharedFrame(frame_addr);
+        shm->frames_.push_back(frame_addr);
+    }
+    return {shm, MAKE_ERROR(Error::kSuccess)};
+}
+
+SharedMemory::~SharedMemory(){
+    for (const uint64_t frame : frames_){
+        ReleaseSharedFrame(frame);
+    }
+}
+
+size_t SharedMemoryDescriptor::Load(void* buf, size_t len, size_t offset){
+    const auto& frames = shm_->Frames();
+    auto bufc = reinterpret_cast<uint8_t*>(buf);
+    size_t total = 0;
+    while (total < len && offset < shm_->Size()){
+        const size_t page_offset = offset % 4096;
+        const size_t n = std::min(len - total, 4096 - page_offset);
+        memcpy(&bufc[total], reinterpret_cast<const uint8_t*>(frames[offset / 4096]) + page_offset, n);
+        total += n;
+        offset += n;
+    }
+    return total;
+}
+
+WithError<std::shared_ptr<SharedMemory>> OpenSharedMemory(const char* name, size_t bytes, bool create){
+    MutexGuard lock{shm_mutex};
+    if (shm_objects == nullptr){
+        shm_objects = new std::map<std::string, std::weak_ptr<SharedMemory>>;
+    }
+
+    if (auto it = shm_objects->find(name); it != shm_objects->end()){
+        if (auto shm = it->second.lock()){
+            return {shm, MAKE_ERROR(Error::kSuccess)};
+        }
+        shm_objects->erase(it);
+    }
+    if (!create){
+        return {nullptr, MAKE_ERROR(Error::kNoSuchEntry)};
+    }
+
+    auto [shm, err] = SharedMemory::Create(bytes);
+    if (err){
+        return {nullptr, err};
+    }
+    (*shm_objects)[name] = shm;
+    return {shm, MAKE_ERROR(Error::kSuccess)};
+}
@@ -0,0 +1,50 @@
+// タスク間の名前付き共有メモリ
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "error.hpp"
+#include "file.hpp"
+
+// 物理フレームの集合。各フレームはこのオブジェクトと、マップしている各ページが参照している
+// オブジェクトが破棄されても、マップしているページがある間はフレームは解放されない
+class SharedMemory{
+    public:
+        static const size_t kMaxBytes = 64 * 1024 * 1024;
+
+        // bytesを4KiBに切り上げた大きさの、0で埋めたフレームを確保する
+        static WithError<std::shared_ptr<SharedMemory>> Create(size_t bytes);
+        ~SharedMemory();
+        SharedMemory(const SharedMemory&) = delete;
+        SharedMemory& operator=(const SharedMemory&) = delete;
+
+        size_t Size() const {return frames_.size() * 4096;}
+        const std::vector<uint64_t>& Frames() const {return frames_;}
+
+    private:
+        SharedMemory() = default;
+        std::vector<uint64_t> frames_{}; // 各フレームの物理アドレス
+};
+
+// 共有メモリを開いたファイルディスクリプタ。内容はマップして読み書きする
+class SharedMemoryDescriptor : public FileDescriptor{
+    public:
+        explicit SharedMemoryDescriptor(std::shared_ptr<SharedMemory> shm) : shm_{std::move(shm)} {}
+        size_t Read(void* buf, size_t len) override {return 0;}
+        size_t Write(const void* buf, size_t len) override {return 0;}
+        size_t Size() const override {return shm_->Size();}
+        size_t Load(void* buf, size_t len, size_t offset) override;
+        SharedMemory* SharedMemoryObject() override {return shm_.get();}
+
+    private:
+        std::shared_ptr<SharedMemory> shm_;
+};
+
+// 名前で共有メモリを開く。なければ、createが真ならbytesの大きさで作り、偽ならkNoSuchEntry
+// 名前は、その共有メモリを開いているファイルディスクリプタがある間だけ有効
+WithError<std::shared_ptr<SharedMemory>> OpenSharedMemory(const char* name, size_t bytes, bool create);
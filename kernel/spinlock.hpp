@@ -0,0 +1,52 @@
+// 割り込みとCPU間の排他制御
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "interrupt.hpp"
+
+// スコープの間だけ割り込みを禁止し、抜けるときに元の状態へ戻す
+class InterruptGuard{
+    public:
+        InterruptGuard() : rflags_{SaveAndDisableInterrupts()} {}
+        ~InterruptGuard() {RestoreInterrupts(rflags_);}
+        InterruptGuard(const InterruptGuard&) = delete;
+        InterruptGuard& operator=(const InterruptGuard&) = delete;
+
+    private:
+        uint64_t rflags_;
+};
+
+// チケットロック。待っているCPUは取得を試みた順に獲得する
+// 保持したままタスクを切り替えてはならない（Sleepする箇所はInterruptGuardで守る）
+class SpinLock{
+    public:
+        void Lock(){
+            const uint32_t ticket = next_.fetch_add(1, std::memory_order_relaxed);
+            while (serving_.load(std::memory_order_acquire) != ticket){
+                __asm__ volatile("pause");
+            }
+        }
+
+        void Unlock(){
+            serving_.store(serving_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<uint32_t> next_{0}, serving_{0};
+};
+
+// 割り込みを禁止してからロックを取得する。割り込みハンドラと共有するデータはこれで守る
+class SpinLockGuard{
+    public:
+        explicit SpinLockGuard(SpinLock& lock) : lock_{lock} {lock_.Lock();}
+        ~SpinLockGuard() {lock_.Unlock();}
+        SpinLockGuard(const SpinLockGuard&) = delete;
+        SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+
+    private:
+        InterruptGuard irq_; // lock_より先に構築され、後に破棄される
+        SpinLock& lock_;
+};
@@ -0,0 +1,71 @@
+// 1つの送信者と1つの受信者のための、有界でロックフリーなバイト列のリングバッファ
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// head_は受信者だけが、tail_は送信者だけが進める。どちらも単調に増え、剰余で位置を求める
+// 送信者と受信者がそれぞれ1つであれば、割り込みを禁止したりロックを取ったりする必要はない
+class SPSCByteRing{
+    public:
+        // @param capacity  容量（2のべき乗のバイト数）
+        explicit SPSCByteRing(size_t capacity) : data_(capacity), mask_{capacity - 1} {}
+        SPSCByteRing(const SPSCByteRing&) = delete;
+        SPSCByteRing& operator=(const SPSCByteRing&) = delete;
+
+        // 空いている分だけ書き込み、書き込んだバイト数を返す。送信者から呼ぶこと
+        size_t Write(const void* buf, size_t len){
+            const uint64_t tail = tail_.load(std::memory_order_relaxed);
+            const uint64_t head = head_.load(std::memory_order_acquire);
+            const size_t n = std::min(len, Capacity() - static_cast<size_t>(tail - head));
+            if (n == 0){
+                return 0;
+            }
+
+            const size_t pos = tail & mask_;
+            const size_t first = std::min(n, Capacity() - pos);
+            auto src = reinterpret_cast<const uint8_t*>(buf);
+            memcpy(&data_[pos], src, first);
+            memcpy(&data_[0], src + first, n - first);
+            tail_.store(tail + n, std::memory_order_release);
+            return n;
+        }
+
+        // 溜まっている分だけ読み出し、読み出したバイト数を返す。受信者から呼ぶこと
+        size_t Read(void* buf, size_t len){
+            const uint64_t head = head_.load(std::memory_order_relaxed);
+            const uint64_t tail = tail_.load(std::memory_order_acquire);
+            const size_t n = std::min(len, static_cast<size_t>(tail - head));
+            if (n == 0){
+                return 0;
+            }
+
+            const size_t pos = head & mask_;
+            const size_t first = std::min(n, Capacity() - pos);
+            auto dst = reinterpret_cast<uint8_t*>(buf);
+            memcpy(dst, &data_[pos], first);
+            memcpy(dst + first, &data_[0], n - first);
+            head_.store(head + n, std::memory_order_release);
+            return n;
+        }
+
+        // どちらの側から呼んでもよいが、相手側の操作によって値はすぐに変わりうる
+        size_t Size() const{
+            return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+        }
+        bool Empty() const {return Size() == 0;}
+        bool Full() const {return Size() == Capacity();}
+
+        size_t Capacity() const {return mask_ + 1;}
+
+    private:
+        std::vector<uint8_t> data_;
+        const size_t mask_;
+        alignas(64) std::atomic<uint64_t> head_{0};
+        alignas(64) std::atomic<uint64_t> tail_{0};
+};
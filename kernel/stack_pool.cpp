@@ -0,0 +1,47 @@
+#include "stack_pool.hpp"
+
+#include "logger.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
+
+WithError<uint64_t> StackPool::Allocate(){
+    SpinLockGuard guard{lock_};
+    if (!free_stacks_.empty()){
+        const uint64_t stack_bottom = free_stacks_.back();
+        free_stacks_.pop_back();
+        return {stack_bottom, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    if (num_slots_ >= kMaxStacks){
+        return {0, MAKE_ERROR(Error::kFull)};
+    }
+
+    const uint64_t stack_bottom = kRegionBase + num_slots_*kSlotBytes + kGuardBytes;
+    if (auto err = SetupKernelPageMaps(LinearAddress4Level{stack_bottom}, kStackBytes / 4096)){
+        return {0, err};
+    }
+    ++num_slots_;
+    return {stack_bottom, MAKE_ERROR(Error::kSuccess)};
+}
+
+void StackPool::Free(uint64_t stack_bottom){
+    SpinLockGuard guard{lock_};
+    free_stacks_.push_back(stack_bottom);
+}
+
+bool StackPool::InGuardPage(uint64_t addr) const{
+    if (addr < kRegionBase || kRegionBase + num_slots_*kSlotBytes <= addr){
+        return false;
+    }
+    return (addr - kRegionBase) % kSlotBytes < kGuardBytes;
+}
+
+StackPool* stack_pool;
+
+void InitializeStackPool(){
+    stack_pool = new StackPool;
+    if (auto err = ReserveKernelPageMap(LinearAddress4Level{StackPool::kRegionBase})){
+        Log(kError, "failed to reserve stack region: %s\n", err.Name());
+        exit(1);
+    }
+}
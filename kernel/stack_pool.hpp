@@ -0,0 +1,36 @@
+// カーネルタスク用スタックのプール
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "error.hpp"
+#include "spinlock.hpp"
+
+// 専用の仮想アドレス領域に、未マップのガードページを下に挟んでスタックを配置する
+// 解放されたスタックはマップしたままプールに戻し、次のタスクで再利用する
+class StackPool{
+    public:
+        static const uint64_t kRegionBase = 0x0000'4000'0000'0000; // PML4の128番目のエントリ
+        static const size_t kStackBytes = 8*4096;
+        static const size_t kGuardBytes = 4096;
+        static const size_t kSlotBytes = kGuardBytes + kStackBytes;
+        static const size_t kMaxStacks = 4096;
+
+        // スタックを確保し、最下位アドレスを返す。スタックの頂上はその kStackBytes 上
+        WithError<uint64_t> Allocate();
+        void Free(uint64_t stack_bottom);
+        // addrがいずれかのスタックのガードページ内にあるか
+        bool InGuardPage(uint64_t addr) const;
+
+    private:
+        SpinLock lock_{};
+        std::vector<uint64_t> free_stacks_{};
+        size_t num_slots_{0}; // これまでにマップしたスロット数
+};
+
+extern StackPool* stack_pool;
+
+void InitializeStackPool();
@@ -1,5 +1,6 @@
 #include <cstdint>
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <cerrno>
@@ -14,7 +15,13 @@
 #include "font.hpp"
 #include "timer.hpp"
 #include "keyboard.hpp"
+#include "layer.hpp"
+#include "mutex.hpp"
 #include "app_event.hpp"
+#include "futex.hpp"
+#include "poll.hpp"
+#include "shm.hpp"
+#include "io_ring.hpp"
 
 namespace syscall{
     struct Result{
@@ -45,20 +52,20 @@ namespace syscall{
             return {0, E2BIG};
         }
 
-        __asm__("cli");
         auto& task = task_manager->CurrentTask();
-        __asm__("sti");
 
         if (fd < 0 || task.Files().size()<= fd || !task.Files()[fd]){
             return {0, EBADF};
         }
-        return {task.Files()[fd]->Write(s, len), 0};
+        const size_t n = task.Files()[fd]->Write(s, len);
+        if (n == 0 && len > 0 && task.Files()[fd]->WriteClosed()){
+            return {0, EPIPE};
+        }
+        return {n, 0};
     }
 
     SYSCALL (Exit){
-        __asm__("cli");
         auto& task = task_manager->CurrentTask();
-        __asm__("sti");
         return {task.OSStackPointer(), static_cast<int>(arg1)};
     }
 
@@ -67,13 +74,12 @@ namespace syscall{
         const auto title = reinterpret_cast<const char*>(arg5);
         const auto win = std::make_shared<ToplevelWindow>(w, h, screen_config.pixel_format, title);
 
-        __asm__("cli");
+        const auto task_id = task_manager->CurrentTask().ID();
+
+        MutexGuard lock{layer_mutex};
         const auto layer_id = layer_manager->NewLayer().SetWindow(win).SetDraggable(true).Move({x,y}).ID();
         active_layer->Activate(layer_id);
-
-        const auto task_id = task_manager->CurrentTask().ID();
         layer_task_map->insert(std::make_pair(layer_id, task_id));
-        __asm__("sti");
 
         return {layer_id, 0};
     }
@@ -84,9 +90,8 @@ namespace syscall{
             const uint32_t layer_flags = layer_id_flags >>32;
             const unsigned int layer_id = layer_id_flags & 0xffffffff;
 
-            __asm__("cli");
+            MutexGuard lock{layer_mutex};
             auto layer = layer_manager->FindLayer(layer_id);
-            __asm__("sti");
             if (layer == nullptr){
                 return {0, EBADF};
             }
@@ -97,9 +102,7 @@ namespace syscall{
             }
 
             if ((layer_flags & 1) == 0){
-                __asm__("cli");
                 layer_manager->Draw(layer_id);
-                __asm__("sti");
             }
 
             return res;
@@ -177,6 +180,8 @@ namespace syscall{
 
     SYSCALL(CloseWindow){
         const unsigned int layer_id = arg1 & 0xffffffff;
+
+        MutexGuard lock{layer_mutex};
         const auto layer = layer_manager->FindLayer(layer_id);
 
         if (layer == nullptr){
@@ -186,16 +191,53 @@ namespace syscall{
         const auto layer_pos = layer->GetPosition();
         const auto win_size = layer->GetWindow()->Size();
 
-        __asm__("cli");
         active_layer->Activate(0);
         layer_manager->RemoveLayer(layer_id);
         layer_manager->Draw({layer_pos, win_size});
         layer_task_map->erase(layer_id);
-        __asm__("sti");
 
         return {0,0};
     }
 
+    namespace {
+        // アプリへ渡すマウス移動は、この間隔（約1フレーム）ごとに1件まで
+        const unsigned long kMouseMoveInterval = kTimerFreq / 60 > 0 ? kTimerFreq / 60 : 1;
+        // フレームの終わりを知らせるタイマーの値。アプリのタイマーは負の値なので重ならない
+        const int kMouseMoveFrameTimer = 2;
+
+        // 保留中のマウス移動を今渡すべきならtrue。まだならフレームの終わりに届くタイマーを設定しておく
+        bool MouseMoveDue(Task& task){
+            auto& throttle = task.MouseMove();
+            const unsigned long deadline = throttle.tick + kMouseMoveInterval;
+            if (timer_manager->CurrentTick() >= deadline){
+                return true;
+            }
+            // 後ろに届いているボタン操作を追い越さない
+            if (task.AnyMessage([](const Message& m){return m.type == Message::kMouseButton;})){
+                return true;
+            }
+            if (!throttle.timer_armed){
+                if (auto [handle, err] = timer_manager->AddTimer(Timer{deadline, kMouseMoveFrameTimer, task.ID()}); err){
+                    return true; // タイマーを設定できなければ待たずに渡す
+                }
+                throttle.timer_armed = true;
+            }
+            return false;
+        }
+
+        void FlushMouseMove(MouseMoveThrottle& throttle, AppEvent& event){
+            const auto& m = throttle.pending->arg.mouse_move;
+            event.type = AppEvent::kMouseMove;
+            event.arg.mouse_move.x = m.x;
+            event.arg.mouse_move.y = m.y;
+            event.arg.mouse_move.dx = m.dx;
+            event.arg.mouse_move.dy = m.dy;
+            event.arg.mouse_move.buttons = m.buttons;
+            throttle.pending.reset();
+            throttle.tick = timer_manager->CurrentTick();
+        }
+    }
+
     SYSCALL(ReadEvent){
         if (arg1 < 0x8000'0000'0000'0000){
             return {0, EFAULT};
@@ -203,20 +245,19 @@ namespace syscall{
         const auto app_events = reinterpret_cast<AppEvent*>(arg1);
         const size_t len = arg2;
 
-        __asm__("cli");
         auto& task = task_manager->CurrentTask();
-        __asm__("sti");
+        auto& throttle = task.MouseMove();
         size_t i=0;
 
         while (i<len){
-            __asm__("cli");
-            auto msg = task.ReceiveMessage();
-            if (!msg && i == 0){
-                task.Sleep();
+            if (throttle.pending && MouseMoveDue(task)){
+                FlushMouseMove(throttle, app_events[i]);
+                ++i;
                 continue;
             }
-            __asm__("sti");
 
+            // 1件目が届くまでは待ち、以降は届いている分だけ返す
+            std::optional<Message> msg = i == 0 ? task.WaitMessage() : task.ReceiveMessage();
             if (!msg){
                 break;
             }
@@ -236,13 +277,17 @@ namespace syscall{
                     }
                     break;
                 case Message::kMouseMove:
-                    app_events[i].type = AppEvent::kMouseMove;
-                    app_events[i].arg.mouse_move.x = msg->arg.mouse_move.x;
-                    app_events[i].arg.mouse_move.y = msg->arg.mouse_move.y;
-                    app_events[i].arg.mouse_move.dx = msg->arg.mouse_move.dx;
-                    app_events[i].arg.mouse_move.dy = msg->arg.mouse_move.dy;
-                    app_events[i].arg.mouse_move.buttons = msg->arg.mouse_move.buttons;
-                    ++i;
+                    // 素早く動かしても移動は1フレームに1件にする。届いた移動は保留中の移動へまとめておき、
+                    // 前回から1フレーム経ったら（ループの先頭で）渡す。待つ間も他のイベントは返す
+                    task.CoalesceMessages(*msg);
+                    if (!throttle.pending){
+                        throttle.pending = *msg;
+                    } else if (!MergeMessage(*throttle.pending, *msg)){
+                        // ボタンの状態が変わったので、保留中の移動を先に渡す
+                        FlushMouseMove(throttle, app_events[i]);
+                        ++i;
+                        throttle.pending = *msg;
+                    }
                     break;
                 case Message::kMouseButton:
                     app_events[i].type = AppEvent::kMouseButton;
@@ -253,7 +298,9 @@ namespace syscall{
                     ++i;
                     break;
                 case Message::kTimerTimeout:
-                    if (msg->arg.timer.value < 0){
+                    if (msg->arg.timer.value == kMouseMoveFrameTimer){
+                        throttle.timer_armed = false;
+                    } else if (msg->arg.timer.value < 0){
                         app_events[i].type = AppEvent::kTimerTimeout;
                         app_events[i].arg.timer.timeout = msg->arg.timer.timeout;
                         app_events[i].arg.timer.value = -msg->arg.timer.value;
@@ -274,22 +321,151 @@ namespace syscall{
         if (timer_value <= 0){
             return {0, EINVAL};
         }
+        if (arg4 != 0 && arg4 < 0x8000'0000'0000'0000){
+            return {0, EFAULT};
+        }
 
-        __asm__("cli");
         const uint64_t task_id = task_manager->CurrentTask().ID();
-        __asm__("sti");
 
         unsigned long timeout = arg3 * kTimerFreq / 1000;
         if (mode & 1){
             timeout += timer_manager->CurrentTick();
         }
 
-        __asm__("cli");
-        timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
-        __asm__("sti");
+        auto [handle, err] = timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+        if (err){
+            return {0, EAGAIN};
+        }
+
+        if (arg4 != 0){
+            *reinterpret_cast<uint64_t*>(arg4) = handle;
+        }
         return {timeout*1000 / kTimerFreq, 0};
     }
 
+    SYSCALL(CancelTimer){
+        const TimerHandle handle = arg1;
+
+        const uint64_t task_id = task_manager->CurrentTask().ID();
+        auto err = timer_manager->CancelTimer(handle, task_id);
+        if (err){
+            return {0, ENOENT};
+        }
+        return {0, 0};
+    }
+
+    SYSCALL(GetTaskStats){
+        if (arg1 < 0x8000'0000'0000'0000){
+            return {0, EFAULT};
+        }
+        const auto buf = reinterpret_cast<TaskStat*>(arg1);
+        const size_t len = arg2;
+
+        // 返り値は全タスク数。バッファにはそのうち先頭のlen個までを書き込む
+        const auto stats = task_manager->Stats();
+        for (size_t i=0; i<len && i<stats.size(); ++i){
+            buf[i] = stats[i];
+        }
+        return {stats.size(), 0};
+    }
+
+    namespace {
+        bool IsValidFutexAddress(uint64_t addr){
+            return addr >= 0x8000'0000'0000'0000 && (addr & 3) == 0;
+        }
+    }
+
+    SYSCALL(FutexWait){
+        if (!IsValidFutexAddress(arg1)){
+            return {0, EINVAL};
+        }
+        const auto addr = reinterpret_cast<const uint32_t*>(arg1);
+        const uint32_t expected = arg2;
+        const unsigned long timeout_ms = arg3;
+        const unsigned long timeout_ticks = (timeout_ms * kTimerFreq + 999) / 1000;
+
+        auto [result, err] = futex_table->Wait(addr, expected, timeout_ticks);
+        if (err){
+            return {0, err.Cause() == Error::kFull ? ENOMEM : EFAULT};
+        }
+        switch (result){
+            case FutexWaitResult::kWoken: return {0, 0};
+            case FutexWaitResult::kValueMismatch: return {0, EAGAIN};
+            case FutexWaitResult::kTimedOut: return {0, ETIMEDOUT};
+        }
+        return {0, 0};
+    }
+
+    SYSCALL(FutexWake){
+        if (!IsValidFutexAddress(arg1)){
+            return {0, EINVAL};
+        }
+        const auto addr = reinterpret_cast<const uint32_t*>(arg1);
+        const int n = arg2;
+
+        auto [num_woken, err] = futex_table->Wake(addr, n);
+        if (err){
+            return {0, EFAULT};
+        }
+        return {static_cast<uint64_t>(num_woken), 0};
+    }
+
+    SYSCALL(PollCtl){
+        const int op = arg1, fd = arg2;
+        const uint32_t events = arg3;
+        const uint64_t data = arg4;
+
+        auto err = task_manager->CurrentTask().Poll().Control(op, fd, events, data);
+        switch (err.Cause()){
+            case Error::kSuccess: return {0, 0};
+            case Error::kInvalidFile: return {0, EBADF};
+            case Error::kAlreadyAllocated: return {0, EEXIST};
+            case Error::kNoSuchEntry: return {0, ENOENT};
+            default: return {0, EINVAL};
+        }
+    }
+
+    SYSCALL(PollWait){
+        if (arg1 < 0x8000'0000'0000'0000){
+            return {0, EFAULT};
+        }
+        const auto events = reinterpret_cast<PollEvent*>(arg1);
+        const size_t max = arg2;
+        const long timeout_ms = arg3;
+        if (max == 0){
+            return {0, EINVAL};
+        }
+
+        long timeout_ticks = -1;
+        if (timeout_ms >= 0){
+            timeout_ticks = (timeout_ms * kTimerFreq + 999) / 1000;
+        }
+        auto [n, err] = task_manager->CurrentTask().Poll().Wait(events, max, timeout_ticks);
+        if (err){
+            return {0, err.Cause() == Error::kFull ? ENOMEM : EFAULT};
+        }
+        return {n, 0};
+    }
+
+    SYSCALL(Splice){
+        const int fd = arg1;
+        const auto len = arg3;
+        if (arg2 < 0x8000'0000'0000'0000 || arg2 + len < arg2){
+            return {0, EFAULT};
+        }
+        const auto buf = reinterpret_cast<const void*>(arg2);
+
+        auto& task = task_manager->CurrentTask();
+        if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]){
+            return {0, EBADF};
+        }
+        const size_t n = task.Files()[fd]->Splice(buf, len);
+        if (n == 0 && len > 0 && task.Files()[fd]->WriteClosed()){
+            return {0, EPIPE};
+        }
+        return {n, 0};
+    }
+
     namespace {
         size_t AllocateFD(Task& task){
             const size_t num_files = task.Files().size();
@@ -302,6 +478,18 @@ namespace syscall{
             return num_files;
         }
 
+        // 共有メモリをタスクのファイルマップ領域の下端へマップし、先頭アドレスを返す
+        WithError<uint64_t> MapSharedMemoryInto(Task& task, SharedMemory& shm){
+            const uint64_t vaddr_end = task.FileMapEnd();
+            const uint64_t vaddr_begin = vaddr_end - shm.Size();
+            if (auto err = MapSharedFrames(LinearAddress4Level{vaddr_begin}, shm.Frames())){
+                return {0, err};
+            }
+            task.SetFileMapEnd(vaddr_begin);
+            task.SharedMaps().push_back(SharedMapping{vaddr_begin, vaddr_end});
+            return {vaddr_begin, MAKE_ERROR(Error::kSuccess)};
+        }
+
         std::pair<fat::DirectoryEntry*, int> CreateFile(const char* path){
             auto [file, err] = fat::CreateFile(path);
 
@@ -317,9 +505,7 @@ namespace syscall{
     SYSCALL(OpenFile){
         const char* path = reinterpret_cast<const char*>(arg1);
         const int flags = arg2;
-        __asm__("cli");
         auto& task = task_manager->CurrentTask();
-        __asm__("sti");
 
         if (strcmp(path, "@stdin") == 0){
             return {0, 0};
@@ -348,9 +534,7 @@ namespace syscall{
         const int fd = arg1;
         void* buf = reinterpret_cast<void*>(arg2);
         size_t count = arg3;
-        __asm__("cli");
         auto& task = task_manager->CurrentTask();
-        __asm__("sti");
 
         if (fd <0 || task.Files().size() <= fd || !task.Files()[fd]){
             return {0, EBADF};
@@ -360,9 +544,7 @@ namespace syscall{
 
     SYSCALL(DemandPages){
         const size_t num_pages = arg1;
-        __asm__("cli");
         auto& task = task_manager->CurrentTask();
-        __asm__("sti");
 
         const uint64_t dp_end = task.DPagingEnd();
         task.SetDPagingEnd(dp_end + 4096*num_pages);
@@ -372,9 +554,7 @@ namespace syscall{
     SYSCALL(MapFile){
         const int fd = arg1;
         size_t* file_size = reinterpret_cast<size_t*>(arg2);
-        __asm__("cli");
         auto& task = task_manager->CurrentTask();
-        __asm__("sti");
 
         if (fd < 0 || task.Files().size() <= fd || task.Files()[fd]){
             return {0, EBADF};
@@ -388,12 +568,160 @@ namespace syscall{
         return {vaddr_begin, 0};
     }
 
+    SYSCALL(OpenSharedMemory){
+        if (arg1 < 0x8000'0000'0000'0000){
+            return {0, EFAULT};
+        }
+        const char* name = reinterpret_cast<const char*>(arg1);
+        const size_t size = arg2;
+        const int flags = arg3;
+        auto& task = task_manager->CurrentTask();
+
+        auto [shm, err] = ::OpenSharedMemory(name, size, flags & O_CREAT);
+        switch (err.Cause()){
+            case Error::kSuccess: break;
+            case Error::kNoSuchEntry: return {0, ENOENT};
+            case Error::kNoEnoughMemory: return {0, ENOMEM};
+            default: return {0, EINVAL};
+        }
+
+        size_t fd = AllocateFD(task);
+        task.Files()[fd] = std::make_shared<SharedMemoryDescriptor>(shm);
+        return {fd, 0};
+    }
+
+    SYSCALL(MapSharedMemory){
+        if (arg2 < 0x8000'0000'0000'0000){
+            return {0, EFAULT};
+        }
+        const int fd = arg1;
+        size_t* size = reinterpret_cast<size_t*>(arg2);
+        auto& task = task_manager->CurrentTask();
+
+        if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]){
+            return {0, EBADF};
+        }
+        auto shm = task.Files()[fd]->SharedMemoryObject();
+        if (shm == nullptr){
+            return {0, EINVAL};
+        }
+
+        auto [vaddr_begin, err] = MapSharedMemoryInto(task, *shm);
+        if (err){
+            return {0, ENOMEM};
+        }
+        *size = shm->Size();
+        return {vaddr_begin, 0};
+    }
+
+    SYSCALL(UnmapSharedMemory){
+        const uint64_t vaddr = arg1;
+        auto& maps = task_manager->CurrentTask().SharedMaps();
+        auto it = std::find_if(maps.begin(), maps.end(),
+                               [vaddr](const SharedMapping& m){ return m.vaddr_begin == vaddr; });
+        if (it == maps.end()){
+            return {0, EINVAL};
+        }
+        UnmapPages(LinearAddress4Level{it->vaddr_begin}, (it->vaddr_end - it->vaddr_begin) / 4096);
+        maps.erase(it);
+        // リングのマップを外したらリングも使えなくなる
+        if (auto& io_ring = task_manager->CurrentTask().IoRing(); io_ring.vaddr == vaddr){
+            io_ring = {0, 0};
+        }
+        return {0, 0};
+    }
+
+    namespace {
+        const uint64_t kIoRingSQOffset = 64; // 管理領域の後ろ、SQEの配列の位置
+
+        // リングから発行できるシステムコール。Exitやリング自身の操作などは発行できない
+        Result (*IoRingOperation(uint64_t op))(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t){
+            switch (op){
+                case IO_RING_OP_PUT_STRING: return PutString;
+                case IO_RING_OP_WIN_WRITE_STRING: return WinWriteString;
+                case IO_RING_OP_WIN_FILL_RECTANGLE: return WinFillRectangle;
+                case IO_RING_OP_WIN_REDRAW: return WinRedraw;
+                case IO_RING_OP_WIN_DRAW_LINE: return WinDrawLine;
+                case IO_RING_OP_CREATE_TIMER: return CreateTimer;
+                case IO_RING_OP_READ_FILE: return ReadFile;
+                default: return nullptr;
+            }
+        }
+    }
+
+    SYSCALL(IoRingSetup){
+        const size_t requested = arg1;
+        auto& task = task_manager->CurrentTask();
+        if (requested == 0 || requested > IO_RING_MAX_ENTRIES){
+            return {0, EINVAL};
+        }
+        if (task.IoRing().vaddr != 0){
+            return {0, EEXIST};
+        }
+
+        uint32_t entries = 1;
+        while (entries < requested){
+            entries <<= 1;
+        }
+        const uint64_t cq_offset = kIoRingSQOffset + entries * sizeof(IoRingSQE);
+        auto [shm, err] = SharedMemory::Create(cq_offset + entries * sizeof(IoRingCQE));
+        if (err){
+            return {0, ENOMEM};
+        }
+
+        auto [vaddr_begin, map_err] = MapSharedMemoryInto(task, *shm);
+        if (map_err){
+            return {0, ENOMEM};
+        }
+        task.IoRing() = {vaddr_begin, entries};
+
+        auto ring = reinterpret_cast<IoRing*>(vaddr_begin);
+        ring->entries = entries;
+        ring->sq_offset = kIoRingSQOffset;
+        ring->cq_offset = cq_offset;
+        return {vaddr_begin, 0};
+    }
+
+    SYSCALL(IoRingEnter){
+        const size_t to_submit = arg1;
+        const auto io_ring = task_manager->CurrentTask().IoRing();
+        if (io_ring.vaddr == 0){
+            return {0, EINVAL};
+        }
+
+        // 管理領域のentriesやオフセットはアプリが書き換えられるので、控えておいた値を使う
+        auto ring = reinterpret_cast<IoRing*>(io_ring.vaddr);
+        const uint32_t mask = io_ring.entries - 1;
+        auto sqes = reinterpret_cast<const IoRingSQE*>(io_ring.vaddr + kIoRingSQOffset);
+        auto cqes = reinterpret_cast<IoRingCQE*>(io_ring.vaddr + kIoRingSQOffset + io_ring.entries * sizeof(IoRingSQE));
+
+        size_t submitted = 0;
+        uint32_t head = ring->sq_head;
+        while (submitted < to_submit && head != ring->sq_tail){
+            const uint32_t cq_tail = ring->cq_tail;
+            if (cq_tail - ring->cq_head >= io_ring.entries){
+                break; // 完了リングが満杯。アプリが読み出してから再び投入する
+            }
+
+            const IoRingSQE sqe = sqes[head & mask];
+            Result res{0, EINVAL};
+            if (auto op = IoRingOperation(sqe.op)){
+                res = op(sqe.args[0], sqe.args[1], sqe.args[2], sqe.args[3], sqe.args[4], sqe.args[5]);
+            }
+            cqes[cq_tail & mask] = IoRingCQE{sqe.user_data, res.value, res.error, 0};
+            ring->cq_tail = cq_tail + 1;
+            ring->sq_head = ++head;
+            ++submitted;
+        }
+        return {submitted, 0};
+    }
+
     #undef SYSCALL
 }
 
 using SyscallFuncType = syscall::Result (uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 
-extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
+extern "C" std::array<SyscallFuncType*, 0x1c> syscall_table{
     syscall::LogString,
     syscall::PutString,
     syscall::Exit,
@@ -410,11 +738,23 @@ extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
     syscall::ReadFile,
     syscall::DemandPages,
     syscall::MapFile,
+    syscall::CancelTimer,
+    syscall::GetTaskStats,
+    syscall::FutexWait,
+    syscall::FutexWake,
+    syscall::PollCtl,
+    syscall::PollWait,
+    syscall::Splice,
+    syscall::OpenSharedMemory,
+    syscall::MapSharedMemory,
+    syscall::UnmapSharedMemory,
+    syscall::IoRingSetup,
+    syscall::IoRingEnter,
 };
 
 void InitializeSyscall(){
     WriteMSR(kIA32_EFER, 0x0501u);
     WriteMSR(kIA32_LSTAR, reinterpret_cast<uint64_t>(SyscallEntry));
     WriteMSR(kIA32_STAR, static_cast<uint64_t>(8)<<32 | static_cast<uint64_t>(16|3)<<48);
-    WriteMSR(kIA32_FMASK, 0);
+    WriteMSR(kIA32_FMASK, 0x200); // 入口ではIFを下ろし、スタックを切り替えてから許可する
 }
\ No newline at end of file
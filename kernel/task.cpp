@@ -1,28 +1,81 @@
 #include "task.hpp"
 
 #include "asmfunc.h"
+#include "fpu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
 #include "segment.hpp"
+#include "spinlock.hpp"
+#include "stack_pool.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
 
 namespace{
-    template <class T, class U>
-    void Erase(T& c, const U& value){
-        auto it = std::remove(c.begin(), c.end(), value);
-        c.erase(it, c.end());
-    }
-
     void TaskIdle(uint64_t task_id, int64_t data){
         while (true) __asm__("hlt");
     }
+
+    // スリープから戻ったタスクに与えるvruntimeの猶予（タイムスライスの半分）
+    uint64_t SleeperBonus(){
+        return tsc_freq * kTaskTimerPeriod / kTimerFreq / 2;
+    }
+}
+
+bool MergeMessage(Message& dst, const Message& src){
+    if (dst.type != src.type){
+        return false;
+    }
+
+    switch (dst.type){
+        case Message::kMouseMove: {
+            auto& d = dst.arg.mouse_move;
+            const auto& s = src.arg.mouse_move;
+            if (d.buttons != s.buttons){
+                return false;
+            }
+            d.x = s.x;
+            d.y = s.y;
+            d.dx += s.dx;
+            d.dy += s.dy;
+            return true;
+        }
+        case Message::kMouseInput: {
+            auto& d = dst.arg.mouse_input;
+            const auto& s = src.arg.mouse_input;
+            if (d.buttons != s.buttons){
+                return false;
+            }
+            d.dx += s.dx;
+            d.dy += s.dy;
+            return true;
+        }
+        default:
+            return false;
+    }
 }
 
-Task::Task(uint64_t id) : id_{id}, msgs_{}{
+Task::Task(uint64_t id) : id_{id}{
+    fpu_area_buf_.resize(FPUAreaBytes() + 63);
+    fpu_area_ = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(&fpu_area_buf_[0]) + 63) & ~static_cast<uintptr_t>(63));
+
+    // MXCSRの全ての例外をマスク
+    *reinterpret_cast<uint32_t*>(&fpu_area_[24]) = 0x1f80;
+}
+
+Task::~Task(){
+    if (stack_bottom_){
+        stack_pool->Free(stack_bottom_);
+    }
 }
 
-Task& Task::InitContext(TaskFunc* f, int64_t data){
-    const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-    stack_.resize(stack_size);
-    uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+WithError<Task&> Task::InitContext(TaskFunc* f, int64_t data){
+    static_assert(kDefaultStackBytes == StackPool::kStackBytes);
+    if (auto [stack_bottom, err] = stack_pool->Allocate(); err){
+        return {*this, err};
+    } else {
+        stack_bottom_ = stack_bottom;
+    }
+    uint64_t stack_end = stack_bottom_ + kDefaultStackBytes;
 
     memset(&context_, 0, sizeof(context_));
     context_.cr3 = GetCR3();
@@ -35,10 +88,7 @@ Task& Task::InitContext(TaskFunc* f, int64_t data){
     context_.rdi = id_;
     context_.rsi = data;
 
-    // MXCSRの全ての例外をマスク
-    *reinterpret_cast<uint32_t*>(&context_.fxsave_area[24]) = 0x1f80;
-
-    return *this;
+    return {*this, MAKE_ERROR(Error::kSuccess)};
 }
 
 TaskContext& Task::Context(){
@@ -63,21 +113,93 @@ Task& Task::Wakeup(){
     return *this;
 }
 
-void Task::SendMessage(const Message& msg){
-    msgs_.push_back(msg);
-    Wakeup();
+Error Task::SendMessage(const Message& msg){
+    if (!TrySendMessage(msg)){
+        msg_drops_.fetch_add(1, std::memory_order_relaxed);
+        return MAKE_ERROR(Error::kFull);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+bool Task::TrySendMessage(const Message& msg){
+    if (!msgs_.Push(msg)){
+        msg_overflows_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // 受信者が空を観測して待っている場合（空→非空の遷移）だけ起床させる
+    if (receiver_waiting_.exchange(false, std::memory_order_acq_rel)){
+        InterruptGuard guard;
+        Wakeup();
+    }
+    mailbox_notifier_.Notify();
+    return true;
 }
 
 std::optional<Message> Task::ReceiveMessage(){
-    if (msgs_.empty()){
-        return std::nullopt;
+    if (auto m = msgs_.Pop()){
+        WakeBlockedSenders();
+        return m;
     }
 
-    auto m = msgs_.front();
-    msgs_.pop_front();
+    receiver_waiting_.store(true, std::memory_order_seq_cst);
+    // 待ちを表明する直前に送信されたメッセージを取りこぼさないよう再確認する
+    auto m = msgs_.Pop();
+    if (m){
+        receiver_waiting_.store(false, std::memory_order_relaxed);
+        WakeBlockedSenders();
+    }
     return m;
 }
 
+Message Task::WaitMessage(){
+    while (true){
+        // 受信待ちの表明からSleepまでの間に起床されると取りこぼすため、割り込みを禁止しておく
+        InterruptGuard guard;
+        if (auto msg = ReceiveMessage()){
+            return *msg;
+        }
+        Sleep();
+    }
+}
+
+void Task::CoalesceMessages(Message& msg){
+    while (auto next = msgs_.Peek()){
+        if (!MergeMessage(msg, *next)){
+            break;
+        }
+        msgs_.Pop();
+        WakeBlockedSenders();
+    }
+}
+
+void Task::WakeBlockedSenders(){
+    InterruptGuard guard;
+    for (auto sender : blocked_senders_){
+        sender->Wakeup();
+    }
+    blocked_senders_.clear();
+}
+
+PollSet& Task::Poll(){
+    if (!poll_set_){
+        poll_set_ = std::make_unique<PollSet>(*this);
+    }
+    return *poll_set_;
+}
+
+void Task::ClosePoll(){
+    poll_set_.reset();
+}
+
+MailboxStat Task::Mailbox() const{
+    return {
+        msgs_.Size(),
+        msg_overflows_.load(std::memory_order_relaxed),
+        msg_drops_.load(std::memory_order_relaxed),
+    };
+}
+
 std::vector<std::shared_ptr<::FileDescriptor>>& Task::Files(){
     return files_;
 }
@@ -110,12 +232,116 @@ std::vector<FileMapping>& Task::FileMaps(){
     return file_maps_;
 }
 
+std::vector<SharedMapping>& Task::SharedMaps(){
+    return shared_maps_;
+}
+
+TaskStat Task::Stat() const{
+    TaskStat stat = stat_;
+    stat.id = id_;
+    stat.level = level_;
+    stat.running = running_;
+    return stat;
+}
+
+bool RunQueue::Empty() const{
+    if (fair_){
+        return current_ == nullptr && tree_.empty();
+    }
+    return tasks_.empty();
+}
+
+Task* RunQueue::Front(){
+    if (Empty()){
+        return nullptr;
+    }
+    if (!fair_){
+        return tasks_.front();
+    }
+
+    if (current_ == nullptr){
+        auto it = tree_.begin();
+        current_ = it->second;
+        tree_.erase(it);
+        min_vruntime_ = std::max(min_vruntime_, current_->vruntime_);
+    }
+    return current_;
+}
+
+void RunQueue::PopFront(){
+    if (!fair_){
+        tasks_.pop_front();
+        return;
+    }
+
+    Front();
+    current_ = nullptr;
+}
+
+void RunQueue::PushFront(Task* task){
+    if (!fair_){
+        tasks_.push_front(task);
+        return;
+    }
+
+    if (current_){
+        PushBack(current_);
+    }
+    task->vruntime_ = std::max(task->vruntime_, min_vruntime_);
+    current_ = task;
+}
+
+void RunQueue::PushBack(Task* task){
+    if (!fair_){
+        tasks_.push_back(task);
+        return;
+    }
+
+    const uint64_t bonus = SleeperBonus();
+    if (min_vruntime_ > bonus){
+        task->vruntime_ = std::max(task->vruntime_, min_vruntime_ - bonus);
+    }
+    tree_.insert({task->vruntime_, task});
+}
+
+void RunQueue::Erase(Task* task){
+    if (!fair_){
+        tasks_.erase(std::remove(tasks_.begin(), tasks_.end(), task), tasks_.end());
+        return;
+    }
+
+    if (current_ == task){
+        current_ = nullptr;
+        return;
+    }
+    auto [first, last] = tree_.equal_range(task->vruntime_);
+    for (auto it = first; it != last; ++it){
+        if (it->second == task){
+            tree_.erase(it);
+            return;
+        }
+    }
+}
+
 TaskManager::TaskManager(){
+    if (kFairLevel >= 0){
+        running_[kFairLevel].EnableFair();
+    }
+
     Task& task = NewTask().SetLevel(current_level_).SetRunning(true);
-    running_[current_level_].push_back(&task);
+    running_[current_level_].PushBack(&task);
+    UpdateCurrentTask();
+    fpu_owner_area = task.FPUArea(); // 起動時のFPUの状態はメインタスクのもの
+
+    auto [idle, err] = NewTask().InitContext(TaskIdle, 0);
+    if (err){
+        Log(kError, "failed to create idle task: %s\n", err.Name());
+        while (true) __asm__("hlt");
+    }
+    idle.SetLevel(0).SetRunning(true);
+    running_[0].PushBack(&idle);
 
-    Task& idle = NewTask().InitContext(TaskIdle, 0).SetLevel(0).SetRunning(true);
-    running_[0].push_back(&idle);
+    last_charge_tsc_ = ReadTSC();
 }
 
 Task& TaskManager::NewTask(){
@@ -123,12 +349,25 @@ Task& TaskManager::NewTask(){
     return *tasks_.emplace_back(new Task{latest_id_});
 }
 
+void TaskManager::DiscardTask(Task& task){
+    InterruptGuard guard;
+    auto it = std::find_if(tasks_.begin(), tasks_.end(), [&task](const auto& t){return t.get() == &task;});
+    if (it != tasks_.end()){
+        tasks_.erase(it);
+    }
+}
+
 void TaskManager::SwitchTask(const TaskContext& current_ctx){
     TaskContext& task_ctx = task_manager->CurrentTask().Context();
     memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
+    ChargeCurrentTask();
     Task* current_task = RotateCurrentRunQueue(false);
-    if (&CurrentTask() != current_task){
-        RestoreContext(&CurrentTask().Context());
+    Task& next_task = UpdateCurrentTask();
+    if (&next_task != current_task){
+        ++current_task->stat_.involuntary_switches;
+        Trace(TraceType::kSwitchTask, next_task.ID());
+        PrepareFPU(next_task.FPUArea());
+        RestoreContext(&next_task.Context());
     }
 }
 
@@ -138,14 +377,19 @@ void TaskManager::Sleep(Task* task){
     }
 
     task->SetRunning(false);
+    Trace(TraceType::kSleep, task->ID());
 
-    if (task == running_[current_level_].front()){
+    if (task == running_[current_level_].Front()){
+        ChargeCurrentTask();
+        ++task->stat_.voluntary_switches;
         Task* current_task = RotateCurrentRunQueue(true);
-        SwitchContext(&CurrentTask().Context(), &current_task->Context());
+        Task& next_task = UpdateCurrentTask();
+        PrepareFPU(next_task.FPUArea());
+        SwitchContext(&next_task.Context(), &current_task->Context());
         return;
     }
 
-    Erase(running_[task->Level()], task);
+    running_[task->Level()].Erase(task);
 }
 
 Error TaskManager::Sleep(uint64_t id){
@@ -163,6 +407,7 @@ void TaskManager::Wakeup(Task* task, int level){
         ChangeLevelRunning(task, level);
         return;
     }
+    Trace(TraceType::kWakeup, task->ID());
 
     if (level < 0){
         level = task->Level();
@@ -171,7 +416,7 @@ void TaskManager::Wakeup(Task* task, int level){
     task->SetLevel(level);
     task->SetRunning(true);
 
-    running_[level].push_back(task);
+    running_[level].PushBack(task);
     if (level > current_level_){
         level_changed_ = true;
     }
@@ -188,24 +433,79 @@ Error TaskManager::Wakeup(uint64_t id, int level){
     return MAKE_ERROR(Error::kSuccess);
 }
 
+Error TaskManager::SetWeight(uint64_t id, unsigned int weight){
+    // 実行中のタスクへの加算と重なっても、次の加算から新しい重みが使われるだけ
+    InterruptGuard guard;
+    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t){return t->ID() == id;});
+    if (it == tasks_.end()){
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+    (*it)->SetWeight(weight);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
 Error TaskManager::SendMessage(uint64_t id, const Message& msg){
+    // 送信先のタスクが走査中に追加・削除されないよう、割り込みを禁止しておく
+    InterruptGuard guard;
     auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t){return t->ID() == id;});
     if (it ==tasks_.end()){
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    (*it)->SendMessage(msg);
+    return (*it)->SendMessage(msg);
+}
+
+Error TaskManager::TrySendMessage(uint64_t id, const Message& msg){
+    InterruptGuard guard;
+    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t){return t->ID() == id;});
+    if (it == tasks_.end()){
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+    if (!(*it)->TrySendMessage(msg)){
+        return MAKE_ERROR(Error::kFull);
+    }
     return MAKE_ERROR(Error::kSuccess);
 }
 
-Task& TaskManager::CurrentTask(){
-    return *running_[current_level_].front();
+Error TaskManager::SendMessageWait(uint64_t id, const Message& msg){
+    Task* sender = &CurrentTask();
+    // 満杯を確かめてから眠るまでに受信者が取り出すと起床を取りこぼすため、割り込みを禁止しておく
+    InterruptGuard guard;
+    while (true){
+        auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t){return t->ID() == id;});
+        if (it == tasks_.end()){
+            return MAKE_ERROR(Error::kNoSuchTask);
+        }
+        Task& receiver = **it;
+        if (receiver.TrySendMessage(msg)){
+            return MAKE_ERROR(Error::kSuccess);
+        }
+
+        // 受信者が取り出したとき（または終了したとき）に起こしてもらう
+        auto& senders = receiver.blocked_senders_;
+        if (std::find(senders.begin(), senders.end(), sender) == senders.end()){
+            senders.push_back(sender);
+        }
+        Sleep(sender);
+    }
 }
 
 void TaskManager::Finish(int exit_code){
+    // 他のタスクへ切り替えて戻らないので、割り込みは切り替え先のRFLAGSで再び許可される
+    __asm__("cli");
+    ChargeCurrentTask();
     Task* current_task = RotateCurrentRunQueue(true);
+    // 以降の処理（Traceなど）が削除後のタスクを参照しないよう、先に切り替え先を記録する
+    Task& next_task = UpdateCurrentTask();
 
     const auto task_id = current_task->ID();
+    if (fpu_owner_area == current_task->FPUArea()){
+        fpu_owner_area = nullptr;
+    }
+    // 送信を待っているタスクは、送り先がなくなったことを知って戻る
+    for (auto sender : current_task->blocked_senders_){
+        Wakeup(sender);
+    }
     auto it = std::find_if(tasks_.begin(), tasks_.end(), [current_task](const auto& t){return t.get() == current_task;});
     tasks_.erase(it);
 
@@ -216,10 +516,12 @@ void TaskManager::Finish(int exit_code){
         Wakeup(waiter);
     }
 
-    RestoreContext(&CurrentTask().Context());
+    PrepareFPU(next_task.FPUArea());
+    RestoreContext(&next_task.Context());
 }
 
 WithError<int> TaskManager::WaitFinish(uint64_t task_id){
+    InterruptGuard guard;
     int exit_code;
     Task* current_task = &CurrentTask();
     while (true){
@@ -234,15 +536,44 @@ WithError<int> TaskManager::WaitFinish(uint64_t task_id){
     return {exit_code, MAKE_ERROR(Error::kSuccess)};
 }
 
+void TaskManager::BeginSyscall(){
+    ChargeCurrentTask();
+    CurrentTask().in_syscall_ = true;
+}
+
+void TaskManager::EndSyscall(){
+    ChargeCurrentTask();
+    CurrentTask().in_syscall_ = false;
+}
+
+std::vector<TaskStat> TaskManager::Stats(){
+    std::vector<TaskStat> stats;
+    InterruptGuard guard;
+    ChargeCurrentTask();
+    stats.reserve(tasks_.size());
+    for (const auto& t : tasks_){
+        stats.push_back(t->Stat());
+    }
+    return stats;
+}
+
+Task& TaskManager::UpdateCurrentTask(){
+    Task* task = running_[current_level_].Front();
+    PerCPU& cpu = ThisCPU();
+    cpu.current_task = task;
+    cpu.os_stack_ptr = task->OSStackPointer();
+    return *task;
+}
+
 void TaskManager::ChangeLevelRunning(Task* task, int level){
     if (level < 0 || level == task->Level()){
         return;
     }
 
-    if (task != running_[current_level_].front()){
+    if (task != running_[current_level_].Front()){
         // 他のタスクの優先度レベルの変更
-        Erase(running_[task->Level()], task);
-        running_[level].push_back(task);
+        running_[task->Level()].Erase(task);
+        running_[level].PushBack(task);
         task->SetLevel(level);
         if (level > current_level_){
             level_changed_ = true;
@@ -250,8 +581,8 @@ void TaskManager::ChangeLevelRunning(Task* task, int level){
         return;
     }
 
-    running_[current_level_].pop_front();
-    running_[level].push_front(task);
+    running_[current_level_].PopFront();
+    running_[level].PushFront(task);
     task->SetLevel(level);
     if (level >= current_level_){
         current_level_ = level;
@@ -263,19 +594,19 @@ void TaskManager::ChangeLevelRunning(Task* task, int level){
 
 Task* TaskManager::RotateCurrentRunQueue(bool current_sleep){
     auto& level_queue = running_[current_level_];
-    Task* current_task = level_queue.front();
-    level_queue.pop_front();
+    Task* current_task = level_queue.Front();
+    level_queue.PopFront();
     if (!current_sleep){
-        level_queue.push_back(current_task);
+        level_queue.PushBack(current_task);
     }
-    if (level_queue.empty()){
+    if (level_queue.Empty()){
         level_changed_ = true;
     }
 
     if (level_changed_){
         level_changed_ = false;
         for (int lv = kMaxLevel; lv >=0; --lv){
-            if (!running_[lv].empty()){
+            if (!running_[lv].Empty()){
                 current_level_ = lv;
                 break;
             }
@@ -285,17 +616,41 @@ Task* TaskManager::RotateCurrentRunQueue(bool current_sleep){
     return current_task;
 }
 
+void TaskManager::ChargeCurrentTask(){
+    const uint64_t now = ReadTSC();
+    const uint64_t elapsed = now - last_charge_tsc_;
+    last_charge_tsc_ = now;
+
+    Task& task = CurrentTask();
+    task.stat_.cycles += elapsed;
+    if (task.in_syscall_){
+        task.stat_.syscall_cycles += elapsed;
+    }
+    if (task.Level() == kFairLevel){
+        task.vruntime_ += elapsed * Task::kDefaultWeight / task.weight_;
+    }
+}
+
 TaskManager* task_manager;
 
 void InitializeTask(){
     task_manager = new TaskManager;
-    
-    __asm__("cli");
-    timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1});
-    __asm__("sti");
+    timer_manager->StartTaskTimer();
+}
+
+__attribute__((no_caller_saved_registers))
+extern "C" uint8_t* GetCurrentTaskFPUArea(){
+    return task_manager->CurrentTask().FPUArea();
 }
 
 __attribute__((no_caller_saved_registers))
-extern "C" uint64_t GetCurrentTaskOSStackPointer(){
-    return task_manager->CurrentTask().OSStackPointer();
-}
\ No newline at end of file
+extern "C" void BeginSyscallAccounting(uint64_t syscall_index){
+    Trace(TraceType::kSyscallBegin, syscall_index);
+    task_manager->BeginSyscall();
+}
+
+__attribute__((no_caller_saved_registers))
+extern "C" void EndSyscallAccounting(){
+    task_manager->EndSyscall();
+    Trace(TraceType::kSyscallEnd);
+}
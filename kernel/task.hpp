@@ -3,6 +3,7 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <deque>
@@ -12,40 +13,98 @@
 
 #include "error.hpp"
 #include "message.hpp"
+#include "mpsc_ring.hpp"
 #include "paging.hpp"
+#include "per_cpu.hpp"
+#include "poll.hpp"
 #include "fat.hpp"
+#include "spinlock.hpp"
+#include "task_stat.hpp"
+#include "timer.hpp"
 
 struct TaskContext{
     uint64_t cr3, rip, rflags, reserved1;
     uint64_t cs, ss, fs, gs;
     uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp;
     uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
-    std::array<uint8_t, 512> fxsave_area;
 } __attribute__((packed));
 
 using TaskFunc = void(uint64_t, int64_t);
 
 class TaskManager;
 
+struct MailboxStat{
+    size_t queued;
+    uint64_t overflows; // 満杯のメッセージボックスへ送信しようとした回数
+    uint64_t drops; // 満杯のため破棄されたメッセージ数
+};
+
 struct FileMapping{
     int fd;
     uint64_t vaddr_begin, vaddr_end;
 };
 
+// 共有メモリをマップした範囲。ページは作成時に全てマップ済み
+struct SharedMapping{
+    uint64_t vaddr_begin, vaddr_end;
+};
+
+// SyscallIoRingSetupで作ったリング。アプリが書き換えられない値をカーネル側に控えておく
+struct IoRingMapping{
+    uint64_t vaddr; // 0ならリングはない
+    uint32_t entries;
+};
+
+// SyscallReadEventがアプリへ渡すマウス移動を間引くための状態
+struct MouseMoveThrottle{
+    unsigned long tick{0}; // 最後にマウス移動を渡したときのタイマー刻み
+    std::optional<Message> pending{}; // まだ渡していない、まとめたマウス移動
+    bool timer_armed{false}; // フレームの終わりに届くタイマーを設定済み
+};
+
+// srcをdstにまとめられればまとめてtrueを返す（マウス移動はボタン状態が同じときだけ）
+bool MergeMessage(Message& dst, const Message& src);
+
 class Task{
     public:
         static const int kDefaultLevel = 1;
         static const size_t kDefaultStackBytes = 8*4096;
+        static const size_t kMailboxCapacity = 256;
+        static const unsigned int kDefaultWeight = 1024;
 
         Task(uint64_t id);
-        Task& InitContext(TaskFunc* f, int64_t data);
+        ~Task();
+        // スタックを確保できなければエラーを返す。そのタスクは起床させずにTaskManager::DiscardTaskで破棄すること
+        WithError<Task&> InitContext(TaskFunc* f, int64_t data);
         TaskContext& Context();
+        uint8_t* FPUArea() {return fpu_area_;}
         uint64_t& OSStackPointer();
         uint64_t ID() const;
         Task& Sleep();
         Task& Wakeup();
-        void SendMessage(const Message& msg);
+        // メッセージを送信する。割り込みハンドラからも割り込みを禁止せずに呼び出せる
+        // 満杯ならメッセージを破棄してkFullを返す
+        Error SendMessage(const Message& msg);
+        // SendMessageと同様だが、満杯の場合は破棄数に数えずにfalseを返す。再送できる送信者向け
+        bool TrySendMessage(const Message& msg);
+        // 空であれば受信待ちを表明してstd::nulloptを返す。
+        // 待つ場合は、割り込みを禁止したまま受信とSleepを行うこと（WaitMessageを参照）
         std::optional<Message> ReceiveMessage();
+        // メッセージが届くまでスリープして待つ。実行中のタスク自身から呼ぶこと
+        Message WaitMessage();
+        // 受信したmsgに続けて届いている、ボタン状態が同じマウス移動のメッセージを取り出してmsgへまとめる
+        // 移動量は合算し、位置は最新のものにする。受信者自身から呼ぶこと
+        void CoalesceMessages(Message& msg);
+        // 受信していないメッセージにpredを満たすものがあればtrue。受信者自身から呼ぶこと
+        template <class Pred>
+        bool AnyMessage(Pred pred) const {return msgs_.Any(pred);}
+        MailboxStat Mailbox() const;
+        // メッセージが届くたびに通知する
+        PollNotifier& MailboxNotifier() {return mailbox_notifier_;}
+        // アプリが使う待ち合わせの集合。最初に呼ばれたときに作る
+        PollSet& Poll();
+        // 待ち合わせの集合を破棄する。アプリの終了時に呼ぶ
+        void ClosePoll();
         std::vector<std::shared_ptr<::FileDescriptor>>& Files();
         uint64_t DPagingBegin() const;
         void SetDPagingBegin(uint64_t v);
@@ -54,35 +113,93 @@ class Task{
         uint64_t FileMapEnd() const;
         void SetFileMapEnd(uint64_t v);
         std::vector<FileMapping>& FileMaps();
+        std::vector<SharedMapping>& SharedMaps();
+        IoRingMapping& IoRing() {return io_ring_;}
+        MouseMoveThrottle& MouseMove() {return mouse_move_;}
 
         int Level() const {return level_;}
         bool Running() const {return running_;}
+        // id, level, runningを埋めたCPU使用状況を返す
+        TaskStat Stat() const;
+        void AddPageFaultCycles(uint64_t cycles) {stat_.page_fault_cycles += cycles;}
+        // 公平スケジューリングでの重み。重みに比例してCPU時間が配分される
+        unsigned int Weight() const {return weight_;}
+        Task& SetWeight(unsigned int weight) {weight_ = weight > 0 ? weight : 1; return *this;}
+        uint64_t VRuntime() const {return vruntime_;}
 
     private:
         uint64_t id_;
-        std::vector<uint64_t> stack_;
+        uint64_t stack_bottom_{0}; // StackPoolから確保したスタック。メインタスクは0
         alignas(16) TaskContext context_;
+        std::vector<uint8_t> fpu_area_buf_{};
+        uint8_t* fpu_area_; // FXSAVE/XSAVEの退避領域（64バイト境界）
         uint64_t os_stack_ptr_;
-        std::deque<Message> msgs_;
+        MPSCRing<Message, kMailboxCapacity> msgs_{};
+        std::atomic<bool> receiver_waiting_{false};
+        std::vector<Task*> blocked_senders_{}; // 満杯のため送信を待っているタスク。割り込み禁止で操作する
+        std::atomic<uint64_t> msg_overflows_{0}, msg_drops_{0};
+        PollNotifier mailbox_notifier_{};
+        std::unique_ptr<PollSet> poll_set_{}; // mailbox_notifier_より先に破棄する
         unsigned int level_{kDefaultLevel};
         bool running_{false};
         std::vector<std::shared_ptr<FileDescriptor>> files_{};
         uint64_t dpaging_begin_{0}, dpaging_end_{0};
         uint64_t file_map_end_{0};
         std::vector<FileMapping> file_maps_{};
+        std::vector<SharedMapping> shared_maps_{};
+        IoRingMapping io_ring_{0, 0};
+        MouseMoveThrottle mouse_move_{};
+        TaskStat stat_{};
+        bool in_syscall_{false};
+        uint64_t vruntime_{0}; // 重みで補正した実行時間（TSCサイクル）
+        unsigned int weight_{kDefaultWeight};
 
+        // 受信で空きができたので、送信を待っているタスクを起こす
+        void WakeBlockedSenders();
         Task& SetLevel(int level) {level_ = level; return *this;}
         Task& SetRunning(bool running) {running_ = running; return *this;}
 
         friend TaskManager;
+        friend class RunQueue;
+};
+
+// 1つの優先度レベルの実行可能なタスクの列。Front()が実行中（または次に実行する）タスク
+// 通常はラウンドロビン。公平モードではvruntimeが最小のタスクを選ぶ
+class RunQueue{
+    public:
+        // 公平モードにする。空のときに呼ぶこと
+        void EnableFair() {fair_ = true;}
+        bool Fair() const {return fair_;}
+        bool Empty() const;
+        // 公平モードでは、選ばれたタスクはPopFrontされるまで先頭に留まる。空ならnullptr
+        Task* Front();
+        void PopFront();
+        void PushFront(Task* task);
+        // 公平モードではvruntimeの順に挿入する。スリープしていたタスクは最小値の少し手前に置く
+        void PushBack(Task* task);
+        void Erase(Task* task);
+
+    private:
+        bool fair_{false};
+        std::deque<Task*> tasks_{};
+
+        Task* current_{nullptr};
+        std::multimap<uint64_t, Task*> tree_{}; // キー: vruntime
+        uint64_t min_vruntime_{0};
 };
 
 class TaskManager{
     public:
         static const int kMaxLevel = 3;// level: 0 = lowest, kMaxLevel = highest
+        // このレベルのタスクはvruntimeによる公平スケジューリングを行う（-1で無効）
+        static const int kFairLevel = Task::kDefaultLevel;
+        // SleepUntilに渡すと期限なしで待つ
+        static const unsigned long kNoDeadline = ~0ul;
 
         TaskManager();
         Task& NewTask();
+        // 一度も実行していないタスクを破棄する（InitContextに失敗したときなど）
+        void DiscardTask(Task& task);
         void SwitchTask(const TaskContext& current_ctx);
 
         void Sleep(Task* task);
@@ -90,23 +207,78 @@ class TaskManager{
         void Wakeup(Task* task, int level = -1);
         Error Wakeup(uint64_t id, int level = -1);
         Error SendMessage(uint64_t id, const Message& msg);
-        Task& CurrentTask();
+        // 満杯ならkFullを返すが、破棄数には数えない。送れなかったメッセージは呼び出し側が後で送り直すこと
+        Error TrySendMessage(uint64_t id, const Message& msg);
+        // 満杯なら受信者が取り出すまで眠って送り直す。取りこぼすと相手が待ち続けるメッセージ用
+        // 実行中のタスクから呼ぶこと。相手がこのタスクへの送信で待つことがあるなら（メインタスクなど）使わない
+        Error SendMessageWait(uint64_t id, const Message& msg);
+        // タスクの公平スケジューリングでの重みを変える（kFairLevelのタスクにだけ効く）
+        Error SetWeight(uint64_t id, unsigned int weight);
+        // 実行中のタスク。割り込みを禁止せずに呼び出せる
+        Task& CurrentTask() {return *ThisCPUTask();}
+        // 実行中のタスクを終了する。呼び出し元には戻らない
         void Finish(int exit_code);
         WithError<int> WaitFinish(uint64_t task_id);
+        // 実行中のタスクを、done()がtrueを返すかタイマー刻みがdeadlineに達するまで眠らせる
+        // メッセージの受信などでも起こされるので、done()は眠る前と起こされるたびに割り込み禁止で確かめる
+        // 起こすタイマーを設定できなければ、眠らずにエラーを返す
+        template <class Pred>
+        Error SleepUntil(unsigned long deadline, Pred done);
+        Error SleepUntil(unsigned long deadline) {return SleepUntil(deadline, []{return false;});}
+
+        // 実行中のタスクのシステムコール処理時間の計測を開始・終了する（割り込み禁止で呼ぶこと）
+        void BeginSyscall();
+        void EndSyscall();
+        // 全タスクのCPU使用状況を取得する。実行中のタスクにはこの時点までの時間を加算する
+        std::vector<TaskStat> Stats();
 
     private:
         std::vector<std::unique_ptr<Task>> tasks_{};
         uint64_t latest_id_{0};
-        std::array<std::deque<Task*>, kMaxLevel+1> running_{};
+        std::array<RunQueue, kMaxLevel+1> running_{};
         int current_level_{kMaxLevel};
         bool level_changed_{false};
         std::map<uint64_t, int> finish_tasks_{};
         std::map<uint64_t, Task*> finish_waiter_{};
+        uint64_t last_charge_tsc_{0};
 
         void ChangeLevelRunning(Task* task, int level);
+        // 実行キューの先頭のタスクを、CPUの実行中のタスクとして記録する
+        Task& UpdateCurrentTask();
         Task* RotateCurrentRunQueue(bool current_sleep);
+        // 前回の加算からの経過時間を実行中のタスクに加算する
+        void ChargeCurrentTask();
 };
 
+template <class Pred>
+Error TaskManager::SleepUntil(unsigned long deadline, Pred done){
+    Task* task = &CurrentTask();
+    TimerHandle timer = kNullTimerHandle;
+    if (deadline != kNoDeadline){
+        auto [handle, err] = timer_manager->AddTimer(Timer{deadline, Timer::kWakeupValue, task->ID()});
+        if (err){
+            return err;
+        }
+        timer = handle;
+    }
+
+    {
+        // 確かめてから眠るまでの間に起こされると取りこぼすため、割り込みを禁止しておく
+        InterruptGuard guard;
+        while (!done()){
+            if (timer != kNullTimerHandle && timer_manager->CurrentTick() >= deadline){
+                break;
+            }
+            Sleep(task);
+        }
+    }
+
+    if (timer != kNullTimerHandle){
+        timer_manager->CancelTimer(timer);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
 extern TaskManager* task_manager;
 
 void InitializeTask();
\ No newline at end of file
@@ -0,0 +1,21 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // タスクごとのCPU使用状況。時間はいずれもTSCのサイクル数
+    struct TaskStat{
+        uint64_t id;
+        int level;
+        int running;
+        uint64_t cycles; // CPUを割り当てられていた時間
+        uint64_t syscall_cycles; // cyclesのうちシステムコールを処理していた時間
+        uint64_t page_fault_cycles; // ページフォルトの処理にかかった時間
+        uint64_t voluntary_switches; // スリープによって切り替わった回数
+        uint64_t involuntary_switches; // タイマー割り込みによって切り替えられた回数
+    };
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,7 @@
 #include "terminal.hpp"
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <limits>
 
@@ -10,8 +12,11 @@
 #include "asmfunc.h"
 #include "elf.hpp"
 #include "memory_manager.hpp"
+#include "block.hpp"
 #include "paging.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
+#include "worker_pool.hpp"
 #include "keyboard.hpp"
 #include "logger.hpp"
 
@@ -92,7 +97,8 @@ namespace{
             last_addr = std::max(last_addr, phdr[i].p_vaddr + phdr[i].p_memsz);
             const auto num_4kpages = (phdr[i].p_memsz + 4095) / 4096;
 
-            if (auto err = SetupPageMaps(dest_addr, num_4kpages, false)){
+            // CR0.WPが有効なので、書き込めるようにマップして読み込む。アプリにはCopyPageMapsで書き込み禁止にして渡す
+            if (auto err = SetupPageMaps(dest_addr, num_4kpages)){
                 return {last_addr, err};
             }
 
@@ -132,35 +138,68 @@ namespace{
         return pml4;
     }
 
+    void ReapPML4(uint64_t cr3){
+        auto pml4 = reinterpret_cast<PageMapEntry*>(cr3);
+        if (auto err = CleanPageMaps(pml4, LinearAddress4Level{0xffff'8000'0000'0000})){
+            Log(kError, "failed to clean page maps: %s\n", err.Name());
+        }
+        if (auto err = FreePageMap(pml4)){
+            Log(kError, "failed to free PML4: %s\n", err.Name());
+        }
+    }
+
+    // アプリ用のページテーブルから離れ、その解放はワーカーに任せる
     Error FreePML4(Task& current_task){
         const auto cr3 = current_task.Context().cr3;
         current_task.Context().cr3 = 0;
         ResetCR3();
 
-        return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3));
+        if (auto err = worker_pool->Queue(ReapPML4, cr3)){
+            ReapPML4(cr3);
+        }
+        return MAKE_ERROR(Error::kSuccess);
     }
 
     void ListAllEntries(FileDescriptor& fd, uint32_t dir_cluster){
-        const auto kEntriesPerCluster = fat::bytes_per_cluster / sizeof(fat::DirectoryEntry);
-
-        while (dir_cluster != fat::kEndOfClusterchain){
-            auto dir = fat::GetSectorByCluster<fat::DirectoryEntry>(dir_cluster);
-
-            for (int i=0; i<kEntriesPerCluster; ++i){
-                if (dir[i].name[0] == 0x00){
-                    return;
-                } else if (static_cast<uint8_t>(dir[i].name[0]) == 0xe5){
-                    continue;
-                } else if (dir[i].attr == fat::Attribute::kLongName){
-                    continue;
-                }
+        for (const auto& [name, entry] : fat::ListDirectory(dir_cluster)){
+            PrintToFD(fd, "%s\n", name.c_str());
+        }
+    }
 
-                char name[13];
-                fat::FormatName(dir[i], name);
-                PrintToFD(fd, "%s\n", name);
+    // 前回の取得からの増分でCPU使用率を表示する。初回は起動時からの値になる
+    void PrintTaskStats(FileDescriptor& fd, const std::vector<TaskStat>& prev, const std::vector<TaskStat>& cur){
+        struct Row{
+            const TaskStat* stat;
+            uint64_t cycles, syscall_cycles, page_fault_cycles;
+        };
+
+        std::vector<Row> rows;
+        uint64_t total = 0;
+        for (const auto& s : cur){
+            Row row{&s, s.cycles, s.syscall_cycles, s.page_fault_cycles};
+            auto it = std::find_if(prev.begin(), prev.end(), [&s](const auto& p){return p.id == s.id;});
+            if (it != prev.end()){
+                row.cycles -= it->cycles;
+                row.syscall_cycles -= it->syscall_cycles;
+                row.page_fault_cycles -= it->page_fault_cycles;
             }
+            total += row.cycles;
+            rows.push_back(row);
+        }
+        if (total == 0){
+            total = 1;
+        }
+        std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b){return a.cycles > b.cycles;});
 
-            dir_cluster = fat::NextCluster(dir_cluster);
+        PrintToFD(fd, "  ID LV S  CPU%%  SYS%%  PFkcyc  Mcycles   VOL  INVOL\n");
+        for (const auto& row : rows){
+            const uint64_t cpu = row.cycles * 1000 / total;
+            const uint64_t sys = row.syscall_cycles * 1000 / total;
+            PrintToFD(fd, "%4lu %2d %c %3lu.%lu %3lu.%lu %7lu %8lu %5lu %6lu\n",
+                      row.stat->id, row.stat->level, row.stat->running ? 'R' : 'S',
+                      cpu / 10, cpu % 10, sys / 10, sys % 10,
+                      row.page_fault_cycles / 1000, row.stat->cycles / 1000000,
+                      row.stat->voluntary_switches, row.stat->involuntary_switches);
         }
     }
 
@@ -349,21 +388,50 @@ void Terminal::ExecuteLine(){
     }
 
     std::shared_ptr<PipeDescriptor> pipe_fd;
-    uint64_t subtask_id = 0;
+    std::vector<uint64_t> subtask_ids;
+    bool pipeline_broken = false;
 
     if (pipe_char){
+        // 2段目以降は段ごとに別のタスクで同時に実行し、隣り合う段をパイプでつなぐ
         *pipe_char = 0;
+        pipe_fd = std::make_shared<PipeDescriptor>(pipe_bytes_, pipe_lowat_, pipe_hiwat_);
+        auto input = pipe_fd;
         char* subcommand = &pipe_char[1];
-        while (isspace(*subcommand)){
-            ++subcommand;
-        }
+        while (true){
+            char* next_pipe = strchr(subcommand, '|');
+            if (next_pipe){
+                *next_pipe = 0;
+            }
+            while (isspace(*subcommand)){
+                ++subcommand;
+            }
 
-        auto& subtask = task_manager->NewTask();
-        pipe_fd = std::make_shared<PipeDescriptor>(subtask);
-        auto term_desc = new TerminalDescriptor{subcommand, ture, false, {pipe_fd, files_[1], files_[2]}};
-        files_[1] = pipe_fd;
+            std::shared_ptr<PipeDescriptor> output;
+            std::shared_ptr<FileDescriptor> output_fd = files_[1];
+            if (next_pipe){
+                output = std::make_shared<PipeDescriptor>(pipe_bytes_, pipe_lowat_, pipe_hiwat_);
+                output_fd = output;
+            }
+            auto term_desc = new TerminalDescriptor{subcommand, true, false, {input, output_fd, files_[2]}, input, output};
+            auto [subtask, err] = task_manager->NewTask().InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc));
+            if (err){
+                PrintToFD(*files_[2], "failed to start pipeline: %s\n", err.Name());
+                task_manager->DiscardTask(subtask);
+                delete term_desc;
+                // 読み手のいない前の段が満杯のパイプで眠ったままにならないようにする
+                input->FinishRead();
+                pipeline_broken = true;
+                break;
+            }
+            subtask_ids.push_back(subtask.Wakeup().ID());
 
-        subtask_id = subtask.InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc)).Wakeup().ID();
+            if (!next_pipe){
+                break;
+            }
+            input = output;
+            subcommand = &next_pipe[1];
+        }
+        files_[1] = pipe_fd;
     }
 
     if (strcmp(command, "echo") == 0 ){
@@ -439,12 +507,96 @@ void Terminal::ExecuteLine(){
         }
     } else if (strcmp(command, "noterm") == 0) {
         auto term_desc = new TerminalDescriptor{first_arg, true, false, files_};
-        task_manager->NewTask().InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc)).Wakeup();
+        auto [task, err] = task_manager->NewTask().InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc));
+        if (err){
+            PrintToFD(*files_[2], "failed to start task: %s\n", err.Name());
+            task_manager->DiscardTask(task);
+            delete term_desc;
+            exit_code = 1;
+        } else {
+            task.Wakeup();
+        }
     } else if (strcmp(command, "memstat") == 0){
         const auto p_stat = memory_manager->Stat();
 
         PrintToFD(*files_[1], "Phys used: %lu frames (%llu MiB)\n", p_stat.allocated_frames, p_stat.allocated_frames*kBytesPerFrame/1024/1024);
         PrintToFD(*files_[1], "Phys total: %lu frames (%llu MiB)\n", p_stat.total_frames, p_stat.total_frames*kBytesPerFrame/1024/1024);
+        PrintToFD(*files_[1], "FAT free: %lu clusters\n", fat::CountFreeClusters());
+        if (block_cache){
+            const auto b_stat = block_cache->Stat();
+            PrintToFD(*files_[1], "Block cache: %lu pages, %lu reads, %lu writebacks\n",
+                      b_stat.resident_pages, b_stat.reads, b_stat.writebacks);
+        }
+    } else if (strcmp(command, "sync") == 0){
+        if (block_cache){
+            if (auto err = block_cache->Sync()){
+                PrintToFD(*files_[2], "sync: %s\n", err.Name());
+                exit_code = 1;
+            }
+        }
+    } else if (strcmp(command, "top") == 0){
+        auto stats = task_manager->Stats();
+        PrintTaskStats(*files_[1], top_prev_stats_, stats);
+        top_prev_stats_ = std::move(stats);
+    } else if (strcmp(command, "nice") == 0){
+        // nice <タスクID> <重み>。既定の重みはTask::kDefaultWeight
+        char* p = first_arg;
+        const uint64_t task_id = p ? strtoul(p, &p, 0) : 0;
+        const unsigned long weight = p ? strtoul(p, &p, 0) : 0;
+        if (task_id == 0 || weight == 0){
+            PrintToFD(*files_[2], "usage: nice <task id> <weight (default %u)>\n", Task::kDefaultWeight);
+            exit_code = 1;
+        } else if (auto err = task_manager->SetWeight(task_id, weight)){
+            PrintToFD(*files_[2], "nice: %s\n", err.Name());
+            exit_code = 1;
+        }
+    } else if (strcmp(command, "trace") == 0){
+        // リダイレクトすると引数の後ろに空白が残るため、末尾の空白を落としてから全体を比較する
+        if (first_arg){
+            for (size_t len = strlen(first_arg); len > 0 && isspace(first_arg[len - 1]); --len){
+                first_arg[len - 1] = 0;
+            }
+        }
+        const char* op = first_arg ? first_arg : "";
+        if (strcmp(op, "on") == 0){
+            trace_enabled.store(true);
+        } else if (strcmp(op, "off") == 0){
+            trace_enabled.store(false);
+        } else if (strcmp(op, "clear") == 0){
+            trace_buffer->Clear();
+        } else if (strcmp(op, "json") == 0){
+            DumpTraceJSON(*files_[1]);
+        } else if (strcmp(op, "bin") == 0){
+            DumpTraceBinary(*files_[1]);
+        } else if (op[0] == 0){
+            PrintToFD(*files_[1], "trace: %s, %lu records\n",
+                      trace_enabled.load() ? "on" : "off", trace_buffer->Count());
+        } else {
+            PrintToFD(*files_[2], "usage: trace [on|off|clear|json|bin]\n");
+            exit_code = 1;
+        }
+    } else if (strcmp(command, "pipe") == 0){
+        const char* op = first_arg ? first_arg : "";
+        if (strncmp(op, "size ", 5) == 0){
+            pipe_bytes_ = strtoul(&op[5], nullptr, 0);
+        } else if (strncmp(op, "lowat ", 6) == 0){
+            pipe_lowat_ = strtoul(&op[6], nullptr, 0);
+        } else if (strncmp(op, "hiwat ", 6) == 0){
+            pipe_hiwat_ = strtoul(&op[6], nullptr, 0);
+        } else if (op[0] == 0 || isspace(op[0])){
+            PrintToFD(*files_[1], "new pipe: size %lu, lowat %lu, hiwat %lu\n", pipe_bytes_, pipe_lowat_, pipe_hiwat_);
+            if (last_pipe_stat_){
+                const auto& s = *last_pipe_stat_;
+                PrintToFD(*files_[1], "last pipe: size %lu, lowat %lu, hiwat %lu, max fill %lu\n",
+                          s.capacity, s.low_watermark, s.high_watermark, s.max_fill);
+                PrintToFD(*files_[1], "  written %lu, read %lu, writer stalls %lu, reader stalls %lu\n",
+                          s.bytes_written, s.bytes_read, s.writer_stalls, s.reader_stalls);
+                PrintToFD(*files_[1], "  spliced pages %lu\n", s.spliced_pages);
+            }
+        } else {
+            PrintToFD(*files_[2], "usage: pipe [size <bytes>|lowat <bytes>|hiwat <bytes>]\n");
+            exit_code = 1;
+        }
     }
     else if (command[0] != 0){
         auto [file_entry, post_slash] = fat::FindFile(command);
@@ -469,13 +621,20 @@ void Terminal::ExecuteLine(){
 
     if (pipe_fd){
         pipe_fd ->FinishWrite();
-        __asm__("cli");
-        auto [ec, err] = task_manager->WaitFinish(subtask_id);
-        __asm__("sti");
-        if (err){
-            Log(kWarn, "failed to wait finish: %s\n", err.Name());
+        // 全ての段の終了を待つ。パイプラインの終了コードは最後の段のもの
+        for (const uint64_t subtask_id : subtask_ids){
+            auto [ec, err] = task_manager->WaitFinish(subtask_id);
+            if (err){
+                Log(kWarn, "failed to wait finish: %s\n", err.Name());
+                exit_code = -1;
+            } else {
+                exit_code = ec;
+            }
+        }
+        if (pipeline_broken){
+            exit_code = 1;
         }
-        exit_code = ec;
+        last_pipe_stat_ = pipe_fd->Stat();
     }
 
     last_exit_code_ = exit_code;
@@ -483,9 +642,7 @@ void Terminal::ExecuteLine(){
 }
 
 WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* command, char* first_arg){
-    __asm__("cli");
     auto& task = task_manager->CurrentTask();
-    __asm__("sti");
 
     auto [ app_load, err] = LoadApp(file_entry, task);
     if (err){
@@ -523,13 +680,12 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
 
     int ret = CallApp(argc.value, argv, 3<<3|3, app_load.entry, stack_frame_addr.value+stack_size-8, &task.OSStackPointer());
 
+    task.ClosePoll();
     task.Files().clear();
     task.FileMaps().clear();
-
-
-    if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})){
-        return {0, err};
-    }
+    task.SharedMaps().clear();
+    task.IoRing() = {0, 0};
+    task.MouseMove() = {};
 
     return {ret, FreePML4(task)};
 }
@@ -587,9 +743,7 @@ void Terminal::Print(const char* s, std::optional<size_t> len){
     Rectangle<int> draw_area{draw_pos, draw_size};
 
     Message msg = MakeLayerMessage(task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area);
-    __asm__("cli");
-    task_manager->SendMessage(1, msg);
-    __asm__("sti");
+    task_manager->SendMessageWait(1, msg);
 }
 
 Rectangle<int> Terminal::HistoryUpDown(int direction){
@@ -625,15 +779,17 @@ void TaskTerminal(uint64_t task_id, int64_t data){
         show_window = term_desc->show_window;
     }
 
-    __asm__("cli");
     Task& task = task_manager->CurrentTask();
-    Terminal* terminal = new Terminal{task, term_desc};
-    if (show_window){
-        layer_manager->Move(terminal->LayerID(), {100, 200});
-        layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
-        active_layer->Activate(terminal->LayerID());
+    Terminal* terminal;
+    {
+        MutexGuard lock{layer_mutex};
+        terminal = new Terminal{task, term_desc};
+        if (show_window){
+            layer_manager->Move(terminal->LayerID(), {100, 200});
+            layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
+            active_layer->Activate(terminal->LayerID());
+        }
     }
-    __asm__("sti");
 
     if (term_desc && !term_desc->command_line.empty()){
         for (int i=0; i<term_desc->command_line.length(); ++i){
@@ -643,53 +799,51 @@ void TaskTerminal(uint64_t task_id, int64_t data){
     }
 
     if (term_desc && term_desc->exit_after_command){
+        // 書き手が満杯のパイプで眠ったままにならないよう、もう読まないことを知らせる
+        if (term_desc->input_pipe){
+            term_desc->input_pipe->FinishRead();
+        }
+        if (term_desc->output_pipe){
+            term_desc->output_pipe->FinishWrite();
+        }
         delete term_desc;
-        __asm__("cli");
         task_manager->Finish(terminal->LastExitCode());
-        __asm__("sti");
     }
 
+    const int kBlinkTimerValue = 1;
     auto add_blink_timer = [task_id](unsigned long t){
-        timer_manager->AddTimer(Timer{t+static_cast<int>(kTimerFreq*0.5), 1, task_id});
+        timer_manager->AddTimer(Timer{t+static_cast<int>(kTimerFreq*0.5), kBlinkTimerValue, task_id});
     };
     add_blink_timer(timer_manager->CurrentTick());
 
     bool window_isactive = false;
 
     while (true){
-        __asm__("cli");
-        auto msg = task.ReceiveMessage();
-        if (!msg){
-            task.Sleep();
-            __asm__("sti");
-            continue;
-        }
-        __asm__("sti");
-
-        switch (msg->type){
+        const auto msg = task.WaitMessage();
+        switch (msg.type){
             case Message::kTimerTimeout:
-                add_blink_timer(msg->arg.timer.timeout);
+                // 終了したアプリのタイマーが届いても点滅タイマーを重複して登録しない
+                if (msg.arg.timer.value != kBlinkTimerValue){
+                    break;
+                }
+                add_blink_timer(msg.arg.timer.timeout);
                 if (window_isactive && show_window){
                     const auto area = terminal->BlinkCursor();
                     Message msg = MakeLayerMessage(task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-                    __asm__("cli");
-                    task_manager->SendMessage(1, msg);
-                    __asm__("sti");
+                    task_manager->SendMessageWait(1, msg);
                 }
                 break;
             case Message::kKeyPush:
-                if (msg->arg.keyboard.press) {
-                    const auto area = terminal->InputKey(msg->arg.keyboard.modifier, msg->arg.keyboard.keycode, msg->arg.keyboard.ascii);
+                if (msg.arg.keyboard.press) {
+                    const auto area = terminal->InputKey(msg.arg.keyboard.modifier, msg.arg.keyboard.keycode, msg.arg.keyboard.ascii);
                     if (show_window) {
                         Message msg = MakeLayerMessage(task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-                        __asm__("cli");
-                        task_manager->SendMessage(1, msg);
-                        __asm__("sti");
+                        task_manager->SendMessageWait(1, msg);
                     }
                 }
                 break;
             case Message::kWindowActive:
-                window_isactive = msg->arg.window_active.activate;
+                window_isactive = msg.arg.window_active.activate;
                 break;
             default:
                 break;
@@ -704,28 +858,21 @@ size_t TerminalFileDescriptor::Read(void* buf, size_t len){
     char* bufc = reinterpret_cast<char*>(buf);
 
     while (true){
-        __asm__("cli");
-        auto msg = term_.UnderlyingTask().ReceiveMessage();
-        if (!msg) {
-            term_.UnderlyingTask().Sleep();
+        const auto msg = term_.UnderlyingTask().WaitMessage();
+        if (msg.type != Message::kKeyPush || !msg.arg.keyboard.press){
             continue;
         }
-        __asm__("sti");
-
-        if (msg->type != Message::kKeyPush || !msg->arg.keyboard.press){
-            continue;
-        }
-        if (msg->arg.keyboard.modifier & (kLControlBitMask|kRControlBitMask)){
+        if (msg.arg.keyboard.modifier & (kLControlBitMask|kRControlBitMask)){
             char s[3] = "^ ";
-            s[1] = toupper(msg->arg.keyboard.ascii);
+            s[1] = toupper(msg.arg.keyboard.ascii);
             term_.Print(s);
-            if (msg->arg.keyboard.keycode == 7){
+            if (msg.arg.keyboard.keycode == 7){
                 return 0; //EOT
             }
             continue;
         }
 
-        bufc[0] = msg->arg.keyboard.ascii;
+        bufc[0] = msg.arg.keyboard.ascii;
         term_.Print(bufc, 1);
         return 1;
     }
@@ -740,67 +887,18 @@ size_t TerminalFileDescriptor::Load(void* buf, size_t len, size_t offset){
     return 0;
 }
 
-PipeDescriptor::PipeDescriptor(Task& task): task_{task}{
-}
-
-size_t PipeDescriptor::Read(void* buf, size_t len){
-    if (len_ > 0){
-        const size_t copy_bytes = std::min(len_, len);
-        memcpy(buf, data_, copy_bytes);
-        len_ -= copy_bytes;
-        memmove(data_, &data_[copy_bytes], len_);
-        return copy_bytes;
-    }
-
-    if (closed_){
-        return 0;
-    }
-
-    while (true){
-        __asm__("cli");
-        auto msg = task_.ReceiveMessage();
-        if (!msg){
-            task_.Sleep();
-            continue;
+uint32_t TerminalFileDescriptor::PollEvents(){
+    // Readが読み捨てるメッセージ（キーを離した、Ctrl+D以外のCtrlとの組み合わせ、キー以外）では読めるようにならない
+    const bool readable = term_.UnderlyingTask().AnyMessage([](const Message& msg){
+        if (msg.type != Message::kKeyPush || !msg.arg.keyboard.press){
+            return false;
         }
-        __asm__("sti");
-
-        if (msg->type != Message::kPipe){
-            continue;
-        }
-
-        if (msg->arg.pipe.len == 0){
-            closed_ = true;
-            return 0;
-        }
-
-        const size_t copy_bytes = std::min<size_t>(msg->arg.pipe.len, len);
-        memcpy(buf, msg->arg.pipe.data, copy_bytes);
-        len_ = msg->arg.pipe.len - copy_bytes;
-        memcpy(data_, &msg->arg.pipe.data[copy_bytes], len_);
-        return copy_bytes;
-    }
+        const bool ctrl = msg.arg.keyboard.modifier & (kLControlBitMask|kRControlBitMask);
+        return !ctrl || msg.arg.keyboard.keycode == 7; // Ctrl+DはEOFとして読める
+    });
+    return readable ? POLL_EV_IN : 0;
 }
 
-size_t PipeDescriptor::Write(const void* buf, size_t len){
-    auto bufc = reinterpret_cast<const char*>(buf);
-    Message msg{Message::kPipe};
-    size_t sent_bytes = 0;
-    while (sent_bytes < len){
-        msg.arg.pipe.len = std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
-        memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
-        sent_bytes += msg.arg.pipe.len;
-        __asm__("cli");
-        task_.SendMessage(msg);
-        __asm__("sti");
-    }
-    return len;
+PollNotifier* TerminalFileDescriptor::Notifier(){
+    return &term_.UnderlyingTask().MailboxNotifier();
 }
-
-void PipeDescriptor::FinishWrite(){
-    Message msg{Message::kPipe};
-    msg.arg.pipe.len = 0;
-    __asm__("cli");
-    task_.SendMessage(msg);
-    __asm__("sti");
-}
\ No newline at end of file
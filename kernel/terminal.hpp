@@ -10,6 +10,7 @@
 #include "task.hpp"
 #include "layer.hpp"
 #include "fat.hpp"
+#include "pipe.hpp"
 
 struct AppLoadInfo{
     uint64_t vaddr_end, entry;
@@ -23,6 +24,8 @@ struct TerminalDescriptor {
     bool exit_after_command;
     bool show_window;
     std::array<std::shared_ptr<FileDescriptor>, 3> files;
+    std::shared_ptr<PipeDescriptor> input_pipe{}; // コマンドの終了後に読み出しの終わりを知らせるパイプ
+    std::shared_ptr<PipeDescriptor> output_pipe{}; // コマンドの終了後に書き込みの終わりを知らせるパイプ
 }
 
 class Terminal{
@@ -64,6 +67,9 @@ class Terminal{
         bool show_window_;
         std::array<std::shared_ptr<FileDescriptor>, 3> files_;
         int last_exit_code_{0};
+        std::vector<TaskStat> top_prev_stats_{}; // 前回のtopコマンドで取得した値
+        size_t pipe_bytes_{PipeDescriptor::kDefaultBytes}, pipe_lowat_{0}, pipe_hiwat_{0}; // 新しいパイプの設定
+        std::optional<PipeStat> last_pipe_stat_{}; // 直前のパイプラインの最初のパイプの統計
 };
 
 void TaskTerminal(uint64_t task_id, int64_t data);
@@ -75,24 +81,10 @@ class TerminalFileDescriptor: public FileDescriptor{
         size_t Write(const void* buf, size_t len) override;
         size_t Size() const override {return 0;}
         size_t Load(void* buf, size_t len, size_t offset) override;
+        // キー入力はタスクのメッセージボックスに届くので、メッセージボックスの状態を返す
+        uint32_t PollEvents() override;
+        PollNotifier* Notifier() override;
 
     private:
         Terminal& term_;
 };
-
-class PipeDescriptor : public FileDescriptor{
-    public:
-        explicit PipeDescriptor(Task& task);
-        size_t Read(void* buf, size_t len) override;
-        size_t Write(const void* buf, size_t len) override;
-        size_t Size() const override { return 0;}
-        size_t Load(void* buf, size_t len, size_t offset) override {return 0;}
-
-        void FinishWrite();
-        
-    private:
-        Task& task;
-        char data_[16];
-        size_t len_{0};
-        bool closed_{false};
-}
\ No newline at end of file
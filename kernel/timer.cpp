@@ -1,8 +1,11 @@
 #include "timer.hpp"
 
 #include "acpi.hpp"
+#include "asmfunc.h"
 #include "interrupt.hpp"
+#include "spinlock.hpp"
 #include "task.hpp"
+#include "trace.hpp"
 
 namespace{
     const uint32_t kCountMax = 0xffffffffu;
@@ -18,12 +21,15 @@ void InitializeLAPICTimer(){
     divide_config = 0b1011;
     lvt_timer = 0b001 << 16;
 
+    const uint64_t tsc_start = ReadTSC();
     StartLAPICTimer();
     acpi::WaitMilliseconds(100);
     const auto elapsed = LAPICTimerElapsed();
     StopLAPICTimer();
+    const uint64_t tsc_elapsed = ReadTSC() - tsc_start;
 
     lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    tsc_freq = tsc_elapsed * 10;
 
     divide_config = 0b1011;
     lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;
@@ -45,44 +51,177 @@ void StopLAPICTimer(){
 Timer::Timer(unsigned long timeout, int value, uint64_t task_id): timeout_{timeout}, value_{value}, task_id_{task_id}{
 }
 
+namespace{
+    template <class Link>
+    void LinkTail(Link& list, Link* link){
+        link->prev = list.prev;
+        link->next = &list;
+        list.prev->next = link;
+        list.prev = link;
+    }
+
+    template <class Link>
+    void Unlink(Link* link){
+        link->prev->next = link->next;
+        link->next->prev = link->prev;
+        link->prev = link->next = link;
+    }
+
+    // srcの要素を全てdstの末尾へ移す
+    template <class Link>
+    void SpliceTail(Link& dst, Link& src){
+        if (src.Empty()){
+            return;
+        }
+        src.next->prev = dst.prev;
+        dst.prev->next = src.next;
+        src.prev->next = &dst;
+        dst.prev = src.prev;
+        src.prev = src.next = &src;
+    }
+}
+
 TimerManager::TimerManager() {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+    for (auto& node : nodes_){
+        LinkTail<TimerLink>(free_, &node);
+    }
+}
+
+WithError<TimerHandle> TimerManager::AddTimer(const Timer& timer){
+    SpinLockGuard guard{lock_};
+    if (free_.Empty()){
+        return {kNullTimerHandle, MAKE_ERROR(Error::kFull)};
+    }
+
+    auto node = static_cast<TimerNode*>(free_.next);
+    Unlink<TimerLink>(node);
+    node->timer = timer;
+    node->active = true;
+    Enqueue(node);
+
+    const uint64_t index = node - &nodes_[0];
+    return {(static_cast<uint64_t>(node->generation) << 32) | (index + 1), MAKE_ERROR(Error::kSuccess)};
+}
+
+Error TimerManager::CancelTimer(TimerHandle handle, uint64_t task_id){
+    SpinLockGuard guard{lock_};
+    auto node = FindNode(handle);
+    if (node == nullptr || (task_id != 0 && node->timer.TaskID() != task_id)){
+        return MAKE_ERROR(Error::kNoSuchTimer);
+    }
+
+    Unlink<TimerLink>(node);
+    FreeNode(node);
+    return MAKE_ERROR(Error::kSuccess);
 }
 
-void TimerManager::AddTimer(const Timer& timer){
-    timers_.push(timer);
+void TimerManager::StartTaskTimer(){
+    SpinLockGuard guard{lock_};
+    task_timer_deadline_ = tick_ + kTaskTimerPeriod;
 }
 
 bool TimerManager::Tick(){
+    SpinLockGuard guard{lock_};
     ++tick_;
+    Trace(TraceType::kTimerTick, tick_);
 
     bool task_timer_timeout = false;
-    while (true){
-        const auto& t = timers_.top();
-        if (t.Timeout() > tick_){
-            break;
-        }
+    if (tick_ >= task_timer_deadline_){
+        task_timer_timeout = true;
+        task_timer_deadline_ = tick_ + kTaskTimerPeriod;
+    }
 
-        if (t.Value() == kTaskTimerValue){
-            task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
-            continue;
-        }
+    Cascade();
+    SpliceTail(expired_, wheel_[0][tick_ & (kWheelSlots - 1)]);
+
+    // 1つのスロットに満了タイマーが集中しても割り込み処理が長引かないよう、
+    // 上限を超えた分はexpired_に残して次のティックへ回す
+    for (int i = 0; i < kMaxExpiresPerTick && !expired_.Empty(); ++i){
+        auto node = static_cast<TimerNode*>(expired_.next);
+        Unlink<TimerLink>(node);
 
         Message m{Message::kTimerTimeout};
-        m.arg.timer.timeout = t.Timeout();
-        m.arg.timer.value = t.Value();
-        task_manager->SendMessage(t.TaskID(), m);
+        m.arg.timer.timeout = node->timer.Timeout();
+        m.arg.timer.value = node->timer.Value();
+        const auto task_id = node->timer.TaskID();
+        FreeNode(node);
 
-        timers_.pop();
+        if (m.arg.timer.value == Timer::kWakeupValue){
+            task_manager->Wakeup(task_id);
+            continue;
+        }
+        task_manager->SendMessage(task_id, m);
     }
 
     return task_timer_timeout;
 }
 
+void TimerManager::Enqueue(TimerNode* node){
+    const unsigned long timeout = node->timer.Timeout();
+    if (timeout <= tick_){
+        LinkTail<TimerLink>(expired_, node);
+        return;
+    }
+
+    // レベルnのスロットは64^nティック分の幅を持ち、
+    // 下位レベルが一周するたびに1スロットずつ下位レベルへ再配置される
+    const unsigned long delta = timeout - tick_;
+    for (int level = 0; level < kWheelLevels; ++level){
+        if (delta < (1ul << (kWheelBits * (level + 1)))){
+            const auto slot = (timeout >> (kWheelBits * level)) & (kWheelSlots - 1);
+            LinkTail<TimerLink>(wheel_[level][slot], node);
+            return;
+        }
+    }
+    LinkTail<TimerLink>(overflow_, node);
+}
+
+void TimerManager::Requeue(TimerLink& list){
+    TimerLink pending{};
+    SpliceTail(pending, list);
+    while (!pending.Empty()){
+        auto node = static_cast<TimerNode*>(pending.next);
+        Unlink<TimerLink>(node);
+        Enqueue(node);
+    }
+}
+
+void TimerManager::Cascade(){
+    for (int level = 1; level < kWheelLevels; ++level){
+        const int shift = kWheelBits * level;
+        if ((tick_ & ((1ul << shift) - 1)) != 0){
+            return;
+        }
+        Requeue(wheel_[level][(tick_ >> shift) & (kWheelSlots - 1)]);
+    }
+
+    if ((tick_ & ((1ul << (kWheelBits * kWheelLevels)) - 1)) == 0){
+        Requeue(overflow_);
+    }
+}
+
+void TimerManager::FreeNode(TimerNode* node){
+    node->active = false;
+    ++node->generation;
+    LinkTail<TimerLink>(free_, node);
+}
+
+TimerManager::TimerNode* TimerManager::FindNode(TimerHandle handle){
+    const uint64_t index = (handle & 0xffffffffu) - 1;
+    if (handle == kNullTimerHandle || index >= kMaxTimers){
+        return nullptr;
+    }
+
+    auto& node = nodes_[index];
+    if (!node.active || node.generation != (handle >> 32)){
+        return nullptr;
+    }
+    return &node;
+}
+
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
 
 extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack){
     const bool task_timer_timeout = timer_manager->Tick();
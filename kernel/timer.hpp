@@ -1,10 +1,11 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
-#include <vector>
 #include <limits>
+#include "error.hpp"
 #include "message.hpp"
+#include "spinlock.hpp"
 
 void InitializeLAPICTimer();
 void StartLAPICTimer();
@@ -13,6 +14,9 @@ void StopLAPICTimer();
 
 class Timer{
     public:
+        // この値のタイマーは満了時にメッセージを送らず、タスクを起床させるだけ
+        static const int kWakeupValue = std::numeric_limits<int>::min();
+
         Timer(unsigned long timeout, int value, uint64_t task_id);
         unsigned long Timeout() const {return timeout_;}
         int Value() const {return value_; }
@@ -24,26 +28,67 @@ class Timer{
         uint64_t task_id_;
 };
 
-// タイマー優先度。タイムアウトが近いほど優先度高
-inline bool operator<(const Timer& lhs, const Timer& rhs){
-    return lhs.Timeout() > rhs.Timeout();
-}
+// AddTimerが返すタイマーの識別子。上位32ビット: 世代番号、下位32ビット: ノード番号+1
+using TimerHandle = uint64_t;
+const TimerHandle kNullTimerHandle = 0;
 
+// 階層型タイミングホイールによるタイマー管理
+// 追加と取り消しはO(1)。1ティックで処理する満了タイマー数には上限があり、
+// 処理しきれなかったタイマーは満了待ちリストに残って次のティックで処理される
+// 各操作は内部でロックを取るので、呼び出し側で割り込みを禁止する必要はない
 class TimerManager{
     public:
+        static const int kWheelBits = 6;
+        static const int kWheelSlots = 1 << kWheelBits;
+        static const int kWheelLevels = 4; // 64^4ティック（100Hzで約46時間）まではホイールで管理
+        static const size_t kMaxTimers = 1024;
+        static const int kMaxExpiresPerTick = 32;
+
         TimerManager();
-        void AddTimer(const Timer& timer);
+        TimerManager(const TimerManager&) = delete;
+        TimerManager& operator=(const TimerManager&) = delete;
+
+        WithError<TimerHandle> AddTimer(const Timer& timer);
+        // タイマーを取り消す。task_idに0以外を指定すると、そのタスクのタイマーのみ取り消せる
+        Error CancelTimer(TimerHandle handle, uint64_t task_id = 0);
+        // タスク切り替え用のタイマーを開始する
+        void StartTaskTimer();
         bool Tick();
         unsigned int CurrentTick() const {return tick_;}
 
     private:
+        struct TimerLink{
+            TimerLink* prev{this};
+            TimerLink* next{this};
+            bool Empty() const {return next == this;}
+        };
+
+        struct TimerNode : TimerLink{
+            Timer timer{0, 0, 0};
+            uint32_t generation{0};
+            bool active{false};
+        };
+
+        SpinLock lock_{};
         volatile unsigned long tick_{0};
-        std::priority_queue<Timer> timers_{};
+        unsigned long task_timer_deadline_{std::numeric_limits<unsigned long>::max()};
+
+        std::array<std::array<TimerLink, kWheelSlots>, kWheelLevels> wheel_{};
+        TimerLink overflow_{}; // ホイールの範囲を超える遠い未来のタイマー
+        TimerLink expired_{}; // 満了したが未処理のタイマー
+        TimerLink free_{};
+        std::array<TimerNode, kMaxTimers> nodes_{};
+
+        void Enqueue(TimerNode* node);
+        void Requeue(TimerLink& list);
+        void Cascade();
+        void FreeNode(TimerNode* node);
+        TimerNode* FindNode(TimerHandle handle);
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
+extern unsigned long tsc_freq; // InitializeLAPICTimerで計測したTSCの周波数
 const int kTimerFreq = 100;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::max();
\ No newline at end of file
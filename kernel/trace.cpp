@@ -0,0 +1,102 @@
+#include "trace.hpp"
+
+#include "asmfunc.h"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace{
+    const char* TraceName(TraceType type){
+        switch (type){
+            case TraceType::kSwitchTask: return "switch";
+            case TraceType::kSleep: return "sleep";
+            case TraceType::kWakeup: return "wakeup";
+            case TraceType::kTimerTick: return "tick";
+            case TraceType::kPageFaultBegin:
+            case TraceType::kPageFaultEnd: return "page_fault";
+            case TraceType::kSyscallBegin:
+            case TraceType::kSyscallEnd: return "syscall";
+            case TraceType::kDrawBegin:
+            case TraceType::kDrawEnd: return "draw";
+        }
+        return "unknown";
+    }
+
+    // Chrome trace形式のフェーズ。B/Eで期間、iで瞬間のイベントを表す
+    char TracePhase(TraceType type){
+        switch (type){
+            case TraceType::kPageFaultBegin:
+            case TraceType::kSyscallBegin:
+            case TraceType::kDrawBegin: return 'B';
+            case TraceType::kPageFaultEnd:
+            case TraceType::kSyscallEnd:
+            case TraceType::kDrawEnd: return 'E';
+            default: return 'i';
+        }
+    }
+
+    struct TraceFileHeader{
+        char magic[8]; // "MIKANTRC"
+        uint32_t version;
+        uint32_t record_bytes;
+        uint64_t tsc_freq;
+        uint64_t num_records;
+    };
+
+    // 出力中に記録されないよう、トレースを一時的に止める
+    bool PauseTrace(){
+        return trace_enabled.exchange(false);
+    }
+}
+
+void TraceBuffer::Record(TraceType type, uint64_t arg){
+    const uint64_t pos = head_.fetch_add(1, std::memory_order_relaxed);
+    TraceRecord& r = records_[pos % kNumRecords];
+    r.seq = 0;
+    std::atomic_signal_fence(std::memory_order_release);
+    r.tsc = ReadTSC();
+    r.task_id = task_manager ? task_manager->CurrentTask().ID() : 0;
+    r.arg = arg;
+    r.type = type;
+    std::atomic_signal_fence(std::memory_order_release);
+    r.seq = pos + 1;
+}
+
+TraceBuffer* trace_buffer;
+std::atomic<bool> trace_enabled{false};
+
+void InitializeTrace(){
+    trace_buffer = new TraceBuffer;
+}
+
+void DumpTraceJSON(FileDescriptor& fd){
+    const bool enabled = PauseTrace();
+    const uint64_t tsc_per_us = tsc_freq / 1000000 ? tsc_freq / 1000000 : 1;
+
+    PrintToFD(fd, "{\"traceEvents\":[\n");
+    bool first = true;
+    trace_buffer->ForEach([&](const TraceRecord& r){
+        const uint64_t ts_ns = r.tsc % tsc_per_us * 1000 / tsc_per_us;
+        PrintToFD(fd, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu.%03lu,\"pid\":0,\"tid\":%lu,\"args\":{\"arg\":%lu}}",
+                  first ? "" : ",\n", TraceName(r.type), TracePhase(r.type),
+                  r.tsc / tsc_per_us, ts_ns, r.task_id, r.arg);
+        first = false;
+    });
+    PrintToFD(fd, "\n]}\n");
+
+    trace_enabled.store(enabled);
+}
+
+void DumpTraceBinary(FileDescriptor& fd){
+    const bool enabled = PauseTrace();
+
+    uint64_t num_records = 0;
+    trace_buffer->ForEach([&](const TraceRecord&){ ++num_records; });
+
+    TraceFileHeader header{{'M', 'I', 'K', 'A', 'N', 'T', 'R', 'C'}, 1, sizeof(TraceRecord), tsc_freq, num_records};
+    fd.Write(&header, sizeof(header));
+    trace_buffer->ForEach([&](const TraceRecord& r){
+        fd.Write(&r, sizeof(r));
+    });
+
+    trace_enabled.store(enabled);
+}
@@ -0,0 +1,72 @@
+// スケジューラや割り込みのイベントを記録するトレースバッファ
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "file.hpp"
+
+enum class TraceType : uint32_t{
+    kSwitchTask, // arg: 切り替え先のタスクID
+    kSleep, // arg: スリープしたタスクID
+    kWakeup, // arg: 起床したタスクID
+    kTimerTick, // arg: ティック数
+    kPageFaultBegin, // arg: フォルトしたアドレス
+    kPageFaultEnd,
+    kSyscallBegin, // arg: システムコール番号
+    kSyscallEnd,
+    kDrawBegin, // arg: レイヤーID（0は画面全体）
+    kDrawEnd,
+};
+
+struct TraceRecord{
+    uint64_t seq; // 書き込み完了後に 書き込み位置+1 となる
+    uint64_t tsc;
+    uint64_t task_id;
+    uint64_t arg;
+    TraceType type;
+};
+
+// 固定長のリングバッファ。古い記録から上書きされる
+// 書き込み位置をアトミックに予約するため、割り込みハンドラからもロックなしで記録できる
+class TraceBuffer{
+    public:
+        static const size_t kNumRecords = 8192;
+
+        void Record(TraceType type, uint64_t arg);
+        // 記録済みのものを古い順にfに渡す。書き込み途中の記録は飛ばす
+        template <class F>
+        void ForEach(F f) const{
+            const uint64_t end = head_.load(std::memory_order_acquire);
+            const uint64_t begin = end > kNumRecords ? end - kNumRecords : 0;
+            for (uint64_t i=begin; i<end; ++i){
+                const TraceRecord& r = records_[i % kNumRecords];
+                if (r.seq == i+1){
+                    f(r);
+                }
+            }
+        }
+        uint64_t Count() const {return head_.load(std::memory_order_relaxed);}
+        void Clear() {head_.store(0, std::memory_order_relaxed);}
+
+    private:
+        std::atomic<uint64_t> head_{0};
+        TraceRecord records_[kNumRecords];
+};
+
+// カーネルは単一のCPUで動作するため、トレースバッファも1つ
+extern TraceBuffer* trace_buffer;
+extern std::atomic<bool> trace_enabled;
+
+inline void Trace(TraceType type, uint64_t arg = 0){
+    if (trace_enabled.load(std::memory_order_relaxed)){
+        trace_buffer->Record(type, arg);
+    }
+}
+
+void InitializeTrace();
+// Chrome trace形式（Perfettoでも読める）のJSONで出力する
+void DumpTraceJSON(FileDescriptor& fd);
+// ヘッダとTraceRecordの配列をそのまま出力する
+void DumpTraceBinary(FileDescriptor& fd);
@@ -0,0 +1,140 @@
+#include "virtio_blk.hpp"
+
+#include <cstring>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+    // レガシーインターフェースのレジスタ（BAR0のI/Oポートからのオフセット）
+    const uint16_t kHostFeatures = 0x00;
+    const uint16_t kGuestFeatures = 0x04;
+    const uint16_t kQueueAddress = 0x08;
+    const uint16_t kQueueSize = 0x0c;
+    const uint16_t kQueueSelect = 0x0e;
+    const uint16_t kQueueNotify = 0x10;
+    const uint16_t kDeviceStatus = 0x12;
+    const uint16_t kISRStatus = 0x13;
+    const uint16_t kDeviceConfig = 0x14; // MSI-Xを使わない場合。virtio-blkでは先頭が容量（セクタ数）
+
+    const uint8_t kStatusAcknowledge = 1;
+    const uint8_t kStatusDriver = 2;
+    const uint8_t kStatusDriverOK = 4;
+    const uint8_t kStatusFailed = 128;
+
+    const uint16_t kDescNext = 1;
+    const uint16_t kDescWrite = 2; // デバイスが書き込む
+
+    const uint32_t kRequestIn = 0;
+    const uint32_t kRequestOut = 1;
+
+    uint64_t AlignPage(uint64_t n){
+        return (n + kBytesPerFrame - 1) / kBytesPerFrame * kBytesPerFrame;
+    }
+}
+
+std::unique_ptr<VirtioBlock> VirtioBlock::Probe(pci::Device& dev){
+    if (pci::ReadVendorId(dev) != kVendorID ||
+        pci::ReadDeviceId(dev.bus, dev.device, dev.function) != kDeviceID){
+        return nullptr;
+    }
+
+    auto [bar, err] = pci::ReadBar(dev, 0);
+    if (err || (bar & 1) == 0){
+        Log(kError, "virtio-blk %d.%d.%d: BAR0 is not an I/O port\n", dev.bus, dev.device, dev.function);
+        return nullptr;
+    }
+    // コマンドレジスタでI/O空間とバスマスタを有効にする
+    pci::WriteConfReg(dev, 0x04, pci::ReadConfReg(dev, 0x04) | 0x05);
+
+    std::unique_ptr<VirtioBlock> blk{new VirtioBlock{static_cast<uint16_t>(bar & ~0x3u)}};
+    if (auto err = blk->Initialize()){
+        Log(kError, "virtio-blk %d.%d.%d: %s\n", dev.bus, dev.device, dev.function, err.Name());
+        IoOut8(blk->io_base_ + kDeviceStatus, kStatusFailed);
+        return nullptr;
+    }
+    return blk;
+}
+
+Error VirtioBlock::Read(uint64_t sector, void* buf, size_t num_sectors){
+    return Request(kRequestIn, sector, buf, num_sectors);
+}
+
+Error VirtioBlock::Write(uint64_t sector, const void* buf, size_t num_sectors){
+    return Request(kRequestOut, sector, const_cast<void*>(buf), num_sectors);
+}
+
+Error VirtioBlock::Initialize(){
+    IoOut8(io_base_ + kDeviceStatus, 0); // リセット
+    IoOut8(io_base_ + kDeviceStatus, kStatusAcknowledge);
+    IoOut8(io_base_ + kDeviceStatus, kStatusAcknowledge | kStatusDriver);
+    IoIn32(io_base_ + kHostFeatures);
+    IoOut32(io_base_ + kGuestFeatures, 0); // 追加の機能は使わない
+
+    IoOut16(io_base_ + kQueueSelect, 0);
+    queue_size_ = IoIn16(io_base_ + kQueueSize);
+    if (queue_size_ == 0){
+        return MAKE_ERROR(Error::kUnknownDevice);
+    }
+
+    const uint64_t avail_offset = sizeof(Descriptor) * queue_size_;
+    const uint64_t used_offset = AlignPage(avail_offset + sizeof(uint16_t) * (3 + queue_size_));
+    const uint64_t queue_bytes = used_offset + AlignPage(sizeof(uint16_t) * 3 + 8 * queue_size_);
+    // 要求のヘッダと状態のために1フレーム余分に確保する
+    const size_t num_frames = queue_bytes / kBytesPerFrame + 1;
+    auto [frame, err] = memory_manager->Allocate(num_frames);
+    if (err){
+        return err;
+    }
+    auto queue = reinterpret_cast<uint8_t*>(frame.Frame());
+    memset(queue, 0, num_frames * kBytesPerFrame);
+
+    desc_ = reinterpret_cast<Descriptor*>(queue);
+    avail_ = reinterpret_cast<volatile uint16_t*>(queue + avail_offset);
+    used_ = reinterpret_cast<volatile uint16_t*>(queue + used_offset);
+    header_ = reinterpret_cast<RequestHeader*>(queue + queue_bytes);
+    status_ = reinterpret_cast<volatile uint8_t*>(queue + queue_bytes + sizeof(RequestHeader));
+    IoOut32(io_base_ + kQueueAddress, reinterpret_cast<uint64_t>(queue) / kBytesPerFrame);
+
+    capacity_ = IoIn32(io_base_ + kDeviceConfig) |
+        static_cast<uint64_t>(IoIn32(io_base_ + kDeviceConfig + 4)) << 32;
+    IoOut8(io_base_ + kDeviceStatus, kStatusAcknowledge | kStatusDriver | kStatusDriverOK);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error VirtioBlock::Request(uint32_t type, uint64_t sector, void* buf, size_t num_sectors){
+    if (sector + num_sectors > capacity_){
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    SpinLockGuard lock{lock_};
+    header_->type = type;
+    header_->reserved = 0;
+    header_->sector = sector;
+    *status_ = 0xff;
+
+    // ヘッダ、データ、状態の3つのディスクリプタをつなげて1つの要求にする
+    desc_[0] = {reinterpret_cast<uint64_t>(header_), sizeof(RequestHeader), kDescNext, 1};
+    desc_[1] = {reinterpret_cast<uint64_t>(buf), static_cast<uint32_t>(num_sectors * kSectorBytes),
+                static_cast<uint16_t>(kDescNext | (type == kRequestIn ? kDescWrite : 0)), 2};
+    desc_[2] = {reinterpret_cast<uint64_t>(status_), 1, kDescWrite, 0};
+
+    const uint16_t avail_idx = avail_[1];
+    avail_[2 + avail_idx % queue_size_] = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    avail_[1] = avail_idx + 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    IoOut16(io_base_ + kQueueNotify, 0);
+
+    while (used_[1] == last_used_){
+        __asm__ volatile("pause");
+    }
+    ++last_used_;
+    IoIn8(io_base_ + kISRStatus); // 割り込みは使わないが、状態を読んで落としておく
+
+    if (*status_ != 0){
+        return MAKE_ERROR(Error::kTransferFailed);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
@@ -0,0 +1,59 @@
+// virtioのブロックデバイス（virtio-blk）のドライバ
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "block.hpp"
+#include "pci.hpp"
+#include "spinlock.hpp"
+
+// PCIのレガシーインターフェース（I/Oポートのレジスタ）で操作するvirtio-blk
+// 割り込みは使わず、要求ごとに完了をポーリングする。ページフォールトの処理中からも呼び出せる
+class VirtioBlock : public BlockDevice{
+    public:
+        static const uint16_t kVendorID = 0x1af4;
+        static const uint16_t kDeviceID = 0x1001; // transitionalなvirtio-blk
+
+        // devがvirtio-blkなら初期化して返す。違うか初期化に失敗すればnullptr
+        static std::unique_ptr<VirtioBlock> Probe(pci::Device& dev);
+
+        uint64_t NumSectors() const override {return capacity_;}
+        Error Read(uint64_t sector, void* buf, size_t num_sectors) override;
+        Error Write(uint64_t sector, const void* buf, size_t num_sectors) override;
+
+    private:
+        struct Descriptor{
+            uint64_t addr;
+            uint32_t len;
+            uint16_t flags;
+            uint16_t next;
+        } __attribute__((packed));
+
+        struct RequestHeader{
+            uint32_t type;
+            uint32_t reserved;
+            uint64_t sector;
+        } __attribute__((packed));
+
+        uint16_t io_base_;
+        uint64_t capacity_{0}; // セクタ数
+        SpinLock lock_{};
+
+        // 仮想キュー（レガシーの配置: ディスクリプタ表と利用可能リングの後、ページ境界から使用済みリング）
+        uint16_t queue_size_{0};
+        Descriptor* desc_{nullptr};
+        volatile uint16_t* avail_{nullptr}; // flags, idx, ring[queue_size_]
+        volatile uint16_t* used_{nullptr}; // flags, idx, {id, len}[queue_size_]
+        uint16_t last_used_{0};
+
+        // 1つの要求のヘッダと状態。要求は1つずつ処理するので1組で足りる
+        RequestHeader* header_{nullptr};
+        volatile uint8_t* status_{nullptr};
+
+        explicit VirtioBlock(uint16_t io_base) : io_base_{io_base} {}
+        Error Initialize();
+        Error Request(uint32_t type, uint64_t sector, void* buf, size_t num_sectors);
+};
@@ -0,0 +1,156 @@
+#include "worker_pool.hpp"
+
+#include "logger.hpp"
+#include "message.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+void TaskWorker(uint64_t task_id, int64_t data){
+    auto pool = reinterpret_cast<WorkerPool*>(data);
+    Task& task = task_manager->CurrentTask();
+    int self = 0;
+    while (pool->workers_[self] != &task){
+        ++self;
+    }
+
+    while (true){
+        const auto msg = task.WaitMessage();
+        switch (msg.type){
+            case Message::kWork:
+                msg.arg.work.func(msg.arg.work.data);
+                pool->done_[self].fetch_add(1, std::memory_order_release);
+                pool->WakeupFlushWaiters();
+                break;
+            case Message::kTimerTimeout: {
+                // 遅延実行のワーク。タイマーの値がdelayed_の添字
+                const auto work = [&]{
+                    SpinLockGuard guard{pool->delayed_lock_};
+                    return pool->delayed_[msg.arg.timer.value];
+                }();
+                work.func(work.data);
+                {
+                    // 実行し終えてから枠を空けるので、Flushは実行中のワークも待つ
+                    SpinLockGuard guard{pool->delayed_lock_};
+                    pool->delayed_[msg.arg.timer.value].used = false;
+                }
+                pool->WakeupFlushWaiters();
+                break;
+            }
+            default:
+                Log(kError, "worker %lu: unknown message type: %d\n", task_id, msg.type);
+        }
+    }
+}
+
+WorkerPool::WorkerPool(){
+    for (int i=0; i<kNumWorkers; ++i){
+        auto [task, err] = task_manager->NewTask().InitContext(TaskWorker, reinterpret_cast<int64_t>(this));
+        if (err){
+            Log(kError, "failed to create worker %d: %s\n", i, err.Name());
+            task_manager->DiscardTask(task);
+            while (true) __asm__("hlt");
+        }
+        workers_[i] = &task;
+        task_manager->Wakeup(&task, kWorkerLevel);
+    }
+}
+
+Error WorkerPool::Queue(WorkFunc* func, uint64_t data){
+    // 未処理のワークが最も少ないワーカーを、前回の次から順に探す
+    const unsigned int start = next_worker_.fetch_add(1, std::memory_order_relaxed);
+    int worker = start % kNumWorkers;
+    for (int i=1; i<kNumWorkers; ++i){
+        const int w = (start + i) % kNumWorkers;
+        if (workers_[w]->Mailbox().queued < workers_[worker]->Mailbox().queued){
+            worker = w;
+        }
+    }
+    return QueueOn(worker, func, data);
+}
+
+Error WorkerPool::QueueOn(int worker, WorkFunc* func, uint64_t data){
+    if (worker < 0 || kNumWorkers <= worker){
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    Message msg{Message::kWork};
+    msg.arg.work.func = func;
+    msg.arg.work.data = data;
+
+    // 送れたワークだけを数える。QueueOnから戻る前に数えるので、Flushより前に依頼したワークは必ず含まれる
+    if (auto err = workers_[worker]->SendMessage(msg)){
+        return err;
+    }
+    sent_[worker].fetch_add(1, std::memory_order_relaxed);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error WorkerPool::QueueDelayed(WorkFunc* func, uint64_t data, unsigned long ticks){
+    SpinLockGuard guard{delayed_lock_};
+    int slot = 0;
+    while (slot < kMaxDelayedWorks && delayed_[slot].used){
+        ++slot;
+    }
+    if (slot == kMaxDelayedWorks){
+        return MAKE_ERROR(Error::kFull);
+    }
+
+    const unsigned int start = next_worker_.fetch_add(1, std::memory_order_relaxed);
+    const Timer timer{timer_manager->CurrentTick() + ticks, slot, workers_[start % kNumWorkers]->ID()};
+    if (auto [handle, err] = timer_manager->AddTimer(timer); err){
+        return err;
+    }
+    delayed_[slot] = {func, data, delayed_seq_++, true};
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void WorkerPool::Flush(){
+    std::array<uint64_t, kNumWorkers> target;
+    for (int i=0; i<kNumWorkers; ++i){
+        target[i] = sent_[i].load(std::memory_order_acquire);
+    }
+    const uint64_t delayed_target = [&]{
+        SpinLockGuard guard{delayed_lock_};
+        return delayed_seq_;
+    }();
+    Task& task = task_manager->CurrentTask();
+
+    while (true){
+        InterruptGuard guard;
+        bool pending = DelayedPending(delayed_target);
+        for (int i=0; i<kNumWorkers && !pending; ++i){
+            pending = done_[i].load(std::memory_order_acquire) < target[i];
+        }
+        if (!pending){
+            return;
+        }
+        flush_waiters_.push_back(&task);
+        task.Sleep();
+    }
+}
+
+bool WorkerPool::DelayedPending(uint64_t seq){
+    SpinLockGuard guard{delayed_lock_};
+    for (const auto& d : delayed_){
+        if (d.used && d.seq < seq){
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkerPool::WakeupFlushWaiters(){
+    // 待っているタスクを全て起こし、それぞれ自分の待ち条件を確認させる
+    InterruptGuard guard;
+    for (Task* waiter : flush_waiters_){
+        task_manager->Wakeup(waiter);
+    }
+    flush_waiters_.clear();
+}
+
+WorkerPool* worker_pool;
+
+void InitializeWorkerPool(){
+    worker_pool = new WorkerPool;
+}
@@ -0,0 +1,65 @@
+// 遅延実行する処理のためのカーネルワーカータスク群
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "error.hpp"
+#include "spinlock.hpp"
+
+class Task;
+
+using WorkFunc = void(uint64_t data);
+
+// 依頼された処理（ワーク）をワーカータスクで実行する
+// ワークはワーカーのメッセージボックスへ送られるので、割り込みハンドラからも依頼できる
+class WorkerPool{
+    public:
+        static const int kNumWorkers = 2;
+        static const int kWorkerLevel = 3; // メインタスクと同じレベルで交互に動く
+        static const size_t kMaxDelayedWorks = 64;
+
+        WorkerPool();
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        // 空いているワーカーで実行する
+        Error Queue(WorkFunc* func, uint64_t data);
+        // 指定したワーカーで実行する。同じワーカーに依頼したワークは依頼順に1つずつ実行される
+        Error QueueOn(int worker, WorkFunc* func, uint64_t data);
+        // ticks後に実行する
+        Error QueueDelayed(WorkFunc* func, uint64_t data, unsigned long ticks);
+        // 呼び出し時点までに依頼されたワーク（遅延実行のものを含む）が全て終わるまで待つ
+        // ワーカー自身から呼び出してはならない
+        void Flush();
+
+    private:
+        struct DelayedWork{
+            WorkFunc* func;
+            uint64_t data;
+            uint64_t seq; // 依頼順の通し番号
+            bool used; // 実行が終わるまで立てておく
+        };
+
+        std::array<Task*, kNumWorkers> workers_{};
+        std::atomic<unsigned int> next_worker_{0};
+        // ワーカーごとに、送ったワークと終わったワークの数
+        // メッセージボックスは順に処理されるので、done_[w]がn以上ならwに送った先頭n個のワークは終わっている
+        std::array<std::atomic<uint64_t>, kNumWorkers> sent_{}, done_{};
+        SpinLock delayed_lock_{}; // delayed_とdelayed_seq_を保護する
+        std::array<DelayedWork, kMaxDelayedWorks> delayed_{};
+        uint64_t delayed_seq_{0};
+        std::vector<Task*> flush_waiters_{};
+
+        friend void TaskWorker(uint64_t task_id, int64_t data);
+        // seq未満の通し番号を持つ遅延実行のワークが残っているか
+        bool DelayedPending(uint64_t seq);
+        void WakeupFlushWaiters();
+};
+
+extern WorkerPool* worker_pool;
+
+void InitializeWorkerPool();